@@ -0,0 +1,775 @@
+#include "win32backend.h"
+
+bool AppBackend::ReadRemoteV(HANDLE hProcess, const remoteiov* pIov,
+    size_t uCount, unsigned& uCalls)
+{
+    uCalls = 0;
+    for (size_t i = 0; i < uCount; i++)
+    {
+        uCalls++;
+        if (!ReadRemote(hProcess, pIov[i].m_pAppMem, pIov[i].m_pThisMem,
+            pIov[i].m_uLen))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool AppBackend::WriteRemoteV(HANDLE hProcess, const remoteiov* pIov,
+    size_t uCount, unsigned& uCalls)
+{
+    uCalls = 0;
+    for (size_t i = 0; i < uCount; i++)
+    {
+        uCalls++;
+        if (!WriteRemote(hProcess, pIov[i].m_pAppMem, pIov[i].m_pThisMem,
+            pIov[i].m_uLen))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef WIN32
+#include "win32ctrl.h"
+#include "win32util.h"
+#include <memory>
+#include <strsafe.h>
+
+bool Win32Backend::StartProcess(const std::wstring& exePath,
+    const std::wstring& cmdLine, HANDLE& hProcess, DWORD& dwPid,
+    bool& bWow64)
+{
+    auto pszCmdLine = std::make_unique<wchar_t[]>(MAX_CMDLINE);
+    StringCchPrintfW(pszCmdLine.get(), MAX_CMDLINE, L"\"%s\" %s",
+        exePath.c_str(), cmdLine.c_str());
+
+    PROCESS_INFORMATION pi;
+    STARTUPINFOW si;
+
+    ZeroMemory(&pi, sizeof(pi));
+    ZeroMemory(&si, sizeof(si));
+
+    si.cb = sizeof(si);
+    BOOL bCreated = CreateProcessW(exePath.c_str(), pszCmdLine.get(),
+        NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi);
+    if (!bCreated)
+        return false;
+
+    hProcess = pi.hProcess;
+    dwPid = pi.dwProcessId;
+
+    BOOL bIsWow64 = FALSE;
+    bWow64 = IsWow64Process(hProcess, &bIsWow64) && bIsWow64;
+
+    CloseHandle(pi.hThread);
+    return true;
+}
+
+void Win32Backend::CloseProcess(HANDLE hProcess)
+{
+    CloseHandle(hProcess);
+}
+
+bool Win32Backend::TerminateProcess(HANDLE hProcess)
+{
+    return !!::TerminateProcess(hProcess, 0);
+}
+
+DWORD Win32Backend::WaitProcess(HANDLE hProcess, DWORD dwTimeOut)
+{
+    return WaitForSingleObject(hProcess, dwTimeOut);
+}
+
+DWORD Win32Backend::WaitProcessIdle(HANDLE hProcess, DWORD dwTimeOut)
+{
+    return WaitForInputIdle(hProcess, dwTimeOut);
+}
+
+void* Win32Backend::AllocRemote(HANDLE hProcess, size_t uLen)
+{
+    return VirtualAllocEx(hProcess, NULL, uLen,
+        MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+bool Win32Backend::FreeRemote(HANDLE hProcess, void* pAppMem)
+{
+    return !!VirtualFreeEx(hProcess, pAppMem, 0, MEM_RELEASE);
+}
+
+bool Win32Backend::ReadRemote(HANDLE hProcess, const void* pAppMem,
+    void* pThisMem, size_t uLen)
+{
+    SIZE_T szTmp = uLen;
+    return !!ReadProcessMemory(hProcess, pAppMem, pThisMem, uLen, &szTmp);
+}
+
+bool Win32Backend::WriteRemote(HANDLE hProcess, void* pAppMem,
+    const void* pThisMem, size_t uLen)
+{
+    SIZE_T szTmp = uLen;
+    return !!WriteProcessMemory(hProcess, pAppMem, pThisMem, uLen, &szTmp);
+}
+
+static BOOL CALLBACK _EnumBackendWindows(HWND hWnd, LPARAM lParam)
+{
+    return (*(AppBackend::WindowFunc*)lParam)(hWnd);
+}
+
+void Win32Backend::EnumTopWindows(WindowFunc func)
+{
+    EnumWindows(_EnumBackendWindows, (LPARAM)&func);
+}
+
+void Win32Backend::EnumChildren(HWND hWnd, WindowFunc func)
+{
+    EnumChildWindows(hWnd, _EnumBackendWindows, (LPARAM)&func);
+}
+
+DWORD Win32Backend::WindowProcessId(HWND hWnd)
+{
+    DWORD dwPid = 0;
+    GetWindowThreadProcessId(hWnd, &dwPid);
+    return dwPid;
+}
+
+std::string Win32Backend::WindowClass(HWND hWnd)
+{
+    char szClass[64] = {0};
+    GetClassNameA(hWnd, szClass, 64);
+    return std::string(szClass);
+}
+
+HWND Win32Backend::WindowParent(HWND hWnd)
+{
+    HWND hParent = GetAncestor(hWnd, GA_PARENT);
+    return hParent == GetDesktopWindow() ? NULL : hParent;
+}
+
+bool Win32Backend::WindowText(HWND hWnd, std::wstring& text)
+{
+    auto pszText = std::make_unique<wchar_t[]>(MAX_WM_TEXT);
+
+    SetLastError(0);
+    int iLen = GetWindowTextW(hWnd, pszText.get(), MAX_WM_TEXT);
+    if (iLen < 0)
+        return false;
+
+    pszText[iLen] = L'\0';
+    text = pszText.get();
+    return true;
+}
+
+bool Win32Backend::IsUnicodeWindow(HWND hWnd)
+{
+    return !!IsWindowUnicode(hWnd);
+}
+
+HWND Win32Backend::FindChildWindow(HWND hParent,
+    const std::string& wndClass, const std::wstring* wndText)
+{
+    return FindWindowExW(hParent, NULL, TextToWchar(wndClass).c_str(),
+        wndText ? wndText->c_str() : NULL);
+}
+
+LRESULT Win32Backend::SendAppMessage(HWND hWnd, UINT uMsg,
+    WPARAM wParam, LPARAM lParam)
+{
+    return SendMessage(hWnd, uMsg, wParam, lParam);
+}
+
+appmsgresult Win32Backend::SendAppMessageTimeout(HWND hWnd, UINT uMsg,
+    WPARAM wParam, LPARAM lParam, unsigned uTimeOut, DWORD_PTR& dwResult)
+{
+    LRESULT lResult;
+
+    if (IsWindowUnicode(hWnd))
+    {
+        lResult = SendMessageTimeoutW(
+            hWnd, uMsg, wParam, lParam,
+            SMTO_ABORTIFHUNG, uTimeOut,
+            &dwResult);
+    }
+    else
+    {
+        lResult = SendMessageTimeoutA(
+            hWnd, uMsg, wParam, lParam,
+            SMTO_ABORTIFHUNG, uTimeOut,
+            &dwResult);
+    }
+
+    if (lResult)
+        return AppMsgDone;
+    return GetLastError() == ERROR_TIMEOUT ? AppMsgTimeOut : AppMsgFailed;
+}
+
+bool Win32Backend::PostAppMessage(HWND hWnd, UINT uMsg,
+    WPARAM wParam, LPARAM lParam)
+{
+    return !!PostMessageW(hWnd, uMsg, wParam, lParam);
+}
+
+// completions of this thread's SendAppMessageAsync, counted for
+// PumpAppMessages; dwData owns the callback
+static thread_local size_t s_uCompleted = 0;
+
+static VOID CALLBACK OnAppMessageResult(HWND hWnd, UINT uMsg,
+    ULONG_PTR dwData, LRESULT lResult)
+{
+    AppBackend::ResultFunc* func = (AppBackend::ResultFunc*)dwData;
+    s_uCompleted++;
+    (*func)((DWORD_PTR)lResult);
+    delete func;
+}
+
+bool Win32Backend::SendAppMessageAsync(HWND hWnd, UINT uMsg,
+    WPARAM wParam, LPARAM lParam, ResultFunc func)
+{
+    ResultFunc* pFunc = new ResultFunc(std::move(func));
+    BOOL bSent;
+
+    if (IsWindowUnicode(hWnd))
+    {
+        bSent = SendMessageCallbackW(hWnd, uMsg, wParam, lParam,
+            OnAppMessageResult, (ULONG_PTR)pFunc);
+    }
+    else
+    {
+        bSent = SendMessageCallbackA(hWnd, uMsg, wParam, lParam,
+            OnAppMessageResult, (ULONG_PTR)pFunc);
+    }
+
+    if (!bSent)
+    {
+        DWORD dwError = GetLastError();
+        delete pFunc;
+        SetLastError(dwError);
+    }
+    return !!bSent;
+}
+
+size_t Win32Backend::PumpAppMessages(DWORD dwTimeOut)
+{
+    ULONGLONG uStart = GetTickCount64();
+    size_t uBefore = s_uCompleted;
+
+    for (;;)
+    {
+        // the callbacks are called from inside PeekMessage
+        MSG msg;
+        while (PeekMessageW(&msg, NULL, 0, 0, PM_REMOVE))
+        {
+            TranslateMessage(&msg);
+            DispatchMessageW(&msg);
+        }
+        if (s_uCompleted != uBefore)
+            break;
+
+        ULONGLONG uWaited = GetTickCount64() - uStart;
+        if (dwTimeOut != INFINITE && uWaited >= dwTimeOut)
+            break;
+        MsgWaitForMultipleObjectsEx(0, NULL, dwTimeOut == INFINITE
+            ? INFINITE : (DWORD)(dwTimeOut - uWaited),
+            QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+    }
+
+    return s_uCompleted - uBefore;
+}
+
+DWORD Win32Backend::LastError() const
+{
+    return GetLastError();
+}
+
+AppBackend* DefaultAppBackend()
+{
+    static Win32Backend s_Backend;
+    return &s_Backend;
+}
+#else
+#include "win32util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <elf.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+extern char** environ;
+
+static thread_local DWORD s_dwLastError = ERROR_SUCCESS;
+
+// nearest Win32 code, AppException reports those
+static bool Fail(int iErrno)
+{
+    switch (iErrno)
+    {
+    case ENOENT: case ENOTDIR: s_dwLastError = ERROR_FILE_NOT_FOUND; break;
+    case EACCES: case EPERM: s_dwLastError = ERROR_ACCESS_DENIED; break;
+    case ESRCH: case EBADF: s_dwLastError = ERROR_INVALID_HANDLE; break;
+    case EFAULT: s_dwLastError = ERROR_PARTIAL_COPY; break;
+    case ENOMEM: s_dwLastError = ERROR_NOT_ENOUGH_MEMORY; break;
+    case ENOSYS: s_dwLastError = ERROR_NOT_SUPPORTED; break;
+    default: s_dwLastError = ERROR_INVALID_PARAMETER; break;
+    }
+    return false;
+}
+
+static int ProcessFd(HANDLE hProcess)
+{
+    return (int)(intptr_t)hProcess;
+}
+
+// Windows command line rules: blanks separate arguments, double quotes
+// group them and \" is a literal quote
+static std::vector<std::string> SplitCommandLine(const std::wstring& cmdLine)
+{
+    std::vector<std::string> args;
+    std::wstring arg;
+    bool bQuoted = false, bArg = false;
+
+    for (size_t i = 0; i < cmdLine.size(); i++)
+    {
+        wchar_t ch = cmdLine[i];
+        if (ch == L'\\' && i + 1 < cmdLine.size() && cmdLine[i+1] == L'"')
+        {
+            arg += L'"';
+            bArg = true;
+            i++;
+        }
+        else if (ch == L'"')
+        {
+            bQuoted = !bQuoted;
+            bArg = true;
+        }
+        else if ((ch == L' ' || ch == L'\t') && !bQuoted)
+        {
+            if (bArg)
+                args.push_back(WcharToText(arg));
+            arg.clear();
+            bArg = false;
+        }
+        else
+        {
+            arg += ch;
+            bArg = true;
+        }
+    }
+
+    if (bArg)
+        args.push_back(WcharToText(arg));
+    return args;
+}
+
+// a 32-bit binary on a 64-bit host is the WOW64 case
+static bool IsElf32(const std::string& path)
+{
+    unsigned char ident[EI_NIDENT] = {0};
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    bool bElf32 = read(fd, ident, EI_NIDENT) == EI_NIDENT
+        && !memcmp(ident, ELFMAG, SELFMAG) && ident[EI_CLASS] == ELFCLASS32;
+    close(fd);
+    return bElf32 && sizeof(void*) == 8;
+}
+
+bool LinuxBackend::StartProcess(const std::wstring& exePath,
+    const std::wstring& cmdLine, HANDLE& hProcess, DWORD& dwPid,
+    bool& bWow64)
+{
+    std::string exe = WcharToText(exePath);
+    std::vector<std::string> args = SplitCommandLine(cmdLine);
+    args.insert(args.begin(), exe);
+
+    std::vector<char*> argv;
+    for (auto& arg : args)
+        argv.push_back((char*)arg.c_str());
+    argv.push_back(NULL);
+
+    pid_t pid;
+    int iError = posix_spawn(&pid, exe.c_str(), NULL, NULL,
+        argv.data(), environ);
+    if (iError)
+        return Fail(iError);
+
+    // the child stays a zombie until CloseProcess reaps it, so the pid
+    // cannot be reused before the pidfd is open
+    int fd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (fd < 0)
+    {
+        int iOpenError = errno;
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return Fail(iOpenError);
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        m_Pids[fd] = pid;
+    }
+
+    hProcess = (HANDLE)(intptr_t)fd;
+    dwPid = (DWORD)pid;
+    bWow64 = IsElf32(exe);
+    return true;
+}
+
+int LinuxBackend::Pid(HANDLE hProcess)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    auto it = m_Pids.find(ProcessFd(hProcess));
+    if (it == m_Pids.end())
+    {
+        Fail(EBADF);
+        return 0;
+    }
+    return it->second;
+}
+
+void LinuxBackend::CloseProcess(HANDLE hProcess)
+{
+    if (!Pid(hProcess))
+        return;
+
+    int fd = ProcessFd(hProcess);
+    bool bKilled;
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        m_Pids.erase(fd);
+        bKilled = m_Killed.erase(fd) != 0;
+    }
+
+    // a killed child dies in a moment, wait for it; one still running
+    // is left to run like on Windows, a thread reaps it when it exits
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    if (bKilled)
+        waitid((idtype_t)P_PIDFD, fd, &info, WEXITED);
+    else if (!waitid((idtype_t)P_PIDFD, fd, &info, WEXITED | WNOHANG)
+        && !info.si_pid)
+    {
+        std::thread([fd]() {
+            siginfo_t info;
+            waitid((idtype_t)P_PIDFD, fd, &info, WEXITED);
+            close(fd);
+        }).detach();
+        return;
+    }
+    close(fd);
+}
+
+bool LinuxBackend::TerminateProcess(HANDLE hProcess)
+{
+    if (!Pid(hProcess))
+        return false;
+    if (syscall(SYS_pidfd_send_signal, ProcessFd(hProcess), SIGKILL,
+        NULL, 0) < 0)
+    {
+        return Fail(errno);
+    }
+
+    std::lock_guard<std::mutex> lock(m_Lock);
+    m_Killed.insert(ProcessFd(hProcess));
+    return true;
+}
+
+DWORD LinuxBackend::WaitProcess(HANDLE hProcess, DWORD dwTimeOut)
+{
+    if (!Pid(hProcess))
+        return WAIT_FAILED;
+
+    // a pidfd polls readable once the process has exited
+    struct pollfd pfd = { ProcessFd(hProcess), POLLIN, 0 };
+    int iReady = poll(&pfd, 1, dwTimeOut == INFINITE ? -1 : (int)dwTimeOut);
+    if (iReady < 0)
+    {
+        Fail(errno);
+        return WAIT_FAILED;
+    }
+    return iReady ? WAIT_OBJECT_0 : WAIT_TIMEOUT;
+}
+
+DWORD LinuxBackend::WaitProcessIdle(HANDLE hProcess, DWORD dwTimeOut)
+{
+    int pid = Pid(hProcess);
+    if (!pid)
+        return WAIT_FAILED;
+
+    char szStat[64];
+    snprintf(szStat, sizeof(szStat), "/proc/%d/stat", pid);
+
+    // two samples in a row, a starting process sleeps on page faults
+    // and the loader too
+    auto deadline = std::chrono::steady_clock::now()
+        + std::chrono::milliseconds(dwTimeOut);
+    int iSleeping = 0;
+    for (;;)
+    {
+        if (WaitProcess(hProcess, 0) != WAIT_TIMEOUT)
+            return WAIT_FAILED;
+
+        char buf[256];
+        int fd = open(szStat, O_RDONLY | O_CLOEXEC);
+        ssize_t lRead = fd < 0 ? -1 : read(fd, buf, sizeof(buf) - 1);
+        if (fd >= 0)
+            close(fd);
+        if (lRead <= 0)
+        {
+            Fail(ESRCH);
+            return WAIT_FAILED;
+        }
+
+        // the state follows the parenthesized command name
+        buf[lRead] = '\0';
+        const char* pszState = strrchr(buf, ')');
+        iSleeping = pszState && pszState[1] == ' ' && pszState[2] == 'S'
+            ? iSleeping + 1 : 0;
+        if (iSleeping == 2)
+            return 0;
+
+        if (dwTimeOut != INFINITE
+            && std::chrono::steady_clock::now() >= deadline)
+        {
+            return WAIT_TIMEOUT;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+void* LinuxBackend::AllocRemote(HANDLE hProcess, size_t uLen)
+{
+    Fail(ENOSYS);
+    return NULL;
+}
+
+bool LinuxBackend::FreeRemote(HANDLE hProcess, void* pAppMem)
+{
+    return Fail(ENOSYS);
+}
+
+// process_vm_readv/writev stop at the first unmapped page and report
+// what was copied so far, anything short of that is retried
+bool LinuxBackend::RemoteCopy(HANDLE hProcess, void* pThisMem,
+    uint64_t uAppMem, size_t uLen, bool bWrite)
+{
+    int pid = Pid(hProcess);
+    if (!pid)
+        return false;
+
+    char* pThis = (char*)pThisMem;
+    while (uLen)
+    {
+        struct iovec local = { pThis, uLen };
+        struct iovec remote = { (void*)(uintptr_t)uAppMem, uLen };
+        ssize_t lDone = bWrite
+            ? process_vm_writev(pid, &local, 1, &remote, 1, 0)
+            : process_vm_readv(pid, &local, 1, &remote, 1, 0);
+        if (lDone < 0 && errno == EINTR)
+            continue;
+        if (lDone < 0)
+            return Fail(errno);
+        if (!lDone)
+            return Fail(EFAULT);
+
+        pThis += lDone;
+        uAppMem += lDone;
+        uLen -= lDone;
+    }
+    return true;
+}
+
+// regions go out IOV_MAX at a time; after a short transfer the rest is
+// done region by region, so the failing one sets the error
+bool LinuxBackend::RemoteCopyV(HANDLE hProcess, const remoteiov* pIov,
+    size_t uCount, unsigned& uCalls, bool bWrite)
+{
+    uCalls = 0;
+    int pid = Pid(hProcess);
+    if (!pid)
+        return false;
+
+    struct iovec local[IOV_MAX], remote[IOV_MAX];
+    while (uCount)
+    {
+        size_t uBatch = std::min<size_t>(uCount, IOV_MAX), uTotal = 0;
+        for (size_t i = 0; i < uBatch; i++)
+        {
+            local[i] = { pIov[i].m_pThisMem, pIov[i].m_uLen };
+            remote[i] = { pIov[i].m_pAppMem, pIov[i].m_uLen };
+            uTotal += pIov[i].m_uLen;
+        }
+
+        ssize_t lDone = bWrite
+            ? process_vm_writev(pid, local, uBatch, remote, uBatch, 0)
+            : process_vm_readv(pid, local, uBatch, remote, uBatch, 0);
+        uCalls++;
+        if (lDone < 0 && errno == EINTR)
+            continue;
+        if (lDone < 0)
+            return Fail(errno);
+
+        if ((size_t)lDone < uTotal)
+        {
+            for (size_t i = 0; i < uBatch; i++)
+            {
+                size_t uLen = pIov[i].m_uLen;
+                if ((size_t)lDone >= uLen)
+                {
+                    lDone -= uLen;
+                    continue;
+                }
+
+                uCalls++;
+                if (!RemoteCopy(hProcess, (char*)pIov[i].m_pThisMem + lDone,
+                    (uint64_t)(uintptr_t)pIov[i].m_pAppMem + lDone,
+                    uLen - lDone, bWrite))
+                {
+                    return false;
+                }
+                lDone = 0;
+            }
+        }
+
+        pIov += uBatch;
+        uCount -= uBatch;
+    }
+    return true;
+}
+
+bool LinuxBackend::ReadRemoteV(HANDLE hProcess, const remoteiov* pIov,
+    size_t uCount, unsigned& uCalls)
+{
+    return RemoteCopyV(hProcess, pIov, uCount, uCalls, false);
+}
+
+bool LinuxBackend::WriteRemoteV(HANDLE hProcess, const remoteiov* pIov,
+    size_t uCount, unsigned& uCalls)
+{
+    return RemoteCopyV(hProcess, pIov, uCount, uCalls, true);
+}
+
+bool LinuxBackend::ReadRemote(HANDLE hProcess, const void* pAppMem,
+    void* pThisMem, size_t uLen)
+{
+    return RemoteCopy(hProcess, pThisMem, (uint64_t)(uintptr_t)pAppMem,
+        uLen, false);
+}
+
+bool LinuxBackend::WriteRemote(HANDLE hProcess, void* pAppMem,
+    const void* pThisMem, size_t uLen)
+{
+    return RemoteCopy(hProcess, (void*)pThisMem,
+        (uint64_t)(uintptr_t)pAppMem, uLen, true);
+}
+
+void LinuxBackend::EnumTopWindows(WindowFunc func)
+{
+}
+
+void LinuxBackend::EnumChildren(HWND hWnd, WindowFunc func)
+{
+}
+
+DWORD LinuxBackend::WindowProcessId(HWND hWnd)
+{
+    return 0;
+}
+
+std::string LinuxBackend::WindowClass(HWND hWnd)
+{
+    return std::string();
+}
+
+HWND LinuxBackend::WindowParent(HWND hWnd)
+{
+    return NULL;
+}
+
+bool LinuxBackend::WindowText(HWND hWnd, std::wstring& text)
+{
+    s_dwLastError = ERROR_INVALID_WINDOW_HANDLE;
+    return false;
+}
+
+bool LinuxBackend::IsUnicodeWindow(HWND hWnd)
+{
+    return true;
+}
+
+HWND LinuxBackend::FindChildWindow(HWND hParent,
+    const std::string& wndClass, const std::wstring* wndText)
+{
+    return NULL;
+}
+
+LRESULT LinuxBackend::SendAppMessage(HWND hWnd, UINT uMsg,
+    WPARAM wParam, LPARAM lParam)
+{
+    s_dwLastError = ERROR_INVALID_WINDOW_HANDLE;
+    return 0;
+}
+
+appmsgresult LinuxBackend::SendAppMessageTimeout(HWND hWnd, UINT uMsg,
+    WPARAM wParam, LPARAM lParam, unsigned uTimeOut, DWORD_PTR& dwResult)
+{
+    s_dwLastError = ERROR_INVALID_WINDOW_HANDLE;
+    return AppMsgFailed;
+}
+
+bool LinuxBackend::PostAppMessage(HWND hWnd, UINT uMsg,
+    WPARAM wParam, LPARAM lParam)
+{
+    s_dwLastError = ERROR_INVALID_WINDOW_HANDLE;
+    return false;
+}
+
+bool LinuxBackend::SendAppMessageAsync(HWND hWnd, UINT uMsg,
+    WPARAM wParam, LPARAM lParam, ResultFunc func)
+{
+    s_dwLastError = ERROR_INVALID_WINDOW_HANDLE;
+    return false;
+}
+
+// nothing can be in flight, nothing to wait for
+size_t LinuxBackend::PumpAppMessages(DWORD dwTimeOut)
+{
+    return 0;
+}
+
+DWORD LinuxBackend::LastError() const
+{
+    return s_dwLastError;
+}
+
+AppBackend* DefaultAppBackend()
+{
+    static LinuxBackend s_Backend;
+    return &s_Backend;
+}
+#endif
@@ -0,0 +1,242 @@
+#ifndef __WIN32BACKEND_H
+#define __WIN32BACKEND_H
+
+#include "win32types.h"
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+
+// TVITEM as laid out in a 32-bit (WOW64) and a 64-bit process
+typedef struct {
+    uint32_t mask;
+    uint32_t hItem;
+    uint32_t state;
+    uint32_t stateMask;
+    uint32_t dwText;
+    int32_t cchTextMax;
+    int32_t iImage;
+    int32_t iSelectedImage;
+    int32_t cChildren;
+    uint32_t lParam;
+} tvitem32_t;
+
+typedef struct {
+    uint32_t mask;
+    uint64_t hItem;
+    uint32_t state;
+    uint32_t stateMask;
+    uint64_t dwText;
+    int32_t cchTextMax;
+    int32_t iImage;
+    int32_t iSelectedImage;
+    int32_t cChildren;
+    uint64_t lParam;
+} tvitem64_t;
+
+// one region of a batched remote read or write
+struct remoteiov {
+    void* m_pThisMem;
+    void* m_pAppMem;
+    size_t m_uLen;
+};
+
+enum appmsgresult {
+    AppMsgDone = 0,
+    AppMsgTimeOut,
+    AppMsgFailed
+};
+
+// Everything AppMonitor needs from the system: the process it drives,
+// that process' memory, its windows and message delivery. Calls mirror
+// the Win32 functions they replace, including their return conventions,
+// and failures leave a Win32 error code for LastError().
+class AppBackend
+{
+public:
+    typedef std::function<bool(HWND)> WindowFunc;
+    typedef std::function<void(DWORD_PTR)> ResultFunc;
+
+    virtual ~AppBackend() {}
+
+    /* process control */
+    virtual bool StartProcess(const std::wstring& exePath,
+        const std::wstring& cmdLine, HANDLE& hProcess, DWORD& dwPid,
+        bool& bWow64) = 0;
+    virtual void CloseProcess(HANDLE hProcess) = 0;
+    virtual bool TerminateProcess(HANDLE hProcess) = 0;
+    // WAIT_OBJECT_0 once the process has exited, WAIT_TIMEOUT before
+    virtual DWORD WaitProcess(HANDLE hProcess, DWORD dwTimeOut) = 0;
+    // 0 once the process waits for input, like WaitForInputIdle
+    virtual DWORD WaitProcessIdle(HANDLE hProcess, DWORD dwTimeOut) = 0;
+
+    /* remote memory */
+    virtual void* AllocRemote(HANDLE hProcess, size_t uLen) = 0;
+    virtual bool FreeRemote(HANDLE hProcess, void* pAppMem) = 0;
+    virtual bool ReadRemote(HANDLE hProcess, const void* pAppMem,
+        void* pThisMem, size_t uLen) = 0;
+    virtual bool WriteRemote(HANDLE hProcess, void* pAppMem,
+        const void* pThisMem, size_t uLen) = 0;
+    // several regions at once, uCalls is how many system calls that
+    // took; by default one ReadRemote/WriteRemote per region
+    virtual bool ReadRemoteV(HANDLE hProcess, const remoteiov* pIov,
+        size_t uCount, unsigned& uCalls);
+    virtual bool WriteRemoteV(HANDLE hProcess, const remoteiov* pIov,
+        size_t uCount, unsigned& uCalls);
+
+    /* windows */
+    virtual void EnumTopWindows(WindowFunc func) = 0;
+    // all descendants of hWnd, like EnumChildWindows
+    virtual void EnumChildren(HWND hWnd, WindowFunc func) = 0;
+    virtual DWORD WindowProcessId(HWND hWnd) = 0;
+    virtual std::string WindowClass(HWND hWnd) = 0;
+    // NULL for top-level windows
+    virtual HWND WindowParent(HWND hWnd) = 0;
+    virtual bool WindowText(HWND hWnd, std::wstring& text) = 0;
+    virtual bool IsUnicodeWindow(HWND hWnd) = 0;
+    // direct child of hParent, or top-level window when hParent is NULL
+    virtual HWND FindChildWindow(HWND hParent, const std::string& wndClass,
+        const std::wstring* wndText) = 0;
+
+    /* messaging */
+    virtual LRESULT SendAppMessage(HWND hWnd, UINT uMsg,
+        WPARAM wParam, LPARAM lParam) = 0;
+    virtual appmsgresult SendAppMessageTimeout(HWND hWnd, UINT uMsg,
+        WPARAM wParam, LPARAM lParam, unsigned uTimeOut,
+        DWORD_PTR& dwResult) = 0;
+    virtual bool PostAppMessage(HWND hWnd, UINT uMsg,
+        WPARAM wParam, LPARAM lParam) = 0;
+    // returns at once, func gets the result from PumpAppMessages on the
+    // calling thread once the window has answered, like
+    // SendMessageCallback; a window that never answers never calls it
+    virtual bool SendAppMessageAsync(HWND hWnd, UINT uMsg,
+        WPARAM wParam, LPARAM lParam, ResultFunc func) = 0;
+    // runs the callbacks of answered messages sent from this thread,
+    // waiting up to dwTimeOut ms for the first; the number run
+    virtual size_t PumpAppMessages(DWORD dwTimeOut) = 0;
+
+    virtual DWORD LastError() const = 0;
+};
+
+#ifdef WIN32
+class Win32Backend : public AppBackend
+{
+public:
+    virtual bool StartProcess(const std::wstring& exePath,
+        const std::wstring& cmdLine, HANDLE& hProcess, DWORD& dwPid,
+        bool& bWow64);
+    virtual void CloseProcess(HANDLE hProcess);
+    virtual bool TerminateProcess(HANDLE hProcess);
+    virtual DWORD WaitProcess(HANDLE hProcess, DWORD dwTimeOut);
+    virtual DWORD WaitProcessIdle(HANDLE hProcess, DWORD dwTimeOut);
+
+    virtual void* AllocRemote(HANDLE hProcess, size_t uLen);
+    virtual bool FreeRemote(HANDLE hProcess, void* pAppMem);
+    virtual bool ReadRemote(HANDLE hProcess, const void* pAppMem,
+        void* pThisMem, size_t uLen);
+    virtual bool WriteRemote(HANDLE hProcess, void* pAppMem,
+        const void* pThisMem, size_t uLen);
+
+    virtual void EnumTopWindows(WindowFunc func);
+    virtual void EnumChildren(HWND hWnd, WindowFunc func);
+    virtual DWORD WindowProcessId(HWND hWnd);
+    virtual std::string WindowClass(HWND hWnd);
+    virtual HWND WindowParent(HWND hWnd);
+    virtual bool WindowText(HWND hWnd, std::wstring& text);
+    virtual bool IsUnicodeWindow(HWND hWnd);
+    virtual HWND FindChildWindow(HWND hParent, const std::string& wndClass,
+        const std::wstring* wndText);
+
+    virtual LRESULT SendAppMessage(HWND hWnd, UINT uMsg,
+        WPARAM wParam, LPARAM lParam);
+    virtual appmsgresult SendAppMessageTimeout(HWND hWnd, UINT uMsg,
+        WPARAM wParam, LPARAM lParam, unsigned uTimeOut,
+        DWORD_PTR& dwResult);
+    virtual bool PostAppMessage(HWND hWnd, UINT uMsg,
+        WPARAM wParam, LPARAM lParam);
+    // Callbacks run while PumpAppMessages pumps the thread's queue. Each
+    // message holds a heap copy of its callback until Windows calls it,
+    // which for a window that never answers is never: that copy leaks.
+    // AppMonitor keeps it small and free of references to its state.
+    virtual bool SendAppMessageAsync(HWND hWnd, UINT uMsg,
+        WPARAM wParam, LPARAM lParam, ResultFunc func);
+    virtual size_t PumpAppMessages(DWORD dwTimeOut);
+
+    virtual DWORD LastError() const;
+};
+#else
+// The process half natively: posix_spawn, pidfd waits and signals, and
+// process_vm_readv/writev for memory. Linux has no windows to send
+// messages to, so the window half finds nothing and messages fail with
+// ERROR_INVALID_WINDOW_HANDLE, and there is no VirtualAllocEx either:
+// AllocRemote fails with ERROR_NOT_SUPPORTED and remote addresses have
+// to come from the application itself. Process handles are pidfds.
+class LinuxBackend : public AppBackend
+{
+public:
+    virtual bool StartProcess(const std::wstring& exePath,
+        const std::wstring& cmdLine, HANDLE& hProcess, DWORD& dwPid,
+        bool& bWow64);
+    virtual void CloseProcess(HANDLE hProcess);
+    virtual bool TerminateProcess(HANDLE hProcess);
+    virtual DWORD WaitProcess(HANDLE hProcess, DWORD dwTimeOut);
+    // idle is sleeping in the kernel, the nearest there is to waiting
+    // for input
+    virtual DWORD WaitProcessIdle(HANDLE hProcess, DWORD dwTimeOut);
+
+    virtual void* AllocRemote(HANDLE hProcess, size_t uLen);
+    virtual bool FreeRemote(HANDLE hProcess, void* pAppMem);
+    virtual bool ReadRemote(HANDLE hProcess, const void* pAppMem,
+        void* pThisMem, size_t uLen);
+    virtual bool WriteRemote(HANDLE hProcess, void* pAppMem,
+        const void* pThisMem, size_t uLen);
+    // process_vm_readv/writev take up to IOV_MAX regions per call
+    virtual bool ReadRemoteV(HANDLE hProcess, const remoteiov* pIov,
+        size_t uCount, unsigned& uCalls);
+    virtual bool WriteRemoteV(HANDLE hProcess, const remoteiov* pIov,
+        size_t uCount, unsigned& uCalls);
+
+    virtual void EnumTopWindows(WindowFunc func);
+    virtual void EnumChildren(HWND hWnd, WindowFunc func);
+    virtual DWORD WindowProcessId(HWND hWnd);
+    virtual std::string WindowClass(HWND hWnd);
+    virtual HWND WindowParent(HWND hWnd);
+    virtual bool WindowText(HWND hWnd, std::wstring& text);
+    virtual bool IsUnicodeWindow(HWND hWnd);
+    virtual HWND FindChildWindow(HWND hParent, const std::string& wndClass,
+        const std::wstring* wndText);
+
+    virtual LRESULT SendAppMessage(HWND hWnd, UINT uMsg,
+        WPARAM wParam, LPARAM lParam);
+    virtual appmsgresult SendAppMessageTimeout(HWND hWnd, UINT uMsg,
+        WPARAM wParam, LPARAM lParam, unsigned uTimeOut,
+        DWORD_PTR& dwResult);
+    virtual bool PostAppMessage(HWND hWnd, UINT uMsg,
+        WPARAM wParam, LPARAM lParam);
+    virtual bool SendAppMessageAsync(HWND hWnd, UINT uMsg,
+        WPARAM wParam, LPARAM lParam, ResultFunc func);
+    virtual size_t PumpAppMessages(DWORD dwTimeOut);
+
+    // per thread, like GetLastError
+    virtual DWORD LastError() const;
+private:
+    int Pid(HANDLE hProcess);
+    bool RemoteCopy(HANDLE hProcess, void* pThisMem, uint64_t uAppMem,
+        size_t uLen, bool bWrite);
+    bool RemoteCopyV(HANDLE hProcess, const remoteiov* pIov,
+        size_t uCount, unsigned& uCalls, bool bWrite);
+
+    std::mutex m_Lock;
+    std::map<int, int> m_Pids;
+    // pidfds sent SIGKILL, CloseProcess waits for those
+    std::set<int> m_Killed;
+};
+#endif
+
+// Backend used by AppMonitor when none is given: Win32Backend on
+// Windows, LinuxBackend on Linux
+AppBackend* DefaultAppBackend();
+
+#endif
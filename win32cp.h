@@ -0,0 +1,30 @@
+#ifndef __WIN32CP_H
+#define __WIN32CP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SBCS_MAX_BLOCKS 8
+#define SBCS_DEFAULT_CHAR '?'
+
+// Single-byte codepage. Decoding is a lookup of the upper half,
+// encoding goes through a two-level table: m_Index maps the high byte
+// of a code point to one of m_Blocks (0 is the empty block), the block
+// maps the low byte to the encoded byte, 0 meaning "not in codepage".
+struct sbcs_page {
+    int m_iCodePage;
+    uint16_t m_Decode[128];
+    uint8_t m_Index[256];
+    uint8_t m_Blocks[SBCS_MAX_BLOCKS][256];
+};
+
+// NULL for pages without a table; every page with one keeps ASCII
+// (0x00..0x7F) unchanged
+const sbcs_page* FindSingleBytePage(int cp);
+
+size_t SingleByteDecode(const sbcs_page* page, const char* in,
+    size_t len, wchar_t* out);
+size_t SingleByteEncode(const sbcs_page* page, const wchar_t* in,
+    size_t len, char* out);
+
+#endif
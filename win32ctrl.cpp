@@ -1,13 +1,15 @@
 #include "win32ctrl.h"
-
-#ifdef WIN32
 #include "win32util.h"
-#include <commctrl.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <strsafe.h>
+#include <algorithm>
+#include <chrono>
 #include <exception>
 #include <memory>
+#include <thread>
+#include <unordered_map>
 
 /* AppException */
 
@@ -16,27 +18,109 @@ AppException::AppException(AppMonitor* app,
 {
     m_pApp = app;
     m_Text = text;
-    m_dwError = GetLastError();
+    m_dwError = app && app->GetBackend()
+        ? app->GetBackend()->LastError() : 0;
+    Format();
 }
 
-static char s_szExcBuf[256] = {0};
+AppException::AppException(AppMonitor* app,
+    const std::string& text, DWORD dwError)
+{
+    m_pApp = app;
+    m_Text = text;
+    m_dwError = dwError;
+    Format();
+}
+
+// formatted up front, what() may be called from any thread
+void AppException::Format()
+{
+    char szPrefix[32];
+    snprintf(szPrefix, sizeof(szPrefix), "AppMonitor#%05u: ",
+        m_pApp ? (unsigned)m_pApp->GetAppProcessId() : 0);
+    m_What = szPrefix + m_Text;
+}
 
 const char* AppException::what() const noexcept
 {
-    StringCchPrintfA(s_szExcBuf, 256, "AppMonitor#%05d: %s",
-        GetApp()->GetAppProcessId(), m_Text.c_str());
-    return s_szExcBuf;
+    return m_What.c_str();
+}
+
+/* AppArena */
+
+AppArena::AppArena(AppMonitor* app, unsigned uChunk)
+    : m_pApp(app), m_uChunk(uChunk), m_uCurrent(0), m_uOffset(0)
+{
+}
+
+AppArena::~AppArena()
+{
+    Release();
+}
+
+AppMem AppArena::Alloc(unsigned uLen)
+{
+    // keep every allocation aligned for the structures put there
+    uLen = (uLen + 15) & ~15u;
+
+    while (m_uCurrent < m_Chunks.size()
+        && m_uOffset + uLen > m_Chunks[m_uCurrent].Size())
+    {
+        m_uCurrent++;
+        m_uOffset = 0;
+    }
+    if (m_uCurrent == m_Chunks.size())
+    {
+        m_Chunks.push_back(m_pApp->MemAlloc(std::max(uLen, m_uChunk)));
+        m_uOffset = 0;
+    }
+
+    AppMem& chunk = m_Chunks[m_uCurrent];
+    char* pThisMem = (char*)chunk.This() + m_uOffset;
+    char* pAppMem = (char*)chunk.App() + m_uOffset;
+    m_uOffset += uLen;
+
+    memset(pThisMem, '\0', uLen);
+    return AppMem(pThisMem, pAppMem, uLen);
+}
+
+uint64_t AppArena::Mark() const
+{
+    return ((uint64_t)m_uCurrent << 32) | m_uOffset;
+}
+
+void AppArena::Rewind(uint64_t uMark)
+{
+    m_uCurrent = (size_t)(uMark >> 32);
+    m_uOffset = (unsigned)uMark;
+}
+
+void AppArena::Reset()
+{
+    Rewind(0);
+}
+
+void AppArena::Release()
+{
+    for (auto& chunk : m_Chunks)
+        m_pApp->MemFree(chunk);
+    m_Chunks.clear();
+    Reset();
 }
 
 /* AppMonitor */
 
 void AppMonitor::Init()
 {
+#ifdef WIN32
     InitCommonControls();
+#endif
 }
 
 AppMonitor::AppMonitor()
-    : m_ExePath(L"")
+    : m_pBackend(DefaultAppBackend()),
+    m_bUseWindows(false), m_uMemRegions(0), m_uMemCalls(0),
+    m_pAsync(std::make_shared<appasync>()), m_ExePath(L"")
 {
     m_hAppProcess = INVALID_HANDLE_VALUE;
     m_dwPid = 0;
@@ -44,7 +128,19 @@ AppMonitor::AppMonitor()
 }
 
 AppMonitor::AppMonitor(const std::wstring& app)
-    : m_ExePath(app)
+    : m_pBackend(DefaultAppBackend()),
+    m_bUseWindows(false), m_uMemRegions(0), m_uMemCalls(0),
+    m_pAsync(std::make_shared<appasync>()), m_ExePath(app)
+{
+    m_hAppProcess = INVALID_HANDLE_VALUE;
+    m_dwPid = 0;
+    m_bWow64 = FALSE;
+}
+
+AppMonitor::AppMonitor(AppBackend* pBackend, const std::wstring& app)
+    : m_pBackend(pBackend),
+    m_bUseWindows(false), m_uMemRegions(0), m_uMemCalls(0),
+    m_pAsync(std::make_shared<appasync>()), m_ExePath(app)
 {
     m_hAppProcess = INVALID_HANDLE_VALUE;
     m_dwPid = 0;
@@ -53,54 +149,84 @@ AppMonitor::AppMonitor(const std::wstring& app)
 
 AppMonitor::~AppMonitor()
 {
-    if (m_hAppProcess != INVALID_HANDLE_VALUE)
-        CloseHandle(m_hAppProcess);
+    // derived parts are gone, callbacks must not call back into them
+    CancelAll(NULL);
+    m_pArena.reset();
+    if (m_pBackend && m_hAppProcess != INVALID_HANDLE_VALUE)
+        m_pBackend->CloseProcess(m_hAppProcess);
 }
 
-struct _enumapp_s {
-    AppMonitor* m_pMonitor;
-    AppMonitor::EnumFunc m_Func;
-};
+AppBackend* AppMonitor::Backend()
+{
+    if (!m_pBackend)
+        throw AppException(this, "!m_pBackend");
+    return m_pBackend;
+}
 
-BOOL CALLBACK _EnumAppWindows(HWND hWnd, LPARAM lParam)
+void AppMonitor::EnumAppWindows(const EnumFunc& func)
 {
-    AppMonitor* app = (AppMonitor*)lParam;
+    AppBackend* pBackend = Backend();
+    DWORD dwAppPid = GetAppProcessId();
 
-    DWORD dwPid = 0;
-    GetWindowThreadProcessId(app->m_Tmp.m_hWnd
-        ? app->m_Tmp.m_hWnd : hWnd, &dwPid);
-    if (dwPid && dwPid != app->GetAppProcessId())
-        return TRUE;
+    pBackend->EnumTopWindows([&](HWND hWnd) {
+        DWORD dwPid = pBackend->WindowProcessId(hWnd);
+        if (dwPid && dwPid != dwAppPid)
+            return true;
 
-    return app->m_Tmp.m_Func(app, hWnd);
+        return func(this, hWnd);
+    });
 }
 
-void AppMonitor::EnumAppWindows(EnumFunc func)
+void AppMonitor::EnumAppControls(HWND hWnd, const EnumFunc& func)
 {
-    m_Tmp.m_hWnd = NULL;
-    m_Tmp.m_Func = func;
+    AppBackend* pBackend = Backend();
+
+    // children of a window of another process are not the app's
+    DWORD dwPid = pBackend->WindowProcessId(hWnd);
+    if (dwPid && dwPid != GetAppProcessId())
+        return;
 
-    EnumWindows(_EnumAppWindows, (LPARAM)this);
+    pBackend->EnumChildren(hWnd,
+        [&](HWND hChild) { return func(this, hChild); });
 }
 
-void AppMonitor::EnumAppControls(HWND hWnd, EnumFunc func)
+void AppMonitor::UseWindowCache(bool bUse)
 {
-    m_Tmp.m_hWnd = hWnd;
-    m_Tmp.m_Func = func;
+    m_bUseWindows = bUse;
+}
 
-    EnumChildWindows(hWnd, _EnumAppWindows, (LPARAM)this);
+// the windows of a process that is gone
+void AppMonitor::ClearWindowCache()
+{
+    std::lock_guard<std::mutex> lock(m_WindowsLock);
+    if (m_pWindows)
+        m_pWindows->Clear();
+}
+
+AppWindowCache& AppMonitor::GetWindowCache()
+{
+    std::lock_guard<std::mutex> lock(m_WindowsLock);
+    if (!m_pWindows)
+        m_pWindows = std::make_unique<AppWindowCache>(this);
+    return *m_pWindows;
 }
 
 HWND AppMonitor::FindAppWindow(const std::string& wndClass)
 {
-    m_Tmp.m_hWnd = NULL;
-    m_Tmp.m_Class = wndClass;
+    if (m_bUseWindows)
+    {
+        AppWindowCache& cache = GetWindowCache();
+        std::lock_guard<std::mutex> lock(m_WindowsLock);
+        return cache.FindAppWindow(wndClass);
+    }
 
+    HWND hFound = NULL;
     EnumAppWindows(
-        [](AppMonitor* app, HWND hWnd) {
-            if (app->GetWindowClass(hWnd) == app->m_Tmp.m_Class)
+        [&](AppMonitor* app, HWND hWnd) {
+            if (AppWindowCache::SameClass(app->GetWindowClass(hWnd),
+                wndClass))
             {
-                app->m_Tmp.m_hWnd = hWnd;
+                hFound = hWnd;
                 return false;
             }
 
@@ -108,7 +234,7 @@ HWND AppMonitor::FindAppWindow(const std::string& wndClass)
         }
     );
 
-    return m_Tmp.m_hWnd;
+    return hFound;
 }
 
 bool AppMonitor::StartApp(const std::wstring& cmdLine)
@@ -116,59 +242,55 @@ bool AppMonitor::StartApp(const std::wstring& cmdLine)
     if (m_ExePath.empty())
         throw AppException(this, "m_ExePath.empty()");
 
-    auto pszCmdLine = std::make_unique<wchar_t[]>(MAX_CMDLINE);
-    StringCchPrintfW(pszCmdLine.get(), MAX_CMDLINE, L"\"%s\" %s",
-        m_ExePath.c_str(), cmdLine.c_str());
-
-    PROCESS_INFORMATION pi;
-    STARTUPINFOW si;
-
-    ZeroMemory(&pi, sizeof(pi));
-    ZeroMemory(&si, sizeof(si));
-
-    si.cb = sizeof(si);
-    BOOL bCreated = CreateProcessW(m_ExePath.c_str(), pszCmdLine.get(),
-        NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi);
-    if (!bCreated)
+    bool bWow64 = false;
+    if (!Backend()->StartProcess(m_ExePath, cmdLine,
+        m_hAppProcess, m_dwPid, bWow64))
+    {
         return false;
+    }
 
-    m_hAppProcess = pi.hProcess;
-    m_dwPid = pi.dwProcessId;
-
-    if (!IsWow64Process(m_hAppProcess, &m_bWow64))
-        m_bWow64 = FALSE;
-
-    CloseHandle(pi.hThread);
+    m_bWow64 = bWow64 ? TRUE : FALSE;
+    ClearWindowCache();
     return true;
 }
 
 void AppMonitor::CloseApp()
 {
+    // while the process can still take the memory back
+    CancelMessages();
+    m_pArena.reset();
+
     EnumAppWindows(
         [](AppMonitor* app, HWND hWnd) {
-            SendMessage(hWnd, WM_CLOSE, 0, 0);
+            app->GetBackend()->SendAppMessage(hWnd, WM_CLOSE, 0, 0);
             return true;
         }
     );
 
-    CloseHandle(m_hAppProcess);
+    Backend()->CloseProcess(m_hAppProcess);
     m_hAppProcess = INVALID_HANDLE_VALUE;
+    m_dwPid = 0;
+    ClearWindowCache();
 }
 
 void AppMonitor::Terminate()
 {
-    TerminateProcess(m_hAppProcess, 0);
-    CloseHandle(m_hAppProcess);
+    CancelMessages();
+    m_pArena.reset();
+    ClearWindowCache();
+    Backend()->TerminateProcess(m_hAppProcess);
+    Backend()->CloseProcess(m_hAppProcess);
     m_hAppProcess = INVALID_HANDLE_VALUE;
+    m_dwPid = 0;
 }
 
 bool AppMonitor::IsAppRunning() const
 {
-    DWORD dwWait = WaitForSingleObject(m_hAppProcess, 0);
-    if (dwWait != WAIT_OBJECT_0)
+    if (!m_pBackend)
         return false;
 
-    return true;
+    // the handle is signalled once the process has exited
+    return m_pBackend->WaitProcess(m_hAppProcess, 0) == WAIT_TIMEOUT;
 }
 
 bool AppMonitor::IsWow64() const
@@ -178,7 +300,8 @@ bool AppMonitor::IsWow64() const
 
 bool AppMonitor::WaitAppIdle(DWORD dwInterval)
 {
-    return WaitForInputIdle(GetAppProcess(), dwInterval) != 0;
+    return Backend()->WaitProcessIdle(GetAppProcess(), dwInterval)
+        == WAIT_OBJECT_0;
 }
 
 void AppMonitor::MonitorSetup()
@@ -202,16 +325,21 @@ void AppMonitor::SetExePath(const std::wstring& exePath)
 
 std::string AppMonitor::GetWindowClass(HWND hWnd)
 {
-    char szClass[64] = {0};
-    GetClassNameA(hWnd, szClass, 64);
-    return std::string(szClass);
+    return Backend()->WindowClass(hWnd);
 }
 
 HWND AppMonitor::GetChild(HWND hWnd, const std::string& wndClass,
     const std::wstring& wndText)
 {
-    return FindWindowExW(hWnd, NULL, TextToWchar(wndClass).c_str(),
-        wndText.empty() ? NULL : wndText.c_str());
+    if (m_bUseWindows)
+    {
+        AppWindowCache& cache = GetWindowCache();
+        std::lock_guard<std::mutex> lock(m_WindowsLock);
+        return cache.FindChild(hWnd, wndClass, wndText);
+    }
+
+    return Backend()->FindChildWindow(hWnd, wndClass,
+        wndText.empty() ? NULL : &wndText);
 }
 
 AppMem AppMonitor::MemAlloc(unsigned uLen)
@@ -223,16 +351,17 @@ AppMem AppMonitor::MemAlloc(unsigned uLen)
     if (!pThisMem)
         throw AppException(this, "!malloc");
     memset(pThisMem, '\0', uLen);
-    pAppMem = VirtualAllocEx(m_hAppProcess,
-        NULL, uLen, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    pAppMem = Backend()->AllocRemote(m_hAppProcess, uLen);
     if (!pAppMem)
     {
         free(pThisMem);
         throw AppException(this, "!VirtualAllocEx");
     }
-    else if (IsWow64() && (uintptr_t)pAppMem > 0xFFFFFFFF)
+    else if (IsWow64()
+        && (uint64_t)(uintptr_t)pAppMem + uLen > 0x100000000ull)
     {
         free(pThisMem);
+        m_pBackend->FreeRemote(m_hAppProcess, pAppMem);
         throw AppException(this, "WOW64 VirtualAllocEx >4GB addr");
     }
 
@@ -242,63 +371,211 @@ AppMem AppMonitor::MemAlloc(unsigned uLen)
 void AppMonitor::MemFree(AppMem& mem)
 {
     free(mem.This());
-    VirtualFreeEx(m_hAppProcess, mem.App(), 0, MEM_RELEASE);
+    if (mem.App())
+        Backend()->FreeRemote(m_hAppProcess, mem.App());
     mem = AppMem();
 }
 
-void AppMonitor::MemWriteApp(const AppMem& mem)
+apperror AppMonitor::BackendError(DWORD dwDefault) const
 {
-    SIZE_T szTmp = mem.Size();
-    if(!WriteProcessMemory(m_hAppProcess, mem.App(),
-        mem.This(), mem.Size(), &szTmp))
+    DWORD dwError = m_pBackend ? m_pBackend->LastError() : 0;
+    return { dwError ? dwError : dwDefault };
+}
+
+AppResult<void> AppMonitor::TryMemWriteApp(const AppMem& mem)
+{
+    if (!m_pBackend)
+        return apperror{ ERROR_INVALID_HANDLE };
+
+    m_uMemRegions++;
+    m_uMemCalls++;
+    if(!m_pBackend->WriteRemote(m_hAppProcess, mem.App(),
+        mem.This(), mem.Size()))
     {
-        throw AppException(this, "!WriteProcessMemory");
+        return BackendError(ERROR_PARTIAL_COPY);
     }
+    return AppResult<void>();
 }
 
-void AppMonitor::MemReadApp(const AppMem& mem)
+AppResult<void> AppMonitor::TryMemReadApp(const AppMem& mem)
 {
-    SIZE_T szTmp = mem.Size();
-    if(!ReadProcessMemory(m_hAppProcess, mem.App(),
-        mem.This(), mem.Size(), &szTmp))
+    if (!m_pBackend)
+        return apperror{ ERROR_INVALID_HANDLE };
+
+    m_uMemRegions++;
+    m_uMemCalls++;
+    if(!m_pBackend->ReadRemote(m_hAppProcess, mem.App(),
+        mem.This(), mem.Size()))
     {
-        throw AppException(this, "!ReadProcessMemory");
+        return BackendError(ERROR_PARTIAL_COPY);
     }
+    return AppResult<void>();
 }
 
-bool AppMonitor::AppMessage(HWND hWnd, UINT uMsg,
-    WPARAM wParam, LPARAM lParam,
-    DWORD_PTR* pResult,
-    unsigned uTimeOut)
+void AppMonitor::MemWriteApp(const AppMem& mem)
 {
-    DWORD_PTR dwResult = 0;
-    LRESULT lResult;
+    AppResult<void> result = TryMemWriteApp(mem);
+    if (!result)
+        throw AppException(this, "!WriteProcessMemory", result.Error());
+}
 
-    if (IsWindowUnicode(hWnd))
+void AppMonitor::MemReadApp(const AppMem& mem)
+{
+    AppResult<void> result = TryMemReadApp(mem);
+    if (!result)
+        throw AppException(this, "!ReadProcessMemory", result.Error());
+}
+
+// sorted by target address; neighbours from the same buffer, where the
+// local and remote addresses differ by the same amount, become one
+static size_t MergeRegions(std::span<const AppMem> mems, remoteiov* pIov)
+{
+    size_t uCount = 0;
+    for (auto& mem : mems)
+        if (mem.Size())
+            pIov[uCount++] = { mem.This(), mem.App(), mem.Size() };
+
+    std::stable_sort(pIov, pIov + uCount,
+        [](const remoteiov& a, const remoteiov& b) {
+            return (uintptr_t)a.m_pAppMem < (uintptr_t)b.m_pAppMem;
+        });
+
+    size_t uMerged = 0;
+    for (size_t i = 0; i < uCount; i++)
     {
-        lResult = SendMessageTimeoutW(
-            hWnd, uMsg, wParam, lParam,
-            SMTO_ABORTIFHUNG, uTimeOut,
-            &dwResult);
+        if (uMerged)
+        {
+            remoteiov& last = pIov[uMerged - 1];
+            uintptr_t uEnd = (uintptr_t)last.m_pAppMem + last.m_uLen;
+            uintptr_t uStart = (uintptr_t)pIov[i].m_pAppMem;
+            if (uStart <= uEnd
+                && (uintptr_t)last.m_pThisMem - (uintptr_t)last.m_pAppMem
+                == (uintptr_t)pIov[i].m_pThisMem - uStart)
+            {
+                last.m_uLen = std::max(uEnd, uStart + pIov[i].m_uLen)
+                    - (uintptr_t)last.m_pAppMem;
+                continue;
+            }
+        }
+        pIov[uMerged++] = pIov[i];
     }
-    else
+    return uMerged;
+}
+
+AppResult<void> AppMonitor::MemTransfer(std::span<const AppMem> mems,
+    bool bWrite)
+{
+    AppBackend* pBackend = m_pBackend;
+    if (!pBackend)
+        return apperror{ ERROR_INVALID_HANDLE };
+
+    remoteiov stackIov[16];
+    std::vector<remoteiov> heapIov;
+    remoteiov* pIov = stackIov;
+    if (mems.size() > 16)
     {
-        lResult = SendMessageTimeoutA(
-            hWnd, uMsg, wParam, lParam,
-            SMTO_ABORTIFHUNG, uTimeOut,
-            &dwResult);
+        heapIov.resize(mems.size());
+        pIov = heapIov.data();
     }
 
-    if (pResult) *pResult = dwResult;
+    size_t uCount = MergeRegions(mems, pIov);
+    if (!uCount)
+        return AppResult<void>();
+
+    unsigned uCalls = 0;
+    bool bOk = bWrite
+        ? pBackend->WriteRemoteV(m_hAppProcess, pIov, uCount, uCalls)
+        : pBackend->ReadRemoteV(m_hAppProcess, pIov, uCount, uCalls);
+    m_uMemRegions += mems.size();
+    m_uMemCalls += uCalls;
+
+    if (!bOk)
+        return BackendError(ERROR_PARTIAL_COPY);
+    return AppResult<void>();
+}
+
+AppResult<void> AppMonitor::TryMemWriteApp(std::span<const AppMem> mems)
+{
+    return MemTransfer(mems, true);
+}
+
+AppResult<void> AppMonitor::TryMemReadApp(std::span<const AppMem> mems)
+{
+    return MemTransfer(mems, false);
+}
+
+void AppMonitor::MemWriteApp(std::span<const AppMem> mems)
+{
+    AppResult<void> result = MemTransfer(mems, true);
+    if (!result)
+        throw AppException(this, "!WriteProcessMemory", result.Error());
+}
+
+void AppMonitor::MemReadApp(std::span<const AppMem> mems)
+{
+    AppResult<void> result = MemTransfer(mems, false);
+    if (!result)
+        throw AppException(this, "!ReadProcessMemory", result.Error());
+}
+
+appmemstats AppMonitor::GetMemStats() const
+{
+    appmemstats stats;
+    stats.m_uRegions = m_uMemRegions;
+    stats.m_uCalls = m_uMemCalls;
+    stats.m_uSaved = stats.m_uRegions > stats.m_uCalls
+        ? stats.m_uRegions - stats.m_uCalls : 0;
+    return stats;
+}
+
+void AppMonitor::ResetMemStats()
+{
+    m_uMemRegions = 0;
+    m_uMemCalls = 0;
+}
+
+AppArena& AppMonitor::GetArena()
+{
+    if (!m_pArena)
+        m_pArena = std::make_unique<AppArena>(this);
+    return *m_pArena;
+}
+
+AppResult<DWORD_PTR> AppMonitor::TryAppMessage(HWND hWnd, UINT uMsg,
+    WPARAM wParam, LPARAM lParam,
+    unsigned uTimeOut)
+{
+    if (!m_pBackend)
+        return apperror{ ERROR_INVALID_HANDLE };
+
+    DWORD_PTR dwResult = 0;
+    appmsgresult result = m_pBackend->SendAppMessageTimeout(
+        hWnd, uMsg, wParam, lParam, uTimeOut, dwResult);
+
+    if (result == AppMsgDone) // ок
+        return dwResult;
+    else if (result == AppMsgTimeOut) // таймаут
+        return apperror{ ERROR_TIMEOUT };
+    else // ошибка
+        return BackendError(ERROR_INVALID_WINDOW_HANDLE);
+}
+
+bool AppMonitor::AppMessage(HWND hWnd, UINT uMsg,
+    WPARAM wParam, LPARAM lParam,
+    DWORD_PTR* pResult,
+    unsigned uTimeOut)
+{
+    AppResult<DWORD_PTR> result = TryAppMessage(hWnd, uMsg,
+        wParam, lParam, uTimeOut);
 
-    if (lResult) // ок
+    if (pResult) *pResult = result.ValueOr(0);
+
+    if (result)
         return true;
-    else if (GetLastError() == ERROR_TIMEOUT) // таймаут
+    else if (result.IsTimeOut())
         throw AppTimeOut(this, uMsg);
-    else // ошибка
-    {
-        throw AppException(this, "!SendMessageTimeoutW");
-    }
+    else
+        throw AppException(this, "!SendMessageTimeoutW", result.Error());
 }
 
 void AppMonitor::AppPostMessage(HWND hWnd, UINT uMsg,
@@ -306,14 +583,214 @@ void AppMonitor::AppPostMessage(HWND hWnd, UINT uMsg,
 {
     if (!hWnd)
         throw AppException(this, "!hWnd");
-    if (!PostMessageW(hWnd, uMsg, wParam, lParam))
+    if (!Backend()->PostAppMessage(hWnd, uMsg, wParam, lParam))
         throw AppException(this, "!PostMessageW");
 }
 
+/* asynchronous messages */
+
+using async_clock = std::chrono::steady_clock;
+
+struct appasync {
+    struct request {
+        AppMonitor::MessageFunc m_Func;
+        async_clock::time_point m_Deadline;
+        std::thread::id m_Thread;
+    };
+
+    std::mutex m_Lock;
+    std::unordered_map<DWORD_PTR, request> m_Requests;
+    DWORD_PTR m_dwNextId = 1;
+};
+
+// callbacks run by this thread's PumpMessages so far
+static thread_local size_t s_uMessageResults = 0;
+
+// the backend's callback: the request may have timed out or been
+// cancelled meanwhile, and the monitor may be gone with it
+static void OnAsyncResult(AppMonitor* app,
+    const std::weak_ptr<appasync>& pWeak, DWORD_PTR dwRequest,
+    DWORD_PTR dwResult)
+{
+    std::shared_ptr<appasync> pAsync = pWeak.lock();
+    if (!pAsync)
+        return;
+
+    AppMonitor::MessageFunc func;
+    {
+        std::lock_guard<std::mutex> lock(pAsync->m_Lock);
+        auto it = pAsync->m_Requests.find(dwRequest);
+        if (it == pAsync->m_Requests.end())
+            return;
+        func = std::move(it->second.m_Func);
+        pAsync->m_Requests.erase(it);
+    }
+
+    s_uMessageResults++;
+    func(app, AppResult<DWORD_PTR>(dwResult));
+}
+
+DWORD_PTR AppMonitor::AppMessageAsync(HWND hWnd, UINT uMsg,
+    WPARAM wParam, LPARAM lParam, const MessageFunc& func,
+    unsigned uTimeOut)
+{
+    if (!m_pBackend)
+    {
+        func(this, apperror{ ERROR_INVALID_HANDLE });
+        return 0;
+    }
+
+    DWORD_PTR dwRequest;
+    {
+        std::lock_guard<std::mutex> lock(m_pAsync->m_Lock);
+        dwRequest = m_pAsync->m_dwNextId++;
+
+        appasync::request& request = m_pAsync->m_Requests[dwRequest];
+        request.m_Func = func;
+        request.m_Deadline = uTimeOut == INFINITE
+            ? async_clock::time_point::max()
+            : async_clock::now() + std::chrono::milliseconds(uTimeOut);
+        request.m_Thread = std::this_thread::get_id();
+    }
+
+    // weak, a backend that never gets an answer may keep the callback
+    // forever (see Win32Backend)
+    std::weak_ptr<appasync> pWeak = m_pAsync;
+    bool bSent = m_pBackend->SendAppMessageAsync(hWnd, uMsg,
+        wParam, lParam, [this, pWeak, dwRequest](DWORD_PTR dwResult) {
+            OnAsyncResult(this, pWeak, dwRequest, dwResult);
+        });
+
+    if (!bSent)
+    {
+        apperror error = BackendError(ERROR_INVALID_WINDOW_HANDLE);
+        {
+            std::lock_guard<std::mutex> lock(m_pAsync->m_Lock);
+            m_pAsync->m_Requests.erase(dwRequest);
+        }
+        func(this, error);
+        return 0;
+    }
+    return dwRequest;
+}
+
+bool AppMonitor::CancelMessage(DWORD_PTR dwRequest)
+{
+    MessageFunc func;
+    {
+        std::lock_guard<std::mutex> lock(m_pAsync->m_Lock);
+        auto it = m_pAsync->m_Requests.find(dwRequest);
+        if (it == m_pAsync->m_Requests.end())
+            return false;
+        func = std::move(it->second.m_Func);
+        m_pAsync->m_Requests.erase(it);
+    }
+
+    func(this, apperror{ ERROR_CANCELLED });
+    return true;
+}
+
+void AppMonitor::CancelMessages()
+{
+    CancelAll(this);
+}
+
+void AppMonitor::CancelAll(AppMonitor* app)
+{
+    std::unordered_map<DWORD_PTR, appasync::request> requests;
+    {
+        std::lock_guard<std::mutex> lock(m_pAsync->m_Lock);
+        requests.swap(m_pAsync->m_Requests);
+    }
+
+    for (auto& request : requests)
+        request.second.m_Func(app, apperror{ ERROR_CANCELLED });
+}
+
+// Times out this thread's requests past their deadline and returns how
+// long the backend may wait: until the next deadline or until, in ms.
+DWORD AppMonitor::ExpireMessages(async_clock::time_point until)
+{
+    std::thread::id thread = std::this_thread::get_id();
+    async_clock::time_point now = async_clock::now();
+    std::vector<MessageFunc> expired;
+    {
+        std::lock_guard<std::mutex> lock(m_pAsync->m_Lock);
+        for (auto it = m_pAsync->m_Requests.begin();
+            it != m_pAsync->m_Requests.end();)
+        {
+            appasync::request& request = it->second;
+            if (request.m_Thread != thread)
+                ++it;
+            else if (request.m_Deadline <= now)
+            {
+                expired.push_back(std::move(request.m_Func));
+                it = m_pAsync->m_Requests.erase(it);
+            }
+            else
+            {
+                until = std::min(until, request.m_Deadline);
+                ++it;
+            }
+        }
+    }
+
+    for (auto& func : expired)
+    {
+        s_uMessageResults++;
+        func(this, apperror{ ERROR_TIMEOUT });
+    }
+
+    if (until == async_clock::time_point::max())
+        return INFINITE;
+    if (until <= now)
+        return 0;
+    // rounded up, waking early would only spin
+    auto wait = std::chrono::ceil<std::chrono::milliseconds>(until - now);
+    return (DWORD)std::min<int64_t>(wait.count(), INFINITE - 1);
+}
+
+size_t AppMonitor::PumpMessages(DWORD dwTimeOut)
+{
+    size_t uBefore = s_uMessageResults;
+    async_clock::time_point start = async_clock::now();
+    async_clock::time_point until = dwTimeOut == INFINITE
+        ? async_clock::time_point::max()
+        : start + std::chrono::milliseconds(dwTimeOut);
+
+    for (;;)
+    {
+        DWORD dwWait = ExpireMessages(until);
+        if (s_uMessageResults != uBefore)
+            break;
+
+        Backend()->PumpAppMessages(dwWait);
+        if (s_uMessageResults != uBefore || async_clock::now() >= until)
+            break;
+    }
+
+    return s_uMessageResults - uBefore;
+}
+
+size_t AppMonitor::PendingMessages() const
+{
+    std::lock_guard<std::mutex> lock(m_pAsync->m_Lock);
+    return m_pAsync->m_Requests.size();
+}
+
 AppMem AppMonitor::NewString(HWND hWnd, DWORD dwChars)
 {
     if (!dwChars) dwChars = 256;
-    return MemAlloc(IsWindowUnicode(hWnd)
+    return MemAlloc(Backend()->IsUnicodeWindow(hWnd)
+        ? sizeof(wchar_t) * dwChars
+        : sizeof(char) * dwChars
+    );
+}
+
+AppMem AppMonitor::NewString(AppArena& arena, HWND hWnd, DWORD dwChars)
+{
+    if (!dwChars) dwChars = 256;
+    return arena.Alloc(Backend()->IsUnicodeWindow(hWnd)
         ? sizeof(wchar_t) * dwChars
         : sizeof(char) * dwChars
     );
@@ -321,10 +798,14 @@ AppMem AppMonitor::NewString(HWND hWnd, DWORD dwChars)
 
 std::wstring AppMonitor::ReadString(HWND hWnd, const AppMem& str)
 {
-    std::wstring ret;
     MemReadApp(str);
+    return DecodeString(hWnd, str);
+}
 
-    if (IsWindowUnicode(hWnd))
+std::wstring AppMonitor::DecodeString(HWND hWnd, const AppMem& str)
+{
+    std::wstring ret;
+    if (Backend()->IsUnicodeWindow(hWnd))
     {
         wchar_t* pszText = (wchar_t*)str.This();
         pszText[(uint64_t)(str.Size()-1)/sizeof(wchar_t)] = L'\0';
@@ -342,15 +823,11 @@ std::wstring AppMonitor::ReadString(HWND hWnd, const AppMem& str)
 
 std::wstring AppMonitor::GetWindowTextStr(HWND hWnd)
 {
-    auto pszText = std::make_unique<wchar_t[]>(MAX_WM_TEXT);
-
-    SetLastError(0);
-    int iLen = GetWindowTextW(hWnd, pszText.get(), MAX_WM_TEXT);
-    if (iLen < 0)
+    std::wstring text;
+    if (!Backend()->WindowText(hWnd, text))
         throw AppException(this, "!GetWindowTextW");
 
-    pszText[iLen] = L'\0';
-    return std::wstring(pszText.get());
+    return text;
 }
 
 std::wstring AppMonitor::GetControlTextStr(HWND hWnd)
@@ -362,7 +839,7 @@ std::wstring AppMonitor::GetControlTextStr(HWND hWnd)
         return L"";
 
     std::wstring ret;
-    if (IsWindowUnicode(hWnd))
+    if (Backend()->IsUnicodeWindow(hWnd))
     {
         auto pszText = std::make_unique<wchar_t[]>(dwLength * 2);
         AppMessage(hWnd, WM_GETTEXT,
@@ -397,25 +874,14 @@ DWORD_PTR AppMonitor::TV_GetNextItem(HWND hTree, DWORD dwFlags,
     return dwRetItem;
 }
 
-typedef struct {
-    uint32_t mask;
-    uint32_t hItem;
-    uint32_t state;
-    uint32_t stateMask;
-    uint32_t dwText;
-    int32_t cchTextMax;
-    int32_t iImage;
-    int32_t iSelectedImage;
-    int32_t cChildren;
-    uint32_t lParam;
-} tvitem32_t;
-
 std::tuple<std::wstring,int>
 AppMonitor::TV_GetItem32(HWND hTree, DWORD_PTR dwItem)
 {
     DWORD_PTR dwRet;
-    AppMem item = MemAlloc(sizeof(tvitem32_t));
-    AppMem str = NewString(hTree, MAX_TV_TEXT);
+    AppArena& arena = GetArena();
+    uint64_t uMark = arena.Mark();
+    AppMem item = arena.Alloc(sizeof(tvitem32_t));
+    AppMem str = NewString(arena, hTree, MAX_TV_TEXT);
 
     std::wstring text = L"";
     int icon = 0;
@@ -426,50 +892,37 @@ AppMonitor::TV_GetItem32(HWND hTree, DWORD_PTR dwItem)
     tvItem->cchTextMax = MAX_TV_TEXT;
     tvItem->dwText = (uint32_t)((uintptr_t)str.App());
 
-    MemWriteApp(item);
-    AppMessage(hTree, IsWindowUnicode(hTree)
-        ? TVM_GETITEMW : TVM_GETITEMA,
-        0, (LPARAM)item.App(), &dwRet
-    );
-    if ((BOOL)dwRet)
-    {
-        MemReadApp(item);
+    try {
+        MemWriteApp(item);
+        AppMessage(hTree, Backend()->IsUnicodeWindow(hTree)
+            ? TVM_GETITEMW : TVM_GETITEMA,
+            0, (LPARAM)item.App(), &dwRet
+        );
+        if (!(BOOL)dwRet)
+            throw AppException(this, "TVM_GETITEM !dwRet");
 
-        text = ReadString(hTree, str);
-        icon = tvItem->iImage;
+        MemReadApp({ item, str });
 
-        MemFree(item);
-        MemFree(str);
-    }
-    else
-    {
-        MemFree(item);
-        MemFree(str);
-        throw AppException(this, "TVM_GETITEM !dwRet");
+        text = DecodeString(hTree, str);
+        icon = tvItem->iImage;
+    } catch (...) {
+        arena.Rewind(uMark);
+        throw;
     }
 
+    arena.Rewind(uMark);
+
     return std::make_tuple(text, icon);
 }
 
-typedef struct {
-    uint32_t mask;
-    uint64_t hItem;
-    uint32_t state;
-    uint32_t stateMask;
-    uint64_t dwText;
-    int32_t cchTextMax;
-    int32_t iImage;
-    int32_t iSelectedImage;
-    int32_t cChildren;
-    uint64_t lParam;
-} tvitem64_t;
-
 std::tuple<std::wstring,int>
 AppMonitor::TV_GetItem64(HWND hTree, DWORD_PTR dwItem)
 {
     DWORD_PTR dwRet;
-    AppMem item = MemAlloc(sizeof(tvitem64_t));
-    AppMem str = NewString(hTree, MAX_TV_TEXT);
+    AppArena& arena = GetArena();
+    uint64_t uMark = arena.Mark();
+    AppMem item = arena.Alloc(sizeof(tvitem64_t));
+    AppMem str = NewString(arena, hTree, MAX_TV_TEXT);
 
     std::wstring text = L"";
     int icon = 0;
@@ -480,28 +933,26 @@ AppMonitor::TV_GetItem64(HWND hTree, DWORD_PTR dwItem)
     tvItem->cchTextMax = MAX_TV_TEXT;
     tvItem->dwText = (uint64_t)((uintptr_t)str.App());
 
-    MemWriteApp(item);
-    AppMessage(hTree, IsWindowUnicode(hTree)
-        ? TVM_GETITEMW : TVM_GETITEMA,
-        0, (LPARAM)item.App(), &dwRet
-    );
-    if ((BOOL)dwRet)
-    {
-        MemReadApp(item);
+    try {
+        MemWriteApp(item);
+        AppMessage(hTree, Backend()->IsUnicodeWindow(hTree)
+            ? TVM_GETITEMW : TVM_GETITEMA,
+            0, (LPARAM)item.App(), &dwRet
+        );
+        if (!(BOOL)dwRet)
+            throw AppException(this, "TVM_GETITEM !dwRet");
 
-        text = ReadString(hTree, str);
-        icon = tvItem->iImage;
+        MemReadApp({ item, str });
 
-        MemFree(item);
-        MemFree(str);
-    }
-    else
-    {
-        MemFree(item);
-        MemFree(str);
-        throw AppException(this, "TVM_GETITEM !dwRet");
+        text = DecodeString(hTree, str);
+        icon = tvItem->iImage;
+    } catch (...) {
+        arena.Rewind(uMark);
+        throw;
     }
 
+    arena.Rewind(uMark);
+
     return std::make_tuple(text, icon);
 }
 
@@ -512,4 +963,116 @@ AppMonitor::TV_GetItem(HWND hTree, DWORD_PTR dwItem)
     else return TV_GetItem64(hTree, dwItem);
 }
 
-#endif
\ No newline at end of file
+std::vector<tvnode> AppMonitor::TV_Dump(HWND hTree, tvdumpstats* pStats)
+{
+    auto start = std::chrono::steady_clock::now();
+    bool bUnicode = Backend()->IsUnicodeWindow(hTree);
+    unsigned uItemLen = IsWow64() ? sizeof(tvitem32_t) : sizeof(tvitem64_t);
+    unsigned uItemSpace = (uItemLen + 15) & ~15u;
+    unsigned uCharSize = bUnicode ? sizeof(wchar_t) : sizeof(char);
+
+    // the item with its text right behind it, so that one read brings
+    // both back
+    AppArena& arena = GetArena();
+    uint64_t uMark = arena.Mark();
+    AppMem block = arena.Alloc(uItemSpace + uCharSize * MAX_TV_TEXT);
+    AppMem item(block.This(), block.App(), uItemLen);
+    uint64_t uTextApp = (uint64_t)(uintptr_t)block.App() + uItemSpace;
+    char* pText = (char*)block.This() + uItemSpace;
+
+    std::vector<tvnode> nodes;
+    std::vector<size_t> parents;
+    try {
+        DWORD_PTR hItem = TV_GetNextItem(hTree, TVGN_ROOT);
+        while (hItem || !parents.empty())
+        {
+            if (!hItem)
+            {
+                // subtree done, on to the sibling of its root
+                hItem = TV_GetNextItem(hTree, TVGN_NEXT,
+                    nodes[parents.back()].m_hItem);
+                parents.pop_back();
+                continue;
+            }
+
+            item.Zero();
+            if (IsWow64())
+            {
+                tvitem32_t* tvItem = item.As<tvitem32_t>();
+                tvItem->mask = TVIF_HANDLE | TVIF_TEXT | TVIF_IMAGE
+                    | TVIF_CHILDREN;
+                tvItem->hItem = (uint32_t)hItem;
+                tvItem->cchTextMax = MAX_TV_TEXT;
+                tvItem->dwText = (uint32_t)uTextApp;
+            }
+            else
+            {
+                tvitem64_t* tvItem = item.As<tvitem64_t>();
+                tvItem->mask = TVIF_HANDLE | TVIF_TEXT | TVIF_IMAGE
+                    | TVIF_CHILDREN;
+                tvItem->hItem = (uint64_t)hItem;
+                tvItem->cchTextMax = MAX_TV_TEXT;
+                tvItem->dwText = uTextApp;
+            }
+
+            DWORD_PTR dwRet = 0;
+            MemWriteApp(item);
+            AppMessage(hTree, bUnicode ? TVM_GETITEMW : TVM_GETITEMA,
+                0, (LPARAM)block.App(), &dwRet);
+            if (!(BOOL)dwRet)
+                throw AppException(this, "TVM_GETITEM !dwRet");
+            MemReadApp(block);
+
+            tvnode node;
+            node.m_hItem = hItem;
+            node.m_hParent = parents.empty()
+                ? 0 : nodes[parents.back()].m_hItem;
+            node.m_uDepth = (unsigned)parents.size();
+            if (IsWow64())
+            {
+                node.m_iImage = item.As<tvitem32_t>()->iImage;
+                node.m_iChildren = item.As<tvitem32_t>()->cChildren;
+            }
+            else
+            {
+                node.m_iImage = item.As<tvitem64_t>()->iImage;
+                node.m_iChildren = item.As<tvitem64_t>()->cChildren;
+            }
+            if (bUnicode)
+            {
+                ((wchar_t*)pText)[MAX_TV_TEXT - 1] = L'\0';
+                node.m_Text = (wchar_t*)pText;
+            }
+            else
+            {
+                pText[MAX_TV_TEXT - 1] = '\0';
+                node.m_Text = AnsiToWchar(pText);
+            }
+            nodes.push_back(std::move(node));
+
+            // I_CHILDRENCALLBACK is negative, ask for children then too
+            if (nodes.back().m_iChildren)
+            {
+                parents.push_back(nodes.size() - 1);
+                hItem = TV_GetNextItem(hTree, TVGN_CHILD, hItem);
+            }
+            else
+                hItem = TV_GetNextItem(hTree, TVGN_NEXT, hItem);
+        }
+    } catch (...) {
+        arena.Rewind(uMark);
+        throw;
+    }
+
+    arena.Rewind(uMark);
+
+    if (pStats)
+    {
+        pStats->m_uNodes = nodes.size();
+        pStats->m_dSeconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        pStats->m_dNodesPerSec = pStats->m_dSeconds > 0
+            ? nodes.size() / pStats->m_dSeconds : 0;
+    }
+    return nodes;
+}
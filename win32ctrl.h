@@ -1,12 +1,21 @@
 #ifndef __WIN32CTRL_H
 #define __WIN32CTRL_H
 
-#ifdef WIN32
-#include <Windows.h>
+#include "win32types.h"
+#include "win32backend.h"
+#include "win32wndcache.h"
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <exception>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <span>
 #include <string>
 #include <tuple>
+#include <vector>
 
 class AppMem
 {
@@ -39,11 +48,73 @@ private:
 
 class AppMonitor;
 
+// error code of a failed call, what AppResult is made from on failure
+struct apperror {
+    DWORD m_dwError;
+};
+
+// Value or Win32 error code of a call that does not throw, in the spirit
+// of std::expected, which our compilers do not have yet. Holds nothing
+// but the value and the code, so failing costs no allocation.
+template<typename T>
+class AppResult
+{
+public:
+    AppResult(const T& value)
+        : m_Value(value), m_dwError(ERROR_SUCCESS)
+    {
+    }
+
+    AppResult(apperror error)
+        : m_Value(), m_dwError(error.m_dwError)
+    {
+    }
+
+    explicit operator bool() const { return m_dwError == ERROR_SUCCESS; }
+    bool HasValue() const { return m_dwError == ERROR_SUCCESS; }
+    bool IsTimeOut() const { return m_dwError == ERROR_TIMEOUT; }
+    DWORD Error() const { return m_dwError; }
+
+    const T& Value() const { return m_Value; }
+    T ValueOr(const T& other) const
+    {
+        return HasValue() ? m_Value : other;
+    }
+private:
+    T m_Value;
+    DWORD m_dwError;
+};
+
+template<>
+class AppResult<void>
+{
+public:
+    AppResult()
+        : m_dwError(ERROR_SUCCESS)
+    {
+    }
+
+    AppResult(apperror error)
+        : m_dwError(error.m_dwError)
+    {
+    }
+
+    explicit operator bool() const { return m_dwError == ERROR_SUCCESS; }
+    bool HasValue() const { return m_dwError == ERROR_SUCCESS; }
+    bool IsTimeOut() const { return m_dwError == ERROR_TIMEOUT; }
+    DWORD Error() const { return m_dwError; }
+private:
+    DWORD m_dwError;
+};
+
 class AppException : public std::exception
 {
 public:
+    // the error is the backend's last one
     AppException(AppMonitor* app,
         const std::string& text);
+    AppException(AppMonitor* app,
+        const std::string& text, DWORD dwError);
 
     virtual AppMonitor* GetApp() const
     {
@@ -57,8 +128,11 @@ public:
 
     virtual const char* what() const noexcept;
 private:
+    void Format();
+
     AppMonitor* m_pApp;
     std::string m_Text;
+    std::string m_What;
     DWORD m_dwError;
 };
 
@@ -66,7 +140,7 @@ class AppTimeOut : public AppException
 {
 public:
     AppTimeOut(AppMonitor* app, UINT uMsg)
-        : AppException(app, "[AppTimeOut]"),
+        : AppException(app, "[AppTimeOut]", ERROR_TIMEOUT),
         m_uMsg(uMsg)
     {
     }
@@ -83,6 +157,70 @@ private:
 #define APP_MSG_TIMEOUT 60*1000
 #define MAX_WM_TEXT 4096
 #define MAX_TV_TEXT 256
+#define APP_ARENA_CHUNK 64*1024
+
+// Remote memory handed out from a few large MemAlloc blocks instead of
+// one VirtualAllocEx per request. Allocations are zeroed locally and
+// released together by rewinding to a Mark() or by Reset(); a request
+// larger than the chunk size gets a block of its own. Blocks come from
+// MemAlloc, so a WOW64 target still only sees addresses below 4GB. Not
+// thread-safe, like the monitor's other state.
+class AppArena
+{
+public:
+    AppArena(AppMonitor* app, unsigned uChunk = APP_ARENA_CHUNK);
+    ~AppArena();
+
+    // owns its remote blocks, a copy would free them twice
+    AppArena(const AppArena&) = delete;
+    AppArena& operator=(const AppArena&) = delete;
+
+    AppMem Alloc(unsigned uLen);
+    uint64_t Mark() const;
+    void Rewind(uint64_t uMark);
+    void Reset();
+    // frees the remote blocks
+    void Release();
+
+    size_t Chunks() const
+    {
+        return m_Chunks.size();
+    }
+private:
+    AppMonitor* m_pApp;
+    unsigned m_uChunk;
+    std::vector<AppMem> m_Chunks;
+    size_t m_uCurrent;
+    unsigned m_uOffset;
+};
+
+// one TreeView item as TV_Dump returns it
+struct tvnode {
+    DWORD_PTR m_hItem;
+    DWORD_PTR m_hParent;
+    unsigned m_uDepth;
+    std::wstring m_Text;
+    int m_iImage;
+    int m_iChildren;
+};
+
+// remote memory traffic: regions asked for and the system calls that
+// moved them, the difference is what batching saved
+struct appmemstats {
+    uint64_t m_uRegions = 0;
+    uint64_t m_uCalls = 0;
+    uint64_t m_uSaved = 0;
+};
+
+struct tvdumpstats {
+    size_t m_uNodes = 0;
+    double m_dSeconds = 0;
+    double m_dNodesPerSec = 0;
+};
+
+// requests of AppMessageAsync in flight, shared with the backend's
+// callbacks so a late answer can never reach a destroyed monitor
+struct appasync;
 
 class AppMonitor
 {
@@ -91,15 +229,33 @@ public:
 
     AppMonitor();
     AppMonitor(const std::wstring& exePath);
+    // all system calls go through pBackend, which must outlive the monitor
+    AppMonitor(AppBackend* pBackend, const std::wstring& exePath = L"");
     virtual ~AppMonitor();
 
     typedef std::function<bool(AppMonitor*, HWND)> EnumFunc;
+    typedef std::function<void(AppMonitor*,
+        const AppResult<DWORD_PTR>&)> MessageFunc;
 
-    friend BOOL CALLBACK _EnumAppWindows(HWND, LPARAM);
-    void EnumAppWindows(EnumFunc func);
-    void EnumAppControls(HWND hWnd, EnumFunc func);
+    AppBackend* GetBackend() const
+    {
+        return m_pBackend;
+    }
+
+    // Enumerations keep their state on the caller's stack, they can be
+    // nested in each other's callbacks and run from several threads on
+    // one monitor, as far as the backend allows (all of ours do).
+    void EnumAppWindows(const EnumFunc& func);
+    void EnumAppControls(HWND hWnd, const EnumFunc& func);
     HWND FindAppWindow(const std::string& wndClass);
 
+    // FindAppWindow and GetChild answered from a snapshot of the app's
+    // windows instead of the desktop, see AppWindowCache; off by default.
+    // Lookups through the monitor are serialized, the cache itself is not
+    // thread-safe.
+    void UseWindowCache(bool bUse);
+    AppWindowCache& GetWindowCache();
+
     virtual HANDLE GetAppProcess() const
     {
         return m_hAppProcess;
@@ -130,16 +286,74 @@ public:
     virtual void MemFree(AppMem& mem);
     virtual void MemWriteApp(const AppMem& mem);
     virtual void MemReadApp(const AppMem& mem);
+    AppResult<void> TryMemWriteApp(const AppMem& mem);
+    AppResult<void> TryMemReadApp(const AppMem& mem);
+
+    // Many regions in as few calls as possible: regions of one buffer
+    // that touch or overlap in the target are merged, the rest go out
+    // together where the backend can (process_vm_readv/writev). Writes
+    // to overlapping regions of different buffers land in address order.
+    virtual void MemWriteApp(std::span<const AppMem> mems);
+    virtual void MemReadApp(std::span<const AppMem> mems);
+    void MemWriteApp(std::initializer_list<AppMem> mems)
+    {
+        MemWriteApp(std::span<const AppMem>(mems.begin(), mems.size()));
+    }
+    void MemReadApp(std::initializer_list<AppMem> mems)
+    {
+        MemReadApp(std::span<const AppMem>(mems.begin(), mems.size()));
+    }
+
+    AppResult<void> TryMemWriteApp(std::span<const AppMem> mems);
+    AppResult<void> TryMemReadApp(std::span<const AppMem> mems);
+
+    appmemstats GetMemStats() const;
+    void ResetMemStats();
+
+    // scratch memory for the monitor's own requests, created on first
+    // use and released with the process
+    AppArena& GetArena();
 
     virtual bool AppMessage(HWND hWnd, UINT uMsg,
         WPARAM wParam, LPARAM lParam,
         DWORD_PTR* pResult = NULL,
         unsigned uTimeOut = APP_MSG_TIMEOUT);
+    // AppMessage for loops where failing is normal: the message result,
+    // or ERROR_TIMEOUT and the like, without an exception. The Try
+    // functions never throw AppException, the throwing ones wrap them.
+    AppResult<DWORD_PTR> TryAppMessage(HWND hWnd, UINT uMsg,
+        WPARAM wParam, LPARAM lParam,
+        unsigned uTimeOut = APP_MSG_TIMEOUT);
     virtual void AppPostMessage(HWND hWnd, UINT uMsg,
         WPARAM wParam, LPARAM lParam);
 
+    // AppMessage without waiting, so one thread can keep many messages
+    // in flight. func is called exactly once: with the result, with
+    // ERROR_TIMEOUT once uTimeOut ms have passed without one, or with
+    // ERROR_CANCELLED. Results and timeouts are delivered by PumpMessages
+    // on the thread that sent the message. A message that cannot be sent
+    // (WM_GETTEXT and other pointer messages below WM_USER go only
+    // synchronously) calls func at once and returns 0, otherwise the
+    // request id.
+    DWORD_PTR AppMessageAsync(HWND hWnd, UINT uMsg,
+        WPARAM wParam, LPARAM lParam, const MessageFunc& func,
+        unsigned uTimeOut = APP_MSG_TIMEOUT);
+    // func gets ERROR_CANCELLED on this thread, a late answer is dropped
+    bool CancelMessage(DWORD_PTR dwRequest);
+    // also done by CloseApp and Terminate; when the monitor is destroyed
+    // the callbacks get ERROR_CANCELLED with a NULL monitor
+    void CancelMessages();
+    // delivers answers and timeouts of this thread's requests, waiting
+    // up to dwTimeOut ms for the first; the number of callbacks run
+    size_t PumpMessages(DWORD dwTimeOut = 0);
+    // requests in flight, from every thread
+    size_t PendingMessages() const;
+
     virtual AppMem NewString(HWND hWnd, DWORD dwChars);
+    virtual AppMem NewString(AppArena& arena, HWND hWnd, DWORD dwChars);
     virtual std::wstring ReadString(HWND hWnd, const AppMem& str);
+    // same for a string already read
+    std::wstring DecodeString(HWND hWnd, const AppMem& str);
 
     virtual std::wstring GetWindowTextStr(HWND hWnd);
     virtual std::wstring GetControlTextStr(HWND hWnd);
@@ -154,19 +368,33 @@ private:
 public:
     virtual std::tuple<std::wstring,int>
         TV_GetItem(HWND hTree, DWORD_PTR dwItem);
+
+    // the whole tree depth-first, parents before their children, through
+    // one remote block reused for every item
+    virtual std::vector<tvnode> TV_Dump(HWND hTree,
+        tvdumpstats* pStats = NULL);
 private:
+    AppBackend* Backend();
+
+    AppResult<void> MemTransfer(std::span<const AppMem> mems, bool bWrite);
+    apperror BackendError(DWORD dwDefault) const;
+    DWORD ExpireMessages(std::chrono::steady_clock::time_point until);
+    void CancelAll(AppMonitor* app);
+    void ClearWindowCache();
+
+    AppBackend* m_pBackend;
+    std::unique_ptr<AppArena> m_pArena;
+    std::unique_ptr<AppWindowCache> m_pWindows;
+    std::mutex m_WindowsLock;
+    std::atomic<bool> m_bUseWindows;
+    std::atomic<uint64_t> m_uMemRegions;
+    std::atomic<uint64_t> m_uMemCalls;
+    std::shared_ptr<appasync> m_pAsync;
     std::wstring m_ExePath;
 
     HANDLE m_hAppProcess;
     DWORD m_dwPid;
     BOOL m_bWow64;
-
-    struct _app_tmp_s {
-        EnumFunc m_Func = NULL;
-        std::string m_Class;
-        HWND m_hWnd = NULL;
-    } m_Tmp;
 };
-#endif
 
 #endif
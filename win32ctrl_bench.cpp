@@ -0,0 +1,908 @@
+#include "win32ctrl.h"
+#include "win32pool.h"
+#include "win32sim.h"
+#include "win32util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef WIN32
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+using bench_clock = std::chrono::steady_clock;
+
+struct bench_result {
+    std::string m_Name;
+    double m_dValue;
+    std::string m_Unit;
+    bool m_bOk;
+};
+
+struct bench_app {
+    size_t m_uForeign;
+    size_t m_uControls;
+    size_t m_uTreeItems;
+    unsigned m_uMessageNs;
+    unsigned m_uMemoryNs;
+    bool m_bSpin;
+};
+
+static std::vector<bench_result> s_Results;
+static double s_dBenchTime = 0.5;
+
+// calls per second of func, run for the --time setting
+static double BenchRate(const std::function<void()>& func)
+{
+    uint64_t uCalls = 0;
+    auto start = bench_clock::now();
+    auto deadline = start + std::chrono::duration<double>(s_dBenchTime);
+    auto now = start;
+
+    do {
+        func();
+        uCalls++;
+        now = bench_clock::now();
+    } while (now < deadline);
+
+    return uCalls / std::chrono::duration<double>(now - start).count();
+}
+
+static void Report(const std::string& name, double dValue,
+    const char* unit = "calls/s", bool bOk = true)
+{
+    int iDigits = dValue < 100 ? 3 : dValue < 10000 ? 1 : 0;
+    printf("%-40s %14.*f %s%s\n", name.c_str(), iDigits, dValue, unit,
+        bOk ? "" : " MISMATCH");
+    s_Results.push_back({ name, dValue, unit, bOk });
+}
+
+static std::string JsonString(const std::string& text)
+{
+    std::string out = "\"";
+    for (char ch : text)
+    {
+        if (ch == '"' || ch == '\\')
+            out += '\\';
+        out += ch;
+    }
+    return out + "\"";
+}
+
+static bool WriteJson(const char* path, const bench_app& app)
+{
+    FILE* fp = fopen(path, "w");
+    if (!fp)
+        return false;
+
+    fprintf(fp, "{\n  \"backend\": \"sim\",\n");
+    fprintf(fp, "  \"time\": %g,\n", s_dBenchTime);
+    fprintf(fp, "  \"app\": { \"foreign\": %zu, \"controls\": %zu, "
+        "\"tree_items\": %zu, \"message_ns\": %u, \"memory_ns\": %u, "
+        "\"spin\": %s },\n", app.m_uForeign, app.m_uControls,
+        app.m_uTreeItems, app.m_uMessageNs, app.m_uMemoryNs,
+        app.m_bSpin ? "true" : "false");
+    fprintf(fp, "  \"results\": [\n");
+    for (size_t i = 0; i < s_Results.size(); i++)
+    {
+        auto& result = s_Results[i];
+        fprintf(fp, "    { \"name\": %s, \"value\": %.10g, "
+            "\"unit\": %s, \"ok\": %s }%s\n",
+            JsonString(result.m_Name).c_str(),
+            std::isfinite(result.m_dValue) ? result.m_dValue : 0.0,
+            JsonString(result.m_Unit).c_str(),
+            result.m_bOk ? "true" : "false",
+            i + 1 < s_Results.size() ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+
+    return !fclose(fp);
+}
+
+// ANSI controls only carry what the code page has
+static std::wstring ItemText(size_t uIndex, bool bUnicode)
+{
+    return L"item " + std::to_wstring(uIndex)
+        + (bUnicode ? L" \u00e9t\u00e9" : L" ete");
+}
+
+// a main window with uControls edits and a TreeView of uTreeItems items,
+// sixteen to a level, behind m_uForeign windows of other processes
+static HWND MakeApp(SimBackend& sim, const bench_app& app, bool bUnicode,
+    HWND& hTree, std::vector<DWORD_PTR>& items)
+{
+    for (size_t i = 0; i < app.m_uForeign; i++)
+        sim.AddForeignWindow("ForeignWnd", L"foreign");
+
+    HWND hMain = sim.AddWindow(NULL, "MainWnd", L"Main window");
+    HWND hPanel = sim.AddWindow(hMain, "Panel", L"");
+    for (size_t i = 0; i < app.m_uControls; i++)
+        sim.AddWindow(i % 2 ? hPanel : hMain, "Edit",
+            L"text " + std::to_wstring(i), bUnicode);
+
+    hTree = sim.AddWindow(hPanel, "SysTreeView32", L"", bUnicode);
+    items.clear();
+    for (size_t i = 0; i < app.m_uTreeItems; i++)
+    {
+        DWORD_PTR hParent = i < 16 ? 0 : items[i / 16 - 1];
+        items.push_back(sim.AddTreeItem(hTree, hParent,
+            ItemText(i, bUnicode), (int)(i % 7)));
+    }
+
+    return hMain;
+}
+
+// depth-first walk the way callers of TV_GetItem do it
+static size_t WalkTree(AppMonitor& mon, HWND hTree, DWORD_PTR hItem,
+    std::vector<std::wstring>& texts)
+{
+    size_t uItems = 0;
+    for (; hItem; hItem = mon.TV_GetNextItem(hTree, TVGN_NEXT, hItem))
+    {
+        texts.push_back(std::get<0>(mon.TV_GetItem(hTree, hItem)));
+        uItems += 1 + WalkTree(mon, hTree,
+            mon.TV_GetNextItem(hTree, TVGN_CHILD, hItem), texts);
+    }
+    return uItems;
+}
+
+static bool BenchApp(const bench_app& app, bool bWow64, bool bUnicode)
+{
+    SimBackend sim(bWow64);
+    HWND hTree;
+    std::vector<DWORD_PTR> items;
+    HWND hMain = MakeApp(sim, app, bUnicode, hTree, items);
+    sim.SetLatency(app.m_uMessageNs, app.m_uMemoryNs, app.m_bSpin);
+
+    AppMonitor mon(&sim, L"C:\\sim\\app.exe");
+    if (!mon.StartApp(L"") || mon.IsWow64() != bWow64)
+    {
+        Report("StartApp", 0, "", false);
+        return false;
+    }
+
+    std::string prefix = std::string(bWow64 ? "wow64 " : "x64 ")
+        + (bUnicode ? "W " : "A ");
+
+    bool bFound = mon.FindAppWindow("MainWnd") == hMain;
+    Report(prefix + "FindAppWindow", BenchRate([&]() {
+        mon.FindAppWindow("MainWnd");
+    }), "calls/s", bFound);
+
+    size_t uControls = 0;
+    mon.EnumAppControls(hMain, [&](AppMonitor*, HWND) {
+        uControls++;
+        return true;
+    });
+    Report(prefix + "EnumAppControls", BenchRate([&]() {
+        mon.EnumAppControls(hMain, [](AppMonitor*, HWND) {
+            return true;
+        });
+    }), "calls/s", uControls == app.m_uControls + 2);
+
+    HWND hEdit = mon.GetChild(hMain, "Edit");
+    bool bText = mon.GetControlTextStr(hEdit) == L"text 0";
+    Report(prefix + "GetControlTextStr", BenchRate([&]() {
+        mon.GetControlTextStr(hEdit);
+    }), "calls/s", bText);
+
+    // the same lookups against the window snapshot
+    HWND hPanel = mon.GetChild(hMain, "Panel");
+    auto lookups = [&](uint64_t& uCalls) {
+        sim.ResetStats();
+        HWND hFound = mon.FindAppWindow("MainWnd");
+        HWND hChild = mon.GetChild(hPanel, "SysTreeView32");
+        sim.ResetStats();
+        for (int i = 0; i < 100; i++)
+        {
+            mon.FindAppWindow("MainWnd");
+            mon.GetChild(hPanel, "SysTreeView32");
+        }
+        uCalls = sim.Stats().m_uWindowCalls / 200;
+        return hFound == hMain && hChild == hTree;
+    };
+
+    uint64_t uDirect, uCached;
+    bool bDirect = lookups(uDirect);
+    Report(prefix + "GetChild", BenchRate([&]() {
+        mon.GetChild(hPanel, "SysTreeView32");
+    }), "calls/s", bDirect);
+    Report(prefix + "window calls per lookup", (double)uDirect, "calls");
+
+    mon.UseWindowCache(true);
+    mon.GetWindowCache().SetMaxAge(INFINITE);
+    bool bCached = lookups(uCached);
+    Report(prefix + "FindAppWindow cached", BenchRate([&]() {
+        mon.FindAppWindow("MainWnd");
+    }), "calls/s", bCached);
+    Report(prefix + "GetChild cached", BenchRate([&]() {
+        mon.GetChild(hPanel, "SysTreeView32");
+    }), "calls/s", bCached);
+    Report(prefix + "window calls per cached lookup", (double)uCached,
+        "calls");
+
+    // a new window is found by the refresh on miss, which only queries
+    // that window; a closed one is skipped for the next of its class
+    HWND hLate = sim.AddWindow(hPanel, "Button", L"late");
+    bool bLate = mon.GetChild(hPanel, "button") == hLate
+        && mon.GetWindowCache().Queried() == 1;
+    sim.SendAppMessage(hEdit, WM_CLOSE, 0, 0);
+    HWND hNext = mon.GetChild(hMain, "Edit");
+    bool bCase = mon.FindAppWindow("MAINWND") == hMain;
+    mon.UseWindowCache(false);
+    bLate = bLate && hNext && hNext != hEdit
+        && hNext == mon.GetChild(hMain, "Edit")
+        && bCase && mon.FindAppWindow("MAINWND") == hMain;
+    Report(prefix + "window cache refreshes",
+        (double)mon.GetWindowCache().Refreshes(), "refreshes", bLate);
+
+    // one full walk, counted on the simulated side
+    std::vector<std::wstring> texts;
+    sim.ResetStats();
+    mon.ResetMemStats();
+    auto start = bench_clock::now();
+    size_t uItems = WalkTree(mon, hTree,
+        mon.TV_GetNextItem(hTree, TVGN_ROOT), texts);
+    double dSeconds = std::chrono::duration<double>(
+        bench_clock::now() - start).count();
+    SimBackend::simstats stats = sim.Stats();
+
+    bool bTree = uItems == app.m_uTreeItems;
+    std::vector<bool> seen(app.m_uTreeItems);
+    for (auto& text : texts)
+    {
+        size_t uIndex = wcstoul(text.c_str() + 5, NULL, 10);
+        bTree = bTree && uIndex < seen.size() && !seen[uIndex]
+            && text == ItemText(uIndex, bUnicode);
+        if (uIndex < seen.size())
+            seen[uIndex] = true;
+    }
+
+    double dItems = uItems ? (double)uItems : 1.0;
+    Report(prefix + "TreeView walk", uItems / dSeconds, "items/s", bTree);
+    Report(prefix + "TreeView messages", stats.m_uMessages / dItems,
+        "msgs/item");
+    Report(prefix + "TreeView memory calls", (stats.m_uReads
+        + stats.m_uWrites + stats.m_uAllocs + stats.m_uFrees) / dItems,
+        "calls/item");
+    Report(prefix + "TreeView virtual time",
+        stats.m_uVirtualNs / dItems, "ns/item");
+    Report(prefix + "TreeView remote allocations",
+        stats.m_uAllocs / dItems, "allocs/item");
+    Report(prefix + "TreeView memory calls saved",
+        mon.GetMemStats().m_uSaved / dItems, "calls/item");
+
+    // the same tree in bulk, checked against how it was built
+    tvdumpstats dump;
+    sim.ResetStats();
+    std::vector<tvnode> nodes = mon.TV_Dump(hTree, &dump);
+    stats = sim.Stats();
+
+    bool bDump = nodes.size() == app.m_uTreeItems
+        && nodes.size() == texts.size();
+    for (size_t i = 0; bDump && i < nodes.size(); i++)
+    {
+        auto& node = nodes[i];
+        size_t uIndex = wcstoul(node.m_Text.c_str() + 5, NULL, 10);
+        bool bChildren = (uIndex + 1) * 16 < app.m_uTreeItems;
+        bDump = uIndex < items.size() && node.m_Text == texts[i]
+            && node.m_hItem == items[uIndex]
+            && node.m_hParent == (uIndex < 16 ? 0 : items[uIndex / 16 - 1])
+            && node.m_iImage == (int)(uIndex % 7)
+            && !!node.m_iChildren == bChildren
+            && (!node.m_uDepth || nodes[i - 1].m_uDepth + 1 >= node.m_uDepth);
+    }
+
+    dItems = nodes.empty() ? 1.0 : (double)nodes.size();
+    Report(prefix + "TV_Dump", dump.m_dNodesPerSec, "nodes/s", bDump);
+    Report(prefix + "TV_Dump messages", stats.m_uMessages / dItems,
+        "msgs/node");
+    Report(prefix + "TV_Dump memory calls", (stats.m_uReads
+        + stats.m_uWrites + stats.m_uAllocs + stats.m_uFrees) / dItems,
+        "calls/node");
+    Report(prefix + "TV_Dump virtual time",
+        stats.m_uVirtualNs / dItems, "ns/node");
+
+    // a hung control times out instead of blocking the walk
+    sim.SetHung(hTree, true);
+    bool bTimeOut = false;
+    try {
+        mon.TV_GetNextItem(hTree, TVGN_ROOT);
+    } catch (AppTimeOut& e) {
+        bTimeOut = e.GetMessage() == TVM_GETNEXTITEM
+            && e.GetError() == ERROR_TIMEOUT;
+    }
+    sim.SetHung(hTree, false);
+    Report(prefix + "hung control timeouts", (double)sim.Stats().m_uTimeOuts,
+        "msgs", bTimeOut);
+
+    mon.CloseApp();
+    bool bExited = sim.WaitProcess(mon.GetAppProcess(), 0) != WAIT_TIMEOUT;
+    Report(prefix + "CloseApp", 1, "exits", bExited);
+    Report(prefix + "live remote allocations",
+        (double)sim.LiveAllocations(), "blocks",
+        sim.LiveAllocations() == 0);
+
+    return bFound && bText && bTree && bTimeOut && bExited
+        && !sim.LiveAllocations();
+}
+
+// Enumerations from several threads on one monitor, each nesting a
+// control enumeration and a window lookup inside the outer callback,
+// which is what m_Tmp used to make impossible.
+static void BenchConcurrentEnum(const bench_app& app, unsigned uThreads)
+{
+    SimBackend sim;
+    HWND hTree;
+    std::vector<DWORD_PTR> items;
+    HWND hMain = MakeApp(sim, app, true, hTree, items);
+
+    AppMonitor mon(&sim, L"C:\\sim\\app.exe");
+    mon.StartApp(L"");
+
+    std::atomic<uint64_t> uEnums(0), uBad(0);
+    std::atomic<bool> bStop(false);
+    auto worker = [&]() {
+        while (!bStop)
+        {
+            size_t uTop = 0, uControls = 0;
+            HWND hNested = NULL;
+            mon.EnumAppWindows([&](AppMonitor* pMon, HWND hWnd) {
+                uTop++;
+                pMon->EnumAppControls(hWnd, [&](AppMonitor* pInner, HWND) {
+                    if (!uControls++)
+                        hNested = pInner->FindAppWindow("MainWnd");
+                    return true;
+                });
+                return true;
+            });
+
+            if (uTop != 1 || uControls != app.m_uControls + 2
+                || hNested != hMain)
+            {
+                uBad++;
+            }
+            uEnums++;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    auto start = bench_clock::now();
+    for (unsigned i = 0; i < uThreads; i++)
+        threads.emplace_back(worker);
+    std::this_thread::sleep_for(
+        std::chrono::duration<double>(s_dBenchTime));
+    bStop = true;
+    for (auto& thread : threads)
+        thread.join();
+    double dSeconds = std::chrono::duration<double>(
+        bench_clock::now() - start).count();
+
+    Report("nested enumerations, " + std::to_string(uThreads)
+        + " threads", uEnums / dSeconds, "enums/s", !uBad && uEnums);
+}
+
+// TVM_GETNEXTITEM for every item, one message at a time and with up
+// to uInFlight messages in flight, then deadlines and cancellation of
+// asynchronous messages to a hung control next to a live one.
+static void BenchAsync(const bench_app& app, size_t uInFlight)
+{
+    SimBackend sim;
+    HWND hTree;
+    std::vector<DWORD_PTR> items;
+    HWND hMain = MakeApp(sim, app, true, hTree, items);
+    sim.SetLatency(app.m_uMessageNs, app.m_uMemoryNs, app.m_bSpin);
+
+    AppMonitor mon(&sim, L"C:\\sim\\app.exe");
+    mon.StartApp(L"");
+
+    std::vector<DWORD_PTR> expected(items.size());
+    sim.ResetStats();
+    for (size_t i = 0; i < items.size(); i++)
+        mon.AppMessage(hTree, TVM_GETNEXTITEM, TVGN_CHILD, items[i],
+            &expected[i]);
+    uint64_t uSyncNs = sim.Stats().m_uVirtualNs;
+
+    std::vector<DWORD_PTR> results(items.size(), ~(DWORD_PTR)0);
+    size_t uNext = 0, uFailed = 0;
+    sim.ResetStats();
+    while (uNext < items.size() || mon.PendingMessages())
+    {
+        for (; uNext < items.size()
+            && mon.PendingMessages() < uInFlight; uNext++)
+        {
+            mon.AppMessageAsync(hTree, TVM_GETNEXTITEM, TVGN_CHILD,
+                items[uNext], [&results, &uFailed, uNext](AppMonitor*,
+                    const AppResult<DWORD_PTR>& result) {
+                    if (result)
+                        results[uNext] = result.Value();
+                    else
+                        uFailed++;
+                });
+        }
+        mon.PumpMessages(INFINITE);
+    }
+    uint64_t uAsyncNs = sim.Stats().m_uVirtualNs;
+
+    double dItems = items.empty() ? 1.0 : (double)items.size();
+    std::string suffix = ", " + std::to_string(uInFlight) + " in flight";
+    Report("AppMessage virtual time", uSyncNs / dItems, "ns/msg");
+    Report("AppMessageAsync virtual time" + suffix, uAsyncNs / dItems,
+        "ns/msg", results == expected && !uFailed);
+
+    // the hung control times out on its own deadline while the live
+    // window next to it answers, its late answer is dropped
+    HWND hEdit = sim.FindChildWindow(hMain, "Edit", NULL);
+    sim.SetHung(hTree, true);
+    DWORD dwHung = ERROR_SUCCESS, dwLive = ERROR_TIMEOUT;
+    size_t uCalls = 0;
+    auto start = bench_clock::now();
+    mon.AppMessageAsync(hTree, TVM_GETNEXTITEM, TVGN_ROOT, 0,
+        [&](AppMonitor*, const AppResult<DWORD_PTR>& result) {
+            dwHung = result.Error();
+            uCalls++;
+        }, 20);
+    mon.AppMessageAsync(hEdit, WM_GETTEXTLENGTH, 0, 0,
+        [&](AppMonitor*, const AppResult<DWORD_PTR>& result) {
+            dwLive = result.Error();
+            uCalls++;
+        });
+    while (mon.PendingMessages())
+        mon.PumpMessages(INFINITE);
+    double dWaited = std::chrono::duration<double>(
+        bench_clock::now() - start).count();
+    sim.SetHung(hTree, false);
+    size_t uLate = mon.PumpMessages(0);
+    Report("AppMessageAsync deadline", dWaited * 1000, "ms",
+        dwHung == ERROR_TIMEOUT && dwLive == ERROR_SUCCESS
+        && uCalls == 2 && !uLate && dWaited < 1.0);
+
+    sim.SetHung(hTree, true);
+    DWORD dwCancelled = ERROR_SUCCESS;
+    DWORD_PTR dwRequest = mon.AppMessageAsync(hTree, TVM_GETNEXTITEM,
+        TVGN_ROOT, 0, [&](AppMonitor*, const AppResult<DWORD_PTR>& result) {
+            dwCancelled = result.Error();
+        });
+    bool bCancelled = mon.CancelMessage(dwRequest)
+        && dwCancelled == ERROR_CANCELLED && !mon.PendingMessages();
+    sim.SetHung(hTree, false);
+    bCancelled = bCancelled && !mon.PumpMessages(0);
+    Report("AppMessageAsync cancelled", 1, "requests", bCancelled);
+
+    // the system cannot marshal WM_GETTEXT's buffer asynchronously
+    DWORD dwSyncOnly = ERROR_SUCCESS;
+    DWORD_PTR dwText = mon.AppMessageAsync(hEdit, WM_GETTEXT, 0, 0,
+        [&](AppMonitor*, const AppResult<DWORD_PTR>& result) {
+            dwSyncOnly = result.Error();
+        });
+    Report("AppMessageAsync WM_GETTEXT", 1, "refused",
+        !dwText && dwSyncOnly == ERROR_MESSAGE_SYNC_ONLY);
+
+    // a monitor destroyed with requests in flight no longer exists for
+    // their callbacks
+    sim.SetHung(hTree, true);
+    bool bOrphaned = false;
+    {
+        AppMonitor other(&sim, L"C:\\sim\\app.exe");
+        other.AppMessageAsync(hTree, TVM_GETNEXTITEM, TVGN_ROOT, 0,
+            [&](AppMonitor* pMon, const AppResult<DWORD_PTR>& result) {
+                bOrphaned = !pMon && result.Error() == ERROR_CANCELLED;
+            });
+    }
+    sim.SetHung(hTree, false);
+    bOrphaned = bOrphaned && !mon.PumpMessages(0);
+    Report("AppMessageAsync monitor destroyed", 1, "requests", bOrphaned);
+
+    mon.CloseApp();
+}
+
+// One tree dump from each of uApps applications whose latency is slept,
+// like a thread blocked on another process: one thread after another
+// against AppMonitorPool. The first application is ten times slower,
+// its result has to come last and not hold up the others.
+static void BenchPool(const bench_app& app, size_t uApps)
+{
+    bench_app small = app;
+    small.m_uForeign = 0;
+    small.m_uTreeItems = std::min<size_t>(app.m_uTreeItems, 256);
+
+    std::vector<std::unique_ptr<SimBackend>> sims;
+    std::vector<HWND> trees;
+    AppMonitorPool pool;
+    for (size_t i = 0; i < uApps; i++)
+    {
+        sims.emplace_back(new SimBackend());
+        SimBackend& sim = *sims.back();
+        HWND hTree;
+        std::vector<DWORD_PTR> items;
+        MakeApp(sim, small, true, hTree, items);
+        unsigned uSlow = i || uApps == 1 ? 1 : 10;
+        sim.SetLatency(app.m_uMessageNs * uSlow, app.m_uMemoryNs * uSlow,
+            true);
+        sim.SetBlocking(true);
+        trees.push_back(hTree);
+
+        std::unique_ptr<AppMonitor> pMon(
+            new AppMonitor(&sim, L"C:\\sim\\app.exe"));
+        pMon->StartApp(L"");
+        pool.Add(std::move(pMon));
+    }
+
+    bool bOk = true;
+    auto start = bench_clock::now();
+    for (size_t i = 0; i < uApps; i++)
+        bOk = bOk && pool.Monitor(i)->TV_Dump(trees[i]).size()
+            == small.m_uTreeItems;
+    double dSerial = std::chrono::duration<double>(
+        bench_clock::now() - start).count();
+
+    start = bench_clock::now();
+    for (size_t i = 0; i < uApps; i++)
+        pool.DumpTree(i, trees[i]);
+    appjob job;
+    size_t uLast = 0;
+    while (pool.Pending() && pool.Next(job))
+    {
+        bOk = bOk && job.m_bOk && job.m_Kind == AppJobDumpTree
+            && job.m_Nodes.size() == small.m_uTreeItems;
+        uLast = job.m_uMonitor;
+    }
+    double dPool = std::chrono::duration<double>(
+        bench_clock::now() - start).count();
+
+    // and a job that fails
+    pool.Submit(0, [](AppMonitor* pMon, appjob&) {
+        pMon->AppMessage(NULL, WM_GETTEXTLENGTH, 0, 0);
+    });
+    bool bFailed = pool.Next(job) && !job.m_bOk
+        && job.m_dwError == ERROR_INVALID_WINDOW_HANDLE;
+    pool.Submit(0, [](AppMonitor*, appjob&) { throw 1; });
+    bFailed = bFailed && pool.Next(job) && !job.m_bOk;
+
+    // answered after the job that sent it has returned
+    std::atomic<bool> bAnswered(false);
+    HWND hTree0 = trees[0];
+    pool.Submit(0, [&bAnswered, hTree0](AppMonitor* pMon, appjob&) {
+        pMon->AppMessageAsync(hTree0, TVM_GETNEXTITEM, TVGN_ROOT, 0,
+            [&bAnswered](AppMonitor*, const AppResult<DWORD_PTR>& result) {
+                bAnswered = (bool)result;
+            });
+    });
+    bool bPumped = pool.Next(job) && job.m_bOk;
+    for (int i = 0; i < 1000 && !bAnswered; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    bPumped = bPumped && bAnswered;
+
+    std::string suffix = ", " + std::to_string(uApps) + " apps";
+    Report("TV_Dump one app after another" + suffix, uApps / dSerial,
+        "trees/s", bOk);
+    Report("AppMonitorPool DumpTree" + suffix, uApps / dPool, "trees/s",
+        bOk && uLast == 0 && bFailed && bPumped && !pool.Pending());
+
+    pool.Stop();
+    for (size_t i = 0; i < uApps; i++)
+        pool.Monitor(i)->CloseApp();
+}
+
+// Polling loops where most calls fail: a hung window and a read past
+// the end of a remote block, through the throwing API and the Try one.
+// No latency, so the rates compare the cost of reporting the failure.
+static void BenchFailures(const bench_app& app)
+{
+    SimBackend sim;
+    HWND hTree;
+    std::vector<DWORD_PTR> items;
+    MakeApp(sim, app, true, hTree, items);
+    sim.SetLatency(0, 0);
+
+    AppMonitor mon(&sim, L"C:\\sim\\app.exe");
+    mon.StartApp(L"");
+    sim.SetHung(hTree, true);
+
+    bool bThrown = true;
+    Report("failing AppMessage, catch", BenchRate([&]() {
+        try {
+            mon.AppMessage(hTree, TVM_GETNEXTITEM, TVGN_ROOT, 0);
+            bThrown = false;
+        } catch (AppTimeOut&) {
+        }
+    }), "calls/s", bThrown);
+
+    bool bTimeOut = true;
+    Report("failing TryAppMessage", BenchRate([&]() {
+        AppResult<DWORD_PTR> result = mon.TryAppMessage(hTree,
+            TVM_GETNEXTITEM, TVGN_ROOT, 0);
+        bTimeOut = bTimeOut && result.IsTimeOut();
+    }), "calls/s", bTimeOut);
+    sim.SetHung(hTree, false);
+
+    // reads one byte more than was allocated
+    AppMem mem = mon.MemAlloc(256);
+    char szBuf[257];
+    AppMem past(szBuf, mem.App(), sizeof(szBuf));
+
+    bool bCaught = true;
+    Report("failing MemReadApp, catch", BenchRate([&]() {
+        try {
+            mon.MemReadApp(past);
+            bCaught = false;
+        } catch (AppException& e) {
+            bCaught = bCaught && e.GetError() == ERROR_PARTIAL_COPY;
+        }
+    }), "calls/s", bCaught);
+
+    bool bPartial = true;
+    Report("failing TryMemReadApp", BenchRate([&]() {
+        bPartial = bPartial
+            && mon.TryMemReadApp(past).Error() == ERROR_PARTIAL_COPY;
+    }), "calls/s", bPartial);
+
+    bool bRead = (bool)mon.TryMemReadApp(mem);
+    Report("TryMemReadApp", 1, "reads", bRead);
+
+    mon.MemFree(mem);
+    mon.CloseApp();
+}
+
+#ifndef WIN32
+// odd-sized, so the child's buffer is the only mapping of that size
+#define NATIVE_REGION (48 * 1024 * 1024 + 3 * 4096)
+
+static uint64_t PatternWord(size_t uIndex)
+{
+    return uIndex * 0x9E3779B97F4A7C15ull;
+}
+
+// what the spawned application runs: fill a buffer and wait
+static int RunChild()
+{
+    // with a guard page behind it for reads running past the end
+    void* p = mmap(NULL, NATIVE_REGION + 4096, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED
+        || mprotect((char*)p + NATIVE_REGION, 4096, PROT_NONE))
+    {
+        return 1;
+    }
+
+    uint64_t* pWords = (uint64_t*)p;
+    for (size_t i = 0; i < NATIVE_REGION / 8; i++)
+        pWords[i] = PatternWord(i);
+
+    for (;;)
+        pause();
+}
+
+static uint64_t FindRegion(DWORD dwPid)
+{
+    char szMaps[64];
+    snprintf(szMaps, sizeof(szMaps), "/proc/%u/maps", (unsigned)dwPid);
+    FILE* fp = fopen(szMaps, "r");
+    if (!fp)
+        return 0;
+
+    char line[512];
+    uint64_t uFound = 0;
+    while (!uFound && fgets(line, sizeof(line), fp))
+    {
+        unsigned long long uStart, uEnd;
+        char szPerms[8];
+        if (sscanf(line, "%llx-%llx %7s", &uStart, &uEnd, szPerms) == 3
+            && uEnd - uStart == NATIVE_REGION && !strcmp(szPerms, "rw-p"))
+        {
+            uFound = uStart;
+        }
+    }
+
+    fclose(fp);
+    return uFound;
+}
+
+// the default backend against a real child process, memory moved with
+// process_vm_readv/writev next to a local memcpy of the same size
+static void BenchNative()
+{
+    char szExe[4096];
+    ssize_t lLen = readlink("/proc/self/exe", szExe, sizeof(szExe) - 1);
+    if (lLen <= 0)
+        return;
+    szExe[lLen] = '\0';
+
+    AppMonitor mon(TextToWchar(szExe));
+    if (!mon.StartApp(L"--child"))
+    {
+        Report("native StartApp", 0, "", false);
+        return;
+    }
+
+    // the child sleeps in pause() once the buffer is filled
+    uint64_t uRegion = 0;
+    for (int i = 0; i < 100 && !uRegion; i++)
+        if (mon.WaitAppIdle(10000))
+            uRegion = FindRegion(mon.GetAppProcessId());
+    if (!uRegion)
+    {
+        Report("native child region", 0, "", false);
+        mon.Terminate();
+        return;
+    }
+
+    std::vector<uint64_t> local(NATIVE_REGION / 8), copy(NATIVE_REGION / 8);
+    AppMem mem(local.data(), (void*)(uintptr_t)uRegion, NATIVE_REGION);
+    double dGB = NATIVE_REGION / 1e9;
+
+    mon.MemReadApp(mem);
+    bool bRead = true;
+    for (size_t i = 0; i < local.size(); i++)
+        bRead = bRead && local[i] == PatternWord(i);
+    Report("native MemReadApp", BenchRate([&]() {
+        mon.MemReadApp(mem);
+    }) * dGB, "GB/s", bRead);
+
+    for (size_t i = 0; i < local.size(); i++)
+        local[i] = ~PatternWord(i);
+    mon.MemWriteApp(mem);
+    std::fill(local.begin(), local.end(), 0);
+    mon.MemReadApp(mem);
+    bool bWrite = local[0] == ~PatternWord(0)
+        && local.back() == ~PatternWord(local.size() - 1);
+    Report("native MemWriteApp", BenchRate([&]() {
+        mon.MemWriteApp(mem);
+    }) * dGB, "GB/s", bWrite);
+
+    Report("local memcpy", BenchRate([&]() {
+        memcpy(copy.data(), local.data(), NATIVE_REGION);
+    }) * dGB, "GB/s");
+
+    // 4K pieces every 8K, one call each against one batch; the local
+    // side is packed, so none of them merge
+    std::vector<AppMem> pieces;
+    for (size_t i = 0; i < 4096; i++)
+        pieces.emplace_back((char*)copy.data() + i * 4096,
+            (void*)(uintptr_t)(uRegion + i * 8192), 4096);
+
+    mon.MemWriteApp(mem);
+    std::fill(copy.begin(), copy.end(), 0);
+    mon.ResetMemStats();
+    mon.MemReadApp(pieces);
+    appmemstats memStats = mon.GetMemStats();
+    bool bPieces = memStats.m_uRegions == pieces.size();
+    for (size_t i = 0; i < pieces.size(); i++)
+        bPieces = bPieces && copy[i * 512] == local[i * 1024];
+
+    Report("native 4K reads, one per call", BenchRate([&]() {
+        for (auto& piece : pieces)
+            mon.MemReadApp(piece);
+    }) * pieces.size(), "regions/s");
+    Report("native 4K reads, batched", BenchRate([&]() {
+        mon.MemReadApp(pieces);
+    }) * pieces.size(), "regions/s", bPieces);
+    Report("native batch calls saved", (double)memStats.m_uSaved
+        / memStats.m_uRegions * 100, "%");
+
+    // pieces of one buffer that touch collapse into one region
+    std::vector<AppMem> adjacent;
+    for (size_t i = 0; i < 1024; i++)
+        adjacent.emplace_back((char*)local.data() + i * 4096,
+            (void*)(uintptr_t)(uRegion + i * 4096), 4096);
+    mon.ResetMemStats();
+    mon.MemReadApp(adjacent);
+    Report("native adjacent batch", (double)mon.GetMemStats().m_uCalls,
+        "calls", mon.GetMemStats().m_uCalls == 1);
+
+    // reading into the guard page is a failure, not a crash
+    bool bFault = false;
+    try {
+        mon.MemReadApp(AppMem(local.data(),
+            (void*)(uintptr_t)(uRegion + NATIVE_REGION - 4096), 8192));
+    } catch (AppException& e) {
+        bFault = e.GetError() == ERROR_PARTIAL_COPY;
+    }
+    Report("native partial read fails", 1, "faults", bFault);
+
+    bFault = false;
+    try {
+        mon.MemReadApp({ pieces[0], AppMem(local.data(),
+            (void*)(uintptr_t)(uRegion + NATIVE_REGION - 4096), 8192) });
+    } catch (AppException& e) {
+        bFault = e.GetError() == ERROR_PARTIAL_COPY;
+    }
+    Report("native partial batch fails", 1, "faults", bFault);
+
+    // reaped by Terminate, no zombie left behind
+    DWORD dwPid = mon.GetAppProcessId();
+    bool bRunning = mon.IsAppRunning();
+    mon.Terminate();
+    bool bReaped = kill((pid_t)dwPid, 0) < 0 && errno == ESRCH;
+    Report("native Terminate", 1, "exits", bRunning && bReaped);
+
+    // closing leaves the child running, it is reaped once it exits
+    bool bClosed = false;
+    if (mon.StartApp(L"--child"))
+    {
+        dwPid = mon.GetAppProcessId();
+        mon.CloseApp();
+        bRunning = kill((pid_t)dwPid, 0) == 0;
+        kill((pid_t)dwPid, SIGKILL);
+        for (int i = 0; i < 500 && !bClosed; i++)
+        {
+            bClosed = kill((pid_t)dwPid, 0) < 0 && errno == ESRCH;
+            if (!bClosed)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    Report("native CloseApp", 1, "exits", bRunning && bClosed);
+}
+#endif
+
+int main(int argc, char** argv)
+{
+    bench_app app = { 200, 64, 4096, 20000, 5000, false };
+    const char* json = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+#ifndef WIN32
+        if (!strcmp(argv[i], "--child"))
+            return RunChild();
+#endif
+        if (!strcmp(argv[i], "--spin"))
+            app.m_bSpin = true;
+        else if (i + 1 >= argc)
+            break;
+        else if (!strcmp(argv[i], "--foreign"))
+            app.m_uForeign = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--controls"))
+            app.m_uControls = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--tree-items"))
+            app.m_uTreeItems = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--message-ns"))
+            app.m_uMessageNs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--memory-ns"))
+            app.m_uMemoryNs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--time"))
+            s_dBenchTime = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--json"))
+            json = argv[++i];
+    }
+
+    AppMonitor::Init();
+    BenchApp(app, false, true);
+    BenchApp(app, true, true);
+    BenchApp(app, false, false);
+    BenchApp(app, true, false);
+    BenchConcurrentEnum(app, 1);
+    BenchConcurrentEnum(app, 8);
+    BenchFailures(app);
+    BenchAsync(app, 1);
+    BenchAsync(app, 64);
+    BenchPool(app, 1);
+    BenchPool(app, 4);
+    BenchPool(app, 16);
+#ifndef WIN32
+    BenchNative();
+#endif
+
+    if (json && !WriteJson(json, app))
+    {
+        printf("cannot write %s\n", json);
+        return 1;
+    }
+
+    for (auto& result : s_Results)
+        if (!result.m_bOk)
+            return 1;
+    return 0;
+}
@@ -0,0 +1,322 @@
+#include "win32dircache.h"
+
+#ifndef WIN32
+#include "win32util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+
+#define DIRCACHE_MAGIC "W32DSC1"
+#define DIRCACHE_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM \
+    | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF \
+    | IN_ONLYDIR | IN_EXCL_UNLINK)
+
+DirSizeCache::DirSizeCache()
+    : m_iNotify(-1), m_uRescanned(0)
+{
+}
+
+DirSizeCache::~DirSizeCache()
+{
+    Unwatch();
+}
+
+uint64_t DirSizeCache::GetSize(const std::wstring& path)
+{
+    m_uRescanned = 0;
+    if (IsWatching())
+        ReadEvents();
+
+    int fd = open(WcharToText(path).c_str(),
+        O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+
+    dirkey key;
+    uint64_t uSize = Walk(fd, NULL, key);
+    close(fd);
+    return uSize;
+}
+
+uint64_t DirSizeCache::Walk(int fd, const dirkey* parent, dirkey& key)
+{
+    struct stat st;
+    if (fstat(fd, &st))
+        return 0;
+
+    key = { (uint64_t)st.st_dev, (uint64_t)st.st_ino };
+    int64_t iMtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+
+    // references into unordered_map survive rehashing by the recursion
+    dirnode& node = m_Nodes[key];
+    if (parent)
+        node.m_Parent = *parent;
+
+    // watch before looking at mtime, so no change can slip in between
+    if (IsWatching() && node.m_iWatch < 0)
+        AddWatch(fd, key, node);
+
+    if (!node.m_bScanned || node.m_bDirty || node.m_iMtime != iMtime)
+    {
+        node.m_iMtime = iMtime;
+        Rescan(fd, node);
+    }
+    else if (node.m_iWatch >= 0 && !node.m_bStale)
+        return node.m_uTotal;
+
+    uint64_t uTotal = node.m_uFiles;
+    std::vector<dirkey> children;
+    children.reserve(node.m_Children.size());
+
+    for (size_t uPos = 0; uPos < node.m_Subdirs.size(); )
+    {
+        const char* name = node.m_Subdirs.c_str() + uPos;
+        uPos += strlen(name) + 1;
+
+        int subfd = openat(fd, name,
+            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (subfd < 0)
+            continue;
+
+        dirkey child;
+        uTotal += Walk(subfd, &key, child);
+        children.push_back(child);
+        close(subfd);
+    }
+
+    // forget subtrees that were removed or replaced since the last walk,
+    // but not those moved under a parent that has already claimed them
+    for (auto& old : node.m_Children)
+        if (std::find(children.begin(), children.end(), old) == children.end())
+            Erase(old, key);
+
+    node.m_Children = std::move(children);
+    node.m_uTotal = uTotal;
+    node.m_bStale = false;
+    return uTotal;
+}
+
+void DirSizeCache::Rescan(int fd, dirnode& node)
+{
+    node.m_Subdirs.clear();
+    node.m_uFiles = ScanDirectoryAt(fd, node.m_Subdirs);
+    node.m_bScanned = true;
+    node.m_bDirty = false;
+    m_uRescanned++;
+}
+
+void DirSizeCache::AddWatch(int fd, const dirkey& key, dirnode& node)
+{
+    // inotify has no *at variant, the descriptor is reached through /proc
+    char szPath[64];
+    snprintf(szPath, sizeof(szPath), "/proc/self/fd/%d", fd);
+
+    int wd = inotify_add_watch(m_iNotify, szPath, DIRCACHE_EVENTS);
+    if (wd < 0)
+        return;
+
+    node.m_iWatch = wd;
+    m_Watches[wd] = key;
+}
+
+void DirSizeCache::ReadEvents()
+{
+    alignas(struct inotify_event) char buf[16384];
+    ssize_t lRead;
+
+    while ((lRead = read(m_iNotify, buf, sizeof(buf))) > 0)
+    {
+        for (ssize_t lPos = 0; lPos < lRead; )
+        {
+            auto* ev = (struct inotify_event*)(buf + lPos);
+            lPos += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW)
+            {
+                for (auto& [key, node] : m_Nodes)
+                {
+                    node.m_bDirty = true;
+                    node.m_bStale = true;
+                }
+                continue;
+            }
+
+            auto it = m_Watches.find(ev->wd);
+            if (it == m_Watches.end())
+                continue;
+
+            dirkey key = it->second;
+            if (ev->mask & IN_IGNORED)
+            {
+                m_Watches.erase(it);
+                auto node = m_Nodes.find(key);
+                if (node != m_Nodes.end())
+                    node->second.m_iWatch = -1;
+            }
+            MarkDirty(key);
+        }
+    }
+}
+
+void DirSizeCache::MarkDirty(const dirkey& key)
+{
+    auto it = m_Nodes.find(key);
+    if (it == m_Nodes.end())
+        return;
+
+    it->second.m_bDirty = true;
+    while (it != m_Nodes.end() && !it->second.m_bStale)
+    {
+        it->second.m_bStale = true;
+        it = m_Nodes.find(it->second.m_Parent);
+    }
+}
+
+void DirSizeCache::Erase(const dirkey& key, const dirkey& parent)
+{
+    auto it = m_Nodes.find(key);
+    if (it == m_Nodes.end() || !(it->second.m_Parent == parent))
+        return;
+
+    std::vector<dirkey> children = std::move(it->second.m_Children);
+    if (it->second.m_iWatch >= 0)
+    {
+        inotify_rm_watch(m_iNotify, it->second.m_iWatch);
+        m_Watches.erase(it->second.m_iWatch);
+    }
+    m_Nodes.erase(it);
+
+    for (auto& child : children)
+        Erase(child, key);
+}
+
+bool DirSizeCache::Watch()
+{
+    if (IsWatching())
+        return true;
+
+    m_iNotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_iNotify < 0)
+        return false;
+
+    // nothing is known about changes made while not watching
+    for (auto& [key, node] : m_Nodes)
+        node.m_bStale = true;
+    return true;
+}
+
+void DirSizeCache::Unwatch()
+{
+    if (!IsWatching())
+        return;
+
+    close(m_iNotify);
+    m_iNotify = -1;
+    m_Watches.clear();
+    for (auto& [key, node] : m_Nodes)
+        node.m_iWatch = -1;
+}
+
+void DirSizeCache::Clear()
+{
+    if (IsWatching())
+    {
+        for (auto& [wd, key] : m_Watches)
+            inotify_rm_watch(m_iNotify, wd);
+        m_Watches.clear();
+    }
+    m_Nodes.clear();
+}
+
+/* On-disk format: magic, node count, then for every node its key,
+ * mtime, size of its own files, parent key, child keys and the
+ * '\0'-separated subdirectory names. */
+
+template<typename T>
+static bool WriteValue(FILE* fp, const T& value)
+{
+    return fwrite(&value, sizeof(T), 1, fp) == 1;
+}
+
+template<typename T>
+static bool ReadValue(FILE* fp, T& value)
+{
+    return fread(&value, sizeof(T), 1, fp) == 1;
+}
+
+bool DirSizeCache::Save(const std::wstring& file) const
+{
+    FILE* fp = fopen(WcharToText(file).c_str(), "wb");
+    if (!fp)
+        return false;
+
+    bool bOk = fwrite(DIRCACHE_MAGIC, 8, 1, fp) == 1
+        && WriteValue(fp, (uint64_t)m_Nodes.size());
+    for (auto it = m_Nodes.begin(); bOk && it != m_Nodes.end(); it++)
+    {
+        const dirnode& node = it->second;
+        bOk = WriteValue(fp, it->first) && WriteValue(fp, node.m_iMtime)
+            && WriteValue(fp, node.m_uFiles)
+            && WriteValue(fp, node.m_Parent)
+            && WriteValue(fp, (uint64_t)node.m_Children.size())
+            && (node.m_Children.empty() || fwrite(node.m_Children.data(),
+                sizeof(dirkey), node.m_Children.size(), fp)
+                    == node.m_Children.size())
+            && WriteValue(fp, (uint64_t)node.m_Subdirs.size())
+            && fwrite(node.m_Subdirs.data(), 1, node.m_Subdirs.size(), fp)
+                == node.m_Subdirs.size();
+    }
+
+    return !fclose(fp) && bOk;
+}
+
+bool DirSizeCache::Load(const std::wstring& file)
+{
+    FILE* fp = fopen(WcharToText(file).c_str(), "rb");
+    if (!fp)
+        return false;
+
+    char szMagic[8];
+    uint64_t uCount = 0;
+    bool bOk = fread(szMagic, 8, 1, fp) == 1
+        && !memcmp(szMagic, DIRCACHE_MAGIC, 8) && ReadValue(fp, uCount);
+
+    Clear();
+    for (uint64_t i = 0; bOk && i < uCount; i++)
+    {
+        dirkey key;
+        dirnode node;
+        uint64_t uChildren = 0, uNames = 0;
+
+        bOk = ReadValue(fp, key) && ReadValue(fp, node.m_iMtime)
+            && ReadValue(fp, node.m_uFiles) && ReadValue(fp, node.m_Parent)
+            && ReadValue(fp, uChildren) && uChildren < (1u << 31);
+        if (!bOk)
+            break;
+
+        node.m_Children.resize(uChildren);
+        bOk = (!uChildren || fread(node.m_Children.data(), sizeof(dirkey),
+            uChildren, fp) == uChildren)
+            && ReadValue(fp, uNames) && uNames < (1u << 31);
+        if (!bOk)
+            break;
+
+        node.m_Subdirs.resize(uNames);
+        bOk = fread(node.m_Subdirs.data(), 1, uNames, fp) == uNames;
+
+        node.m_bScanned = true;
+        node.m_bDirty = false;
+        m_Nodes[key] = std::move(node);
+    }
+
+    fclose(fp);
+    if (!bOk)
+        Clear();
+    return bOk;
+}
+#endif
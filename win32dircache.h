@@ -0,0 +1,86 @@
+#ifndef __WIN32DIRCACHE_H
+#define __WIN32DIRCACHE_H
+
+#ifndef WIN32
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Remembers the size of every directory of the trees it was asked
+// about, keyed by (dev, inode) and validated by the directory mtime.
+// A query still opens each directory, but only directories whose mtime
+// changed are read and have their files stat'ed again.
+//
+// A directory mtime does not change when a file inside it grows, only
+// when entries are added, removed or renamed. Watch() closes that gap
+// with inotify: every directory is watched, events mark it dirty along
+// with its ancestors, and queries skip unchanged subtrees entirely.
+//
+// Not thread-safe, use one cache per thread or lock around it.
+class DirSizeCache
+{
+public:
+    DirSizeCache();
+    virtual ~DirSizeCache();
+
+    uint64_t GetSize(const std::wstring& path);
+
+    bool Watch();
+    void Unwatch();
+    inline bool IsWatching() const { return m_iNotify >= 0; }
+
+    bool Load(const std::wstring& file);
+    bool Save(const std::wstring& file) const;
+    void Clear();
+
+    // directories read again by the last GetSize
+    inline size_t Rescanned() const { return m_uRescanned; }
+    inline size_t Directories() const { return m_Nodes.size(); }
+private:
+    struct dirkey {
+        uint64_t m_uDev;
+        uint64_t m_uIno;
+
+        bool operator==(const dirkey& other) const
+        {
+            return m_uDev == other.m_uDev && m_uIno == other.m_uIno;
+        }
+    };
+
+    struct dirkey_hash {
+        size_t operator()(const dirkey& key) const
+        {
+            return std::hash<uint64_t>()(key.m_uIno * 31 + key.m_uDev);
+        }
+    };
+
+    struct dirnode {
+        int64_t m_iMtime = 0;
+        uint64_t m_uFiles = 0;
+        uint64_t m_uTotal = 0;
+        std::string m_Subdirs;
+        std::vector<dirkey> m_Children;
+        dirkey m_Parent = { 0, 0 };
+        int m_iWatch = -1;
+        bool m_bScanned = false;
+        bool m_bDirty = true;
+        bool m_bStale = true;
+    };
+
+    uint64_t Walk(int fd, const dirkey* parent, dirkey& key);
+    void Rescan(int fd, dirnode& node);
+    void AddWatch(int fd, const dirkey& key, dirnode& node);
+    void ReadEvents();
+    void MarkDirty(const dirkey& key);
+    // only while still a child of parent
+    void Erase(const dirkey& key, const dirkey& parent);
+
+    std::unordered_map<dirkey, dirnode, dirkey_hash> m_Nodes;
+    std::unordered_map<int, dirkey> m_Watches;
+    int m_iNotify;
+    size_t m_uRescanned;
+};
+#endif
+
+#endif
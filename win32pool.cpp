@@ -0,0 +1,212 @@
+#include "win32pool.h"
+#include <chrono>
+#include <exception>
+
+// how often an idle worker with messages in flight looks for new jobs
+#define APP_POOL_PUMP 10
+
+AppMonitorPool::AppMonitorPool()
+    : m_uNextJob(1), m_uPending(0)
+{
+}
+
+AppMonitorPool::~AppMonitorPool()
+{
+    Stop();
+}
+
+size_t AppMonitorPool::Add(std::unique_ptr<AppMonitor> pMonitor)
+{
+    std::unique_ptr<worker> pWorker(new worker);
+    pWorker->m_pMonitor = std::move(pMonitor);
+
+    worker* pRun = pWorker.get();
+    pRun->m_Thread = std::thread([this, pRun]() { Run(pRun); });
+
+    std::lock_guard<std::mutex> lock(m_Lock);
+    m_Workers.push_back(std::move(pWorker));
+    return m_Workers.size() - 1;
+}
+
+AppMonitor* AppMonitorPool::Monitor(size_t uMonitor) const
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    return uMonitor < m_Workers.size()
+        ? m_Workers[uMonitor]->m_pMonitor.get() : NULL;
+}
+
+size_t AppMonitorPool::Size() const
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    return m_Workers.size();
+}
+
+size_t AppMonitorPool::Submit(size_t uMonitor, JobFunc func)
+{
+    return Queue(uMonitor, AppJobCustom, NULL, std::move(func));
+}
+
+size_t AppMonitorPool::Enumerate(size_t uMonitor)
+{
+    return Queue(uMonitor, AppJobEnumerate, NULL,
+        [](AppMonitor* app, appjob& job) {
+            app->EnumAppWindows([&job](AppMonitor* app, HWND hWnd) {
+                job.m_Windows.push_back(hWnd);
+                app->EnumAppControls(hWnd, [&job](AppMonitor*, HWND hCtl) {
+                    job.m_Windows.push_back(hCtl);
+                    return true;
+                });
+                return true;
+            });
+        });
+}
+
+size_t AppMonitorPool::ReadText(size_t uMonitor, HWND hWnd)
+{
+    return Queue(uMonitor, AppJobReadText, hWnd,
+        [](AppMonitor* app, appjob& job) {
+            job.m_Text = app->GetControlTextStr(job.m_hWnd);
+        });
+}
+
+size_t AppMonitorPool::DumpTree(size_t uMonitor, HWND hTree)
+{
+    return Queue(uMonitor, AppJobDumpTree, hTree,
+        [](AppMonitor* app, appjob& job) {
+            job.m_Nodes = app->TV_Dump(job.m_hWnd);
+        });
+}
+
+bool AppMonitorPool::Next(appjob& result, DWORD dwTimeOut)
+{
+    std::unique_lock<std::mutex> lock(m_ResultsLock);
+    auto ready = [this]() { return !m_Results.empty(); };
+
+    if (dwTimeOut == INFINITE)
+        m_Done.wait(lock, ready);
+    else if (!m_Done.wait_for(lock,
+        std::chrono::milliseconds(dwTimeOut), ready))
+        return false;
+
+    result = std::move(m_Results.front());
+    m_Results.pop_front();
+    m_uPending--;
+    return true;
+}
+
+size_t AppMonitorPool::Pending() const
+{
+    std::lock_guard<std::mutex> lock(m_ResultsLock);
+    return m_uPending;
+}
+
+void AppMonitorPool::Stop()
+{
+    std::vector<worker*> workers;
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        for (auto& pWorker : m_Workers)
+            workers.push_back(pWorker.get());
+    }
+
+    size_t uDropped = 0;
+    for (worker* pWorker : workers)
+    {
+        {
+            std::lock_guard<std::mutex> lock(pWorker->m_Lock);
+            pWorker->m_bStop = true;
+            uDropped += pWorker->m_Jobs.size();
+            pWorker->m_Jobs.clear();
+        }
+        pWorker->m_Wake.notify_one();
+    }
+    for (worker* pWorker : workers)
+        if (pWorker->m_Thread.joinable())
+            pWorker->m_Thread.join();
+
+    std::lock_guard<std::mutex> lock(m_ResultsLock);
+    m_uPending -= uDropped;
+}
+
+size_t AppMonitorPool::Queue(size_t uMonitor, appjobkind kind, HWND hWnd,
+    JobFunc func)
+{
+    worker* pWorker;
+    appjob job;
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        if (uMonitor >= m_Workers.size())
+            return 0;
+        pWorker = m_Workers[uMonitor].get();
+        job.m_uJob = m_uNextJob++;
+    }
+    job.m_uMonitor = uMonitor;
+    job.m_Kind = kind;
+    job.m_hWnd = hWnd;
+    size_t uJob = job.m_uJob;
+
+    {
+        std::lock_guard<std::mutex> lock(pWorker->m_Lock);
+        if (pWorker->m_bStop)
+            return 0;
+        // counted before the worker can finish it
+        {
+            std::lock_guard<std::mutex> results(m_ResultsLock);
+            m_uPending++;
+        }
+        pWorker->m_Jobs.emplace_back(std::move(job), std::move(func));
+    }
+    pWorker->m_Wake.notify_one();
+    return uJob;
+}
+
+void AppMonitorPool::Run(worker* pWorker)
+{
+    AppMonitor* pMonitor = pWorker->m_pMonitor.get();
+    for (;;)
+    {
+        std::pair<appjob, JobFunc> next;
+        {
+            std::unique_lock<std::mutex> lock(pWorker->m_Lock);
+            if (pWorker->m_Jobs.empty() && !pWorker->m_bStop)
+            {
+                // answers to AppMessageAsync sent by earlier jobs arrive
+                // only while this thread pumps
+                if (pMonitor->PendingMessages())
+                {
+                    lock.unlock();
+                    pMonitor->PumpMessages(APP_POOL_PUMP);
+                    continue;
+                }
+                pWorker->m_Wake.wait(lock, [pWorker]() {
+                    return pWorker->m_bStop || !pWorker->m_Jobs.empty();
+                });
+            }
+            if (pWorker->m_bStop)
+                return;
+            next = std::move(pWorker->m_Jobs.front());
+            pWorker->m_Jobs.pop_front();
+        }
+
+        appjob& job = next.first;
+        try {
+            next.second(pWorker->m_pMonitor.get(), job);
+        } catch (AppException& e) {
+            job.m_bOk = false;
+            job.m_dwError = e.GetError();
+            job.m_Error = e.what();
+        } catch (std::exception& e) {
+            job.m_bOk = false;
+            job.m_Error = e.what();
+        } catch (...) {
+            job.m_bOk = false;
+            job.m_Error = "unknown exception";
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_ResultsLock);
+            m_Results.push_back(std::move(job));
+        }
+        m_Done.notify_all();
+    }
+}
@@ -0,0 +1,100 @@
+#ifndef __WIN32POOL_H
+#define __WIN32POOL_H
+
+#include "win32ctrl.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum appjobkind {
+    AppJobCustom = 0,
+    AppJobEnumerate,
+    AppJobReadText,
+    AppJobDumpTree
+};
+
+// a job of AppMonitorPool and what it produced
+struct appjob {
+    size_t m_uJob = 0;
+    size_t m_uMonitor = 0;
+    appjobkind m_Kind = AppJobCustom;
+    HWND m_hWnd = NULL;
+
+    // false when the job threw, m_dwError and m_Error say what
+    bool m_bOk = true;
+    DWORD m_dwError = ERROR_SUCCESS;
+    std::string m_Error;
+
+    // AppJobEnumerate: each top-level window followed by its controls
+    std::vector<HWND> m_Windows;
+    // AppJobReadText
+    std::wstring m_Text;
+    // AppJobDumpTree
+    std::vector<tvnode> m_Nodes;
+};
+
+// Monitors of many applications, each driven by a worker thread of its
+// own, so the time for a round of jobs is that of the slowest application
+// rather than the sum of all of them, and a hung one holds up only its
+// own jobs. Jobs of one monitor run in the order submitted, on its
+// worker; between jobs the worker pumps the AppMessageAsync requests
+// they left in flight, so their callbacks run there too. Results of all
+// monitors come out of Next() in the order they completed.
+class AppMonitorPool
+{
+public:
+    typedef std::function<void(AppMonitor*, appjob&)> JobFunc;
+
+    AppMonitorPool();
+    virtual ~AppMonitorPool();
+
+    // takes the monitor over and starts its worker, returns its index
+    size_t Add(std::unique_ptr<AppMonitor> pMonitor);
+    // for setup, the monitor is its worker's while jobs are queued
+    AppMonitor* Monitor(size_t uMonitor) const;
+    size_t Size() const;
+
+    // Jobs return their id, which the result carries. func may throw,
+    // the result then says what.
+    size_t Submit(size_t uMonitor, JobFunc func);
+    size_t Enumerate(size_t uMonitor);
+    size_t ReadText(size_t uMonitor, HWND hWnd);
+    size_t DumpTree(size_t uMonitor, HWND hTree);
+
+    // next result in completion order, false if none within dwTimeOut ms
+    bool Next(appjob& result, DWORD dwTimeOut = INFINITE);
+    // jobs submitted whose result Next has not returned yet
+    size_t Pending() const;
+
+    // workers finish the job at hand and exit, queued jobs are dropped
+    void Stop();
+private:
+    struct worker {
+        std::unique_ptr<AppMonitor> m_pMonitor;
+        std::thread m_Thread;
+        std::mutex m_Lock;
+        std::condition_variable m_Wake;
+        std::deque<std::pair<appjob, JobFunc>> m_Jobs;
+        bool m_bStop = false;
+    };
+
+    size_t Queue(size_t uMonitor, appjobkind kind, HWND hWnd,
+        JobFunc func);
+    void Run(worker* pWorker);
+
+    mutable std::mutex m_Lock;
+    std::vector<std::unique_ptr<worker>> m_Workers;
+    size_t m_uNextJob;
+
+    mutable std::mutex m_ResultsLock;
+    std::condition_variable m_Done;
+    std::deque<appjob> m_Results;
+    size_t m_uPending;
+};
+
+#endif
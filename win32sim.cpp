@@ -0,0 +1,884 @@
+#include "win32sim.h"
+#include "win32util.h"
+
+#include <string.h>
+#include <wchar.h>
+#include <algorithm>
+#include <chrono>
+
+#ifdef WIN32
+#define strcasecmp _stricmp
+#else
+#include <strings.h>
+#endif
+
+/* Windows are numbered from 1 and tree items from 1, the handles are
+ * those numbers shifted so they do not look like small integers. The
+ * remote address space hands out 64K-aligned blocks like VirtualAllocEx,
+ * below 2GB for a WOW64 process and above 4GB for a 64-bit one, and
+ * reuses released blocks of the same size. */
+
+#define SIM_PID 4200
+#define SIM_FOREIGN_PID 4300
+#define SIM_PROCESS ((HANDLE)(uintptr_t)0x4C)
+#define SIM_ALLOC_GRANULARITY 0x10000
+
+static HWND WindowHandle(size_t uIndex)
+{
+    return (HWND)(uintptr_t)((uIndex + 1) << 4);
+}
+
+static DWORD_PTR ItemHandle(size_t uIndex)
+{
+    return (DWORD_PTR)((uIndex + 1) << 4);
+}
+
+static size_t AllocBlock(size_t uLen)
+{
+    return (uLen + SIM_ALLOC_GRANULARITY - 1)
+        & ~(size_t)(SIM_ALLOC_GRANULARITY - 1);
+}
+
+SimBackend::SimBackend(bool bWow64)
+    : m_bWow64(bWow64), m_bStarted(false), m_bExited(false),
+    m_dwPid(SIM_PID), m_dwError(0),
+    m_uMessageNs(0), m_uMemoryNs(0), m_bSpin(false), m_bBlocking(false)
+{
+    m_uNextAddr = bWow64 ? 0x00400000 : 0x000001F000000000ull;
+    m_uAddrLimit = bWow64 ? 0x7FFF0000 : 0x00007FF000000000ull;
+}
+
+SimBackend::~SimBackend()
+{
+}
+
+HWND SimBackend::AddWindow(HWND hParent, const std::string& wndClass,
+    const std::wstring& text, bool bUnicode)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    simwindow wnd;
+    wnd.m_hParent = hParent;
+    wnd.m_dwPid = m_dwPid;
+    wnd.m_Class = wndClass;
+    wnd.m_Text = text;
+    wnd.m_bUnicode = bUnicode;
+
+    HWND hWnd = WindowHandle(m_Windows.size());
+    if (hParent)
+    {
+        simwindow* parent = Window(hParent);
+        if (!parent)
+            return NULL;
+        parent->m_Children.push_back(hWnd);
+    }
+
+    m_Windows.push_back(std::move(wnd));
+    return hWnd;
+}
+
+HWND SimBackend::AddForeignWindow(const std::string& wndClass,
+    const std::wstring& text)
+{
+    HWND hWnd = AddWindow(NULL, wndClass, text);
+
+    std::lock_guard<std::mutex> lock(m_Lock);
+    Window(hWnd)->m_dwPid = SIM_FOREIGN_PID;
+    return hWnd;
+}
+
+DWORD_PTR SimBackend::AddTreeItem(HWND hTree, DWORD_PTR hParent,
+    const std::wstring& text, int iImage)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+
+    simwindow* tree = Window(hTree);
+    simitem* parent = hParent ? Item(hParent) : nullptr;
+    if (!tree || (hParent && (!parent || parent->m_hTree != hTree)))
+        return 0;
+
+    DWORD_PTR hItem = ItemHandle(m_Items.size());
+    DWORD_PTR& hFirst = parent ? parent->m_hFirstChild : tree->m_hFirstRoot;
+    DWORD_PTR& hLast = parent ? parent->m_hLastChild : tree->m_hLastRoot;
+
+    simitem item = { hTree, hParent, 0, 0, 0, hLast, text, iImage };
+    if (hLast)
+        Item(hLast)->m_hNext = hItem;
+    else
+        hFirst = hItem;
+    hLast = hItem;
+
+    m_Items.push_back(std::move(item));
+    return hItem;
+}
+
+void SimBackend::SetHung(HWND hWnd, bool bHung)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    simwindow* wnd = Window(hWnd);
+    if (!wnd)
+        return;
+
+    wnd->m_bHung = bHung;
+    if (bHung)
+        return;
+
+    // answers what was queued while it hung
+    bool bAnswered = false;
+    for (auto& async : m_Async)
+    {
+        if (async.m_hWnd != hWnd || async.m_bAnswered)
+            continue;
+        async.m_dwResult = (DWORD_PTR)Dispatch(hWnd, *wnd, async.m_uMsg,
+            async.m_wParam, async.m_lParam);
+        async.m_bAnswered = true;
+        async.m_uReadyNs = m_Stats.m_uVirtualNs + m_uMessageNs;
+        bAnswered = true;
+    }
+    if (bAnswered)
+        m_Answered.notify_all();
+}
+
+void SimBackend::SetLatency(unsigned uMessageNs, unsigned uMemoryNs,
+    bool bSpin)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    m_uMessageNs = uMessageNs;
+    m_uMemoryNs = uMemoryNs;
+    m_bSpin = bSpin;
+}
+
+void SimBackend::SetBlocking(bool bBlocking)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    m_bBlocking = bBlocking;
+}
+
+SimBackend::simstats SimBackend::Stats() const
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    return m_Stats;
+}
+
+void SimBackend::ResetStats()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    m_Stats = simstats();
+}
+
+size_t SimBackend::LiveAllocations() const
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    return m_Remote.size();
+}
+
+SimBackend::simwindow* SimBackend::Window(HWND hWnd)
+{
+    uintptr_t uHandle = (uintptr_t)hWnd;
+    size_t uIndex = (uHandle >> 4) - 1;
+    if (!uHandle || (uHandle & 15) || uIndex >= m_Windows.size()
+        || !m_Windows[uIndex].m_bAlive)
+        return nullptr;
+    return &m_Windows[uIndex];
+}
+
+SimBackend::simitem* SimBackend::Item(DWORD_PTR hItem)
+{
+    size_t uIndex = (hItem >> 4) - 1;
+    if (!hItem || (hItem & 15) || uIndex >= m_Items.size())
+        return nullptr;
+    return &m_Items[uIndex];
+}
+
+bool SimBackend::Process(HANDLE hProcess)
+{
+    if (hProcess == SIM_PROCESS && m_bStarted && !m_bExited)
+        return true;
+    return Fail(ERROR_INVALID_HANDLE);
+}
+
+bool SimBackend::Fail(DWORD dwError)
+{
+    m_dwError = dwError;
+    return false;
+}
+
+// called under the lock, the spinning happens after it is released
+void SimBackend::Charge(uint64_t uNs, uint64_t& uSpin)
+{
+    m_Stats.m_uVirtualNs += uNs;
+    if (m_bSpin)
+        uSpin += uNs;
+}
+
+void SimBackend::Spin(uint64_t uNs) const
+{
+    if (!uNs)
+        return;
+
+    bool bBlocking;
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        bBlocking = m_bBlocking;
+    }
+    if (bBlocking)
+    {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(uNs));
+        return;
+    }
+
+    auto deadline = std::chrono::steady_clock::now()
+        + std::chrono::nanoseconds(uNs);
+    while (std::chrono::steady_clock::now() < deadline)
+        ;
+}
+
+/* process control */
+
+bool SimBackend::StartProcess(const std::wstring& exePath,
+    const std::wstring& cmdLine, HANDLE& hProcess, DWORD& dwPid,
+    bool& bWow64)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    if (m_bStarted && !m_bExited)
+        return Fail(ERROR_INVALID_PARAMETER);
+
+    m_bStarted = true;
+    m_bExited = false;
+    hProcess = SIM_PROCESS;
+    dwPid = m_dwPid;
+    bWow64 = m_bWow64;
+    return true;
+}
+
+void SimBackend::CloseProcess(HANDLE hProcess)
+{
+}
+
+bool SimBackend::TerminateProcess(HANDLE hProcess)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    if (!Process(hProcess))
+        return false;
+
+    m_bExited = true;
+    return true;
+}
+
+DWORD SimBackend::WaitProcess(HANDLE hProcess, DWORD dwTimeOut)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    if (hProcess != SIM_PROCESS || !m_bStarted)
+    {
+        Fail(ERROR_INVALID_HANDLE);
+        return WAIT_FAILED;
+    }
+    return m_bExited ? WAIT_OBJECT_0 : WAIT_TIMEOUT;
+}
+
+DWORD SimBackend::WaitProcessIdle(HANDLE hProcess, DWORD dwTimeOut)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    return Process(hProcess) ? 0 : WAIT_FAILED;
+}
+
+/* remote memory */
+
+void* SimBackend::AllocRemote(HANDLE hProcess, size_t uLen)
+{
+    uint64_t uSpin = 0;
+    void* pAppMem = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        Charge(m_uMemoryNs, uSpin);
+        m_Stats.m_uAllocs++;
+        if (!Process(hProcess))
+            return nullptr;
+
+        uLen = std::max<size_t>(uLen, 1);
+        size_t uBlock = AllocBlock(uLen);
+        uint64_t uAddr = 0;
+
+        auto& released = m_Released[uBlock];
+        if (!released.empty())
+        {
+            uAddr = released.back();
+            released.pop_back();
+        }
+        else if (m_uNextAddr + uBlock <= m_uAddrLimit)
+        {
+            uAddr = m_uNextAddr;
+            m_uNextAddr += uBlock;
+        }
+        else
+        {
+            Fail(ERROR_NOT_ENOUGH_MEMORY);
+            return nullptr;
+        }
+
+        // only the requested bytes are backed, the rest of the block
+        // just keeps addresses apart
+        m_Remote[uAddr].assign(uLen, '\0');
+        pAppMem = (void*)(uintptr_t)uAddr;
+    }
+
+    Spin(uSpin);
+    return pAppMem;
+}
+
+bool SimBackend::FreeRemote(HANDLE hProcess, void* pAppMem)
+{
+    uint64_t uSpin = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        Charge(m_uMemoryNs, uSpin);
+        m_Stats.m_uFrees++;
+        if (!Process(hProcess))
+            return false;
+
+        auto it = m_Remote.find((uint64_t)(uintptr_t)pAppMem);
+        if (it == m_Remote.end())
+            return Fail(ERROR_INVALID_PARAMETER);
+
+        m_Released[AllocBlock(it->second.size())].push_back(it->first);
+        m_Remote.erase(it);
+    }
+
+    Spin(uSpin);
+    return true;
+}
+
+std::vector<char>* SimBackend::Remote(uint64_t uAddr, size_t uLen,
+    size_t& uOffset)
+{
+    auto it = m_Remote.upper_bound(uAddr);
+    if (it == m_Remote.begin())
+        return nullptr;
+
+    --it;
+    uOffset = uAddr - it->first;
+    if (uOffset > it->second.size() || uLen > it->second.size() - uOffset)
+        return nullptr;
+    return &it->second;
+}
+
+bool SimBackend::ReadAt(uint64_t uAddr, void* pData, size_t uLen)
+{
+    size_t uOffset;
+    std::vector<char>* block = Remote(uAddr, uLen, uOffset);
+    if (!block)
+        return Fail(ERROR_PARTIAL_COPY);
+
+    memcpy(pData, block->data() + uOffset, uLen);
+    return true;
+}
+
+bool SimBackend::WriteAt(uint64_t uAddr, const void* pData, size_t uLen)
+{
+    size_t uOffset;
+    std::vector<char>* block = Remote(uAddr, uLen, uOffset);
+    if (!block)
+        return Fail(ERROR_PARTIAL_COPY);
+
+    memcpy(block->data() + uOffset, pData, uLen);
+    return true;
+}
+
+bool SimBackend::ReadRemote(HANDLE hProcess, const void* pAppMem,
+    void* pThisMem, size_t uLen)
+{
+    uint64_t uSpin = 0;
+    bool bOk;
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        Charge(m_uMemoryNs, uSpin);
+        m_Stats.m_uReads++;
+        m_Stats.m_uBytesRead += uLen;
+        bOk = Process(hProcess)
+            && ReadAt((uint64_t)(uintptr_t)pAppMem, pThisMem, uLen);
+    }
+
+    Spin(uSpin);
+    return bOk;
+}
+
+bool SimBackend::WriteRemote(HANDLE hProcess, void* pAppMem,
+    const void* pThisMem, size_t uLen)
+{
+    uint64_t uSpin = 0;
+    bool bOk;
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        Charge(m_uMemoryNs, uSpin);
+        m_Stats.m_uWrites++;
+        m_Stats.m_uBytesWritten += uLen;
+        bOk = Process(hProcess)
+            && WriteAt((uint64_t)(uintptr_t)pAppMem, pThisMem, uLen);
+    }
+
+    Spin(uSpin);
+    return bOk;
+}
+
+bool SimBackend::ReadRemoteV(HANDLE hProcess, const remoteiov* pIov,
+    size_t uCount, unsigned& uCalls)
+{
+    uint64_t uSpin = 0;
+    bool bOk;
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        Charge(m_uMemoryNs, uSpin);
+        m_Stats.m_uReads++;
+        bOk = Process(hProcess);
+        for (size_t i = 0; bOk && i < uCount; i++)
+        {
+            m_Stats.m_uBytesRead += pIov[i].m_uLen;
+            bOk = ReadAt((uint64_t)(uintptr_t)pIov[i].m_pAppMem,
+                pIov[i].m_pThisMem, pIov[i].m_uLen);
+        }
+    }
+
+    uCalls = 1;
+    Spin(uSpin);
+    return bOk;
+}
+
+bool SimBackend::WriteRemoteV(HANDLE hProcess, const remoteiov* pIov,
+    size_t uCount, unsigned& uCalls)
+{
+    uint64_t uSpin = 0;
+    bool bOk;
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        Charge(m_uMemoryNs, uSpin);
+        m_Stats.m_uWrites++;
+        bOk = Process(hProcess);
+        for (size_t i = 0; bOk && i < uCount; i++)
+        {
+            m_Stats.m_uBytesWritten += pIov[i].m_uLen;
+            bOk = WriteAt((uint64_t)(uintptr_t)pIov[i].m_pAppMem,
+                pIov[i].m_pThisMem, pIov[i].m_uLen);
+        }
+    }
+
+    uCalls = 1;
+    Spin(uSpin);
+    return bOk;
+}
+
+/* windows */
+
+void SimBackend::EnumTopWindows(WindowFunc func)
+{
+    // callbacks may send messages, so they run without the lock
+    std::vector<HWND> windows;
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        m_Stats.m_uWindowCalls++;
+        for (size_t i = 0; i < m_Windows.size(); i++)
+            if (m_Windows[i].m_bAlive && !m_Windows[i].m_hParent)
+                windows.push_back(WindowHandle(i));
+    }
+
+    for (HWND hWnd : windows)
+        if (!func(hWnd))
+            break;
+}
+
+void SimBackend::EnumChildren(HWND hWnd, WindowFunc func)
+{
+    std::vector<HWND> windows, pending;
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        m_Stats.m_uWindowCalls++;
+        simwindow* wnd = Window(hWnd);
+        if (!wnd)
+            return;
+
+        // depth-first in creation order, as EnumChildWindows does
+        pending.assign(wnd->m_Children.rbegin(), wnd->m_Children.rend());
+        while (!pending.empty())
+        {
+            HWND hChild = pending.back();
+            pending.pop_back();
+            simwindow* child = Window(hChild);
+            if (!child)
+                continue;
+
+            windows.push_back(hChild);
+            pending.insert(pending.end(), child->m_Children.rbegin(),
+                child->m_Children.rend());
+        }
+    }
+
+    for (HWND hChild : windows)
+        if (!func(hChild))
+            break;
+}
+
+DWORD SimBackend::WindowProcessId(HWND hWnd)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    m_Stats.m_uWindowCalls++;
+    simwindow* wnd = Window(hWnd);
+    return wnd ? wnd->m_dwPid : 0;
+}
+
+std::string SimBackend::WindowClass(HWND hWnd)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    m_Stats.m_uWindowCalls++;
+    simwindow* wnd = Window(hWnd);
+    return wnd ? wnd->m_Class : std::string();
+}
+
+HWND SimBackend::WindowParent(HWND hWnd)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    m_Stats.m_uWindowCalls++;
+    simwindow* wnd = Window(hWnd);
+    return wnd ? wnd->m_hParent : NULL;
+}
+
+bool SimBackend::WindowText(HWND hWnd, std::wstring& text)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    m_Stats.m_uWindowCalls++;
+    simwindow* wnd = Window(hWnd);
+    if (!wnd)
+        return Fail(ERROR_INVALID_WINDOW_HANDLE);
+
+    text = wnd->m_Text;
+    return true;
+}
+
+bool SimBackend::IsUnicodeWindow(HWND hWnd)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    simwindow* wnd = Window(hWnd);
+    return wnd && wnd->m_bUnicode;
+}
+
+HWND SimBackend::FindChildWindow(HWND hParent, const std::string& wndClass,
+    const std::wstring* wndText)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    m_Stats.m_uWindowCalls++;
+
+    auto matches = [&](HWND hWnd) {
+        simwindow* wnd = Window(hWnd);
+        return wnd && wnd->m_hParent == hParent
+            && !strcasecmp(wnd->m_Class.c_str(), wndClass.c_str())
+            && (!wndText || wnd->m_Text == *wndText);
+    };
+
+    if (hParent)
+    {
+        simwindow* parent = Window(hParent);
+        if (!parent)
+            return NULL;
+        for (HWND hChild : parent->m_Children)
+            if (matches(hChild))
+                return hChild;
+        return NULL;
+    }
+
+    for (size_t i = 0; i < m_Windows.size(); i++)
+        if (matches(WindowHandle(i)))
+            return WindowHandle(i);
+    return NULL;
+}
+
+/* messaging */
+
+void SimBackend::Destroy(HWND hWnd)
+{
+    simwindow* wnd = Window(hWnd);
+    if (!wnd)
+        return;
+
+    wnd->m_bAlive = false;
+    for (HWND hChild : wnd->m_Children)
+        Destroy(hChild);
+
+    // queued messages die with the window unanswered
+    m_Async.erase(std::remove_if(m_Async.begin(), m_Async.end(),
+        [hWnd](const simasync& async) {
+            return async.m_hWnd == hWnd && !async.m_bAnswered;
+        }), m_Async.end());
+
+    // the last top-level window of the application ends its process
+    for (auto& other : m_Windows)
+        if (other.m_bAlive && !other.m_hParent && other.m_dwPid == m_dwPid)
+            return;
+    if (m_bStarted)
+        m_bExited = true;
+}
+
+LRESULT SimBackend::GetTreeItem(HWND hWnd, LPARAM lParam, bool bUnicode)
+{
+    uint64_t uAddr = (uint64_t)(uintptr_t)lParam;
+    tvitem64_t tv;
+
+    if (m_bWow64)
+    {
+        tvitem32_t tv32;
+        if (!ReadAt(uAddr, &tv32, sizeof(tv32)))
+            return FALSE;
+        tv = { tv32.mask, tv32.hItem, tv32.state, tv32.stateMask,
+            tv32.dwText, tv32.cchTextMax, tv32.iImage,
+            tv32.iSelectedImage, tv32.cChildren, tv32.lParam };
+    }
+    else if (!ReadAt(uAddr, &tv, sizeof(tv)))
+        return FALSE;
+
+    simitem* item = Item((DWORD_PTR)tv.hItem);
+    if (!item || item->m_hTree != hWnd)
+        return FALSE;
+
+    if ((tv.mask & TVIF_TEXT) && tv.cchTextMax > 0)
+    {
+        size_t uMax = tv.cchTextMax - 1;
+        if (bUnicode)
+        {
+            std::wstring text = item->m_Text.substr(0, uMax);
+            if (!WriteAt(tv.dwText, text.c_str(),
+                (text.size() + 1) * sizeof(wchar_t)))
+                return FALSE;
+        }
+        else
+        {
+            std::string text = WcharToAnsi(item->m_Text).substr(0, uMax);
+            if (!WriteAt(tv.dwText, text.c_str(), text.size() + 1))
+                return FALSE;
+        }
+    }
+    if (tv.mask & TVIF_IMAGE)
+        tv.iImage = item->m_iImage;
+    if (tv.mask & TVIF_CHILDREN)
+        tv.cChildren = item->m_hFirstChild ? 1 : 0;
+
+    if (m_bWow64)
+    {
+        tvitem32_t tv32 = { tv.mask, (uint32_t)tv.hItem, tv.state,
+            tv.stateMask, (uint32_t)tv.dwText, tv.cchTextMax, tv.iImage,
+            tv.iSelectedImage, tv.cChildren, (uint32_t)tv.lParam };
+        return WriteAt(uAddr, &tv32, sizeof(tv32));
+    }
+    return WriteAt(uAddr, &tv, sizeof(tv));
+}
+
+LRESULT SimBackend::Dispatch(HWND hWnd, simwindow& wnd, UINT uMsg,
+    WPARAM wParam, LPARAM lParam)
+{
+    switch (uMsg)
+    {
+    case WM_CLOSE:
+        Destroy(hWnd);
+        return 0;
+    case WM_GETTEXTLENGTH:
+        return wnd.m_bUnicode ? wnd.m_Text.size()
+            : WcharToAnsi(wnd.m_Text).size();
+    case WM_GETTEXT:
+    {
+        // the system copies WM_GETTEXT buffers across processes, so
+        // lParam is a pointer in the caller
+        if (!wParam || !lParam)
+            return 0;
+        if (wnd.m_bUnicode)
+        {
+            size_t uLen = std::min<size_t>(wnd.m_Text.size(), wParam - 1);
+            wmemcpy((wchar_t*)lParam, wnd.m_Text.c_str(), uLen);
+            ((wchar_t*)lParam)[uLen] = L'\0';
+            return uLen;
+        }
+        std::string text = WcharToAnsi(wnd.m_Text);
+        size_t uLen = std::min<size_t>(text.size(), wParam - 1);
+        memcpy((char*)lParam, text.c_str(), uLen);
+        ((char*)lParam)[uLen] = '\0';
+        return uLen;
+    }
+    case TVM_GETNEXTITEM:
+    {
+        simitem* item = lParam ? Item((DWORD_PTR)lParam) : nullptr;
+        if (lParam && (!item || item->m_hTree != hWnd))
+            return 0;
+
+        switch (wParam)
+        {
+        case TVGN_ROOT:
+            return wnd.m_hFirstRoot;
+        case TVGN_CHILD:
+            return item ? item->m_hFirstChild : wnd.m_hFirstRoot;
+        case TVGN_NEXT:
+            return item ? item->m_hNext : 0;
+        case TVGN_PREVIOUS:
+            return item ? item->m_hPrev : 0;
+        case TVGN_PARENT:
+            return item ? item->m_hParent : 0;
+        }
+        return 0;
+    }
+    case TVM_GETITEMA:
+        return GetTreeItem(hWnd, lParam, false);
+    case TVM_GETITEMW:
+        return GetTreeItem(hWnd, lParam, true);
+    }
+
+    return 0;
+}
+
+LRESULT SimBackend::SendAppMessage(HWND hWnd, UINT uMsg,
+    WPARAM wParam, LPARAM lParam)
+{
+    DWORD_PTR dwResult = 0;
+    SendAppMessageTimeout(hWnd, uMsg, wParam, lParam, INFINITE, dwResult);
+    return (LRESULT)dwResult;
+}
+
+appmsgresult SimBackend::SendAppMessageTimeout(HWND hWnd, UINT uMsg,
+    WPARAM wParam, LPARAM lParam, unsigned uTimeOut, DWORD_PTR& dwResult)
+{
+    uint64_t uSpin = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        m_Stats.m_uMessages++;
+
+        simwindow* wnd = Window(hWnd);
+        if (!wnd)
+        {
+            Fail(ERROR_INVALID_WINDOW_HANDLE);
+            return AppMsgFailed;
+        }
+        if (wnd->m_bHung)
+        {
+            // charged on the virtual clock only, nobody wants to spin
+            // through a real timeout
+            m_Stats.m_uTimeOuts++;
+            m_Stats.m_uVirtualNs += uTimeOut * 1000000ull;
+            Fail(ERROR_TIMEOUT);
+            return AppMsgTimeOut;
+        }
+
+        Charge(m_uMessageNs, uSpin);
+        dwResult = (DWORD_PTR)Dispatch(hWnd, *wnd, uMsg, wParam, lParam);
+    }
+
+    Spin(uSpin);
+    return AppMsgDone;
+}
+
+bool SimBackend::PostAppMessage(HWND hWnd, UINT uMsg,
+    WPARAM wParam, LPARAM lParam)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    m_Stats.m_uMessages++;
+
+    simwindow* wnd = Window(hWnd);
+    if (!wnd)
+        return Fail(ERROR_INVALID_WINDOW_HANDLE);
+
+    // only closing has a lasting effect, anything else is dropped
+    if (uMsg == WM_CLOSE)
+        Destroy(hWnd);
+    return true;
+}
+
+bool SimBackend::SendAppMessageAsync(HWND hWnd, UINT uMsg,
+    WPARAM wParam, LPARAM lParam, ResultFunc func)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    m_Stats.m_uMessages++;
+
+    simwindow* wnd = Window(hWnd);
+    if (!wnd)
+        return Fail(ERROR_INVALID_WINDOW_HANDLE);
+    if (uMsg == WM_GETTEXT)
+        return Fail(ERROR_MESSAGE_SYNC_ONLY);
+
+    simasync async;
+    async.m_Thread = std::this_thread::get_id();
+    async.m_hWnd = hWnd;
+    async.m_uMsg = uMsg;
+    async.m_wParam = wParam;
+    async.m_lParam = lParam;
+    async.m_Func = std::move(func);
+    if (!wnd->m_bHung)
+    {
+        async.m_dwResult = (DWORD_PTR)Dispatch(hWnd, *wnd, uMsg,
+            wParam, lParam);
+        async.m_bAnswered = true;
+        async.m_uReadyNs = m_Stats.m_uVirtualNs + m_uMessageNs;
+    }
+
+    m_Async.push_back(std::move(async));
+    if (m_Async.back().m_bAnswered)
+        m_Answered.notify_all();
+    return true;
+}
+
+size_t SimBackend::PumpAppMessages(DWORD dwTimeOut)
+{
+    std::thread::id thread = std::this_thread::get_id();
+    auto deadline = std::chrono::steady_clock::now()
+        + std::chrono::milliseconds(dwTimeOut);
+    std::vector<std::pair<ResultFunc, DWORD_PTR>> results;
+    uint64_t uSpin = 0;
+    {
+        std::unique_lock<std::mutex> lock(m_Lock);
+
+        // earliest answer for this thread
+        uint64_t uReadyNs = 0;
+        for (;;)
+        {
+            bool bFound = false;
+            for (auto& async : m_Async)
+            {
+                if (async.m_Thread == thread && async.m_bAnswered
+                    && (!bFound || async.m_uReadyNs < uReadyNs))
+                {
+                    uReadyNs = async.m_uReadyNs;
+                    bFound = true;
+                }
+            }
+            if (bFound)
+                break;
+
+            if (!dwTimeOut)
+                return 0;
+            if (dwTimeOut == INFINITE)
+                m_Answered.wait(lock);
+            else if (m_Answered.wait_until(lock, deadline)
+                == std::cv_status::timeout)
+            {
+                m_Stats.m_uVirtualNs += dwTimeOut * 1000000ull;
+                return 0;
+            }
+        }
+
+        if (uReadyNs > m_Stats.m_uVirtualNs)
+            Charge(uReadyNs - m_Stats.m_uVirtualNs, uSpin);
+
+        auto end = std::remove_if(m_Async.begin(), m_Async.end(),
+            [&](simasync& async) {
+                if (async.m_Thread != thread || !async.m_bAnswered
+                    || async.m_uReadyNs > m_Stats.m_uVirtualNs)
+                    return false;
+                results.emplace_back(std::move(async.m_Func),
+                    async.m_dwResult);
+                return true;
+            });
+        m_Async.erase(end, m_Async.end());
+    }
+
+    Spin(uSpin);
+    for (auto& result : results)
+        result.first(result.second);
+    return results.size();
+}
+
+DWORD SimBackend::LastError() const
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    return m_dwError;
+}
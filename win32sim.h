@@ -0,0 +1,191 @@
+#ifndef __WIN32SIM_H
+#define __WIN32SIM_H
+
+#include "win32backend.h"
+#include <stdint.h>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// AppBackend without a real process: one simulated application owning a
+// tree of windows, some of them TreeView controls answering
+// TVM_GETNEXTITEM and TVM_GETITEM the way comctl32 does. Remote memory
+// is a separate address space laid out like a 32-bit (WOW64) or 64-bit
+// process, so pointers into it cannot be dereferenced by mistake. Wide
+// text in remote memory uses the host wchar_t.
+//
+// Every message and memory call is counted and charged a fixed latency
+// on a virtual clock, which keeps runs deterministic. With bSpin the
+// latency is also spent in wall time, for benchmarks timing real runs.
+// Asynchronous messages are answered one message latency after they
+// were sent, so the latency of messages in flight together overlaps;
+// a hung window answers its queued messages once it is unhung.
+class SimBackend : public AppBackend
+{
+public:
+    struct simstats {
+        uint64_t m_uMessages = 0;
+        // window manager queries: enumeration, class, text, parent...
+        uint64_t m_uWindowCalls = 0;
+        uint64_t m_uTimeOuts = 0;
+        uint64_t m_uReads = 0;
+        uint64_t m_uWrites = 0;
+        uint64_t m_uAllocs = 0;
+        uint64_t m_uFrees = 0;
+        uint64_t m_uBytesRead = 0;
+        uint64_t m_uBytesWritten = 0;
+        uint64_t m_uVirtualNs = 0;
+    };
+
+    SimBackend(bool bWow64 = false);
+    virtual ~SimBackend();
+
+    HWND AddWindow(HWND hParent, const std::string& wndClass,
+        const std::wstring& text, bool bUnicode = true);
+    // top-level window of some other process
+    HWND AddForeignWindow(const std::string& wndClass,
+        const std::wstring& text);
+    // hParent 0 adds a root item
+    DWORD_PTR AddTreeItem(HWND hTree, DWORD_PTR hParent,
+        const std::wstring& text, int iImage = 0);
+    void SetHung(HWND hWnd, bool bHung);
+    void SetLatency(unsigned uMessageNs, unsigned uMemoryNs,
+        bool bSpin = false);
+    // wall time latency is slept instead of spun, the way a thread waits
+    // for another process; coarser, but it leaves the CPU to other
+    // threads
+    void SetBlocking(bool bBlocking);
+
+    simstats Stats() const;
+    void ResetStats();
+    // remote allocations not freed yet
+    size_t LiveAllocations() const;
+
+    virtual bool StartProcess(const std::wstring& exePath,
+        const std::wstring& cmdLine, HANDLE& hProcess, DWORD& dwPid,
+        bool& bWow64);
+    virtual void CloseProcess(HANDLE hProcess);
+    virtual bool TerminateProcess(HANDLE hProcess);
+    virtual DWORD WaitProcess(HANDLE hProcess, DWORD dwTimeOut);
+    virtual DWORD WaitProcessIdle(HANDLE hProcess, DWORD dwTimeOut);
+
+    virtual void* AllocRemote(HANDLE hProcess, size_t uLen);
+    virtual bool FreeRemote(HANDLE hProcess, void* pAppMem);
+    virtual bool ReadRemote(HANDLE hProcess, const void* pAppMem,
+        void* pThisMem, size_t uLen);
+    virtual bool WriteRemote(HANDLE hProcess, void* pAppMem,
+        const void* pThisMem, size_t uLen);
+    // one call, charged once, however many regions
+    virtual bool ReadRemoteV(HANDLE hProcess, const remoteiov* pIov,
+        size_t uCount, unsigned& uCalls);
+    virtual bool WriteRemoteV(HANDLE hProcess, const remoteiov* pIov,
+        size_t uCount, unsigned& uCalls);
+
+    virtual void EnumTopWindows(WindowFunc func);
+    virtual void EnumChildren(HWND hWnd, WindowFunc func);
+    virtual DWORD WindowProcessId(HWND hWnd);
+    virtual std::string WindowClass(HWND hWnd);
+    virtual HWND WindowParent(HWND hWnd);
+    virtual bool WindowText(HWND hWnd, std::wstring& text);
+    virtual bool IsUnicodeWindow(HWND hWnd);
+    virtual HWND FindChildWindow(HWND hParent, const std::string& wndClass,
+        const std::wstring* wndText);
+
+    virtual LRESULT SendAppMessage(HWND hWnd, UINT uMsg,
+        WPARAM wParam, LPARAM lParam);
+    virtual appmsgresult SendAppMessageTimeout(HWND hWnd, UINT uMsg,
+        WPARAM wParam, LPARAM lParam, unsigned uTimeOut,
+        DWORD_PTR& dwResult);
+    virtual bool PostAppMessage(HWND hWnd, UINT uMsg,
+        WPARAM wParam, LPARAM lParam);
+    // WM_GETTEXT fails with ERROR_MESSAGE_SYNC_ONLY, as it does on
+    // Windows, where the system cannot marshal its pointer asynchronously
+    virtual bool SendAppMessageAsync(HWND hWnd, UINT uMsg,
+        WPARAM wParam, LPARAM lParam, ResultFunc func);
+    // a wait without answers is charged on the virtual clock like a
+    // timeout
+    virtual size_t PumpAppMessages(DWORD dwTimeOut);
+
+    virtual DWORD LastError() const;
+private:
+    struct simwindow {
+        HWND m_hParent = NULL;
+        DWORD m_dwPid = 0;
+        std::string m_Class;
+        std::wstring m_Text;
+        bool m_bUnicode = true;
+        bool m_bHung = false;
+        bool m_bAlive = true;
+        std::vector<HWND> m_Children;
+        DWORD_PTR m_hFirstRoot = 0;
+        DWORD_PTR m_hLastRoot = 0;
+    };
+
+    // asynchronous message in flight
+    struct simasync {
+        std::thread::id m_Thread;
+        HWND m_hWnd;
+        UINT m_uMsg;
+        WPARAM m_wParam;
+        LPARAM m_lParam;
+        ResultFunc m_Func;
+        DWORD_PTR m_dwResult = 0;
+        bool m_bAnswered = false;
+        uint64_t m_uReadyNs = 0;
+    };
+
+    struct simitem {
+        HWND m_hTree;
+        DWORD_PTR m_hParent;
+        DWORD_PTR m_hFirstChild;
+        DWORD_PTR m_hLastChild;
+        DWORD_PTR m_hNext;
+        DWORD_PTR m_hPrev;
+        std::wstring m_Text;
+        int m_iImage;
+    };
+
+    simwindow* Window(HWND hWnd);
+    simitem* Item(DWORD_PTR hItem);
+    bool Process(HANDLE hProcess);
+    bool Fail(DWORD dwError);
+    void Charge(uint64_t uNs, uint64_t& uSpin);
+    void Spin(uint64_t uNs) const;
+
+    std::vector<char>* Remote(uint64_t uAddr, size_t uLen, size_t& uOffset);
+    bool ReadAt(uint64_t uAddr, void* pData, size_t uLen);
+    bool WriteAt(uint64_t uAddr, const void* pData, size_t uLen);
+
+    LRESULT Dispatch(HWND hWnd, simwindow& wnd, UINT uMsg,
+        WPARAM wParam, LPARAM lParam);
+    LRESULT GetTreeItem(HWND hWnd, LPARAM lParam, bool bUnicode);
+    void Destroy(HWND hWnd);
+
+    mutable std::mutex m_Lock;
+    std::vector<simwindow> m_Windows;
+    std::vector<simitem> m_Items;
+    std::vector<simasync> m_Async;
+    std::condition_variable m_Answered;
+
+    std::map<uint64_t, std::vector<char>> m_Remote;
+    std::map<size_t, std::vector<uint64_t>> m_Released;
+    uint64_t m_uNextAddr;
+    uint64_t m_uAddrLimit;
+
+    bool m_bWow64;
+    bool m_bStarted;
+    bool m_bExited;
+    DWORD m_dwPid;
+    DWORD m_dwError;
+
+    unsigned m_uMessageNs;
+    unsigned m_uMemoryNs;
+    bool m_bSpin;
+    bool m_bBlocking;
+    simstats m_Stats;
+};
+
+#endif
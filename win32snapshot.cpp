@@ -0,0 +1,358 @@
+#include "win32snapshot.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+#define SNAPSHOT_MAGIC "W32SNP1"
+
+/* File layout: the header, then the arrays sizes, parents, name
+ * offsets, first children, child counts and types, each with one slot
+ * per entry, then the name pool. Every array starts 8-byte aligned. A
+ * pool entry is a length byte followed by the name and a '\0'. */
+
+struct snapheader {
+    char m_szMagic[8];
+    uint32_t m_uCount;
+    uint32_t m_uReserved;
+    uint64_t m_uNamesLen;
+    uint64_t m_uFileLen;
+};
+
+static size_t AlignSnap(size_t uLen)
+{
+    return (uLen + 7) & ~(size_t)7;
+}
+
+struct snaplayout {
+    size_t m_uSizes;
+    size_t m_uParents;
+    size_t m_uNameOffsets;
+    size_t m_uFirstChild;
+    size_t m_uChildCount;
+    size_t m_uTypes;
+    size_t m_uNames;
+    size_t m_uEnd;
+
+    snaplayout(uint64_t uCount, uint64_t uNamesLen)
+    {
+        m_uSizes = sizeof(snapheader);
+        m_uParents = m_uSizes + uCount * sizeof(uint64_t);
+        m_uNameOffsets = AlignSnap(m_uParents + uCount * sizeof(uint32_t));
+        m_uFirstChild = AlignSnap(m_uNameOffsets + uCount * sizeof(uint32_t));
+        m_uChildCount = AlignSnap(m_uFirstChild + uCount * sizeof(uint32_t));
+        m_uTypes = AlignSnap(m_uChildCount + uCount * sizeof(uint32_t));
+        m_uNames = AlignSnap(m_uTypes + uCount);
+        m_uEnd = m_uNames + uNamesLen;
+    }
+};
+
+/* Writer */
+
+class _snapwriter
+{
+public:
+    bool Build(int fd);
+    bool Save(FILE* fp) const;
+private:
+    uint32_t Intern(std::string_view name);
+    uint64_t Walk(int fd, uint32_t uDir);
+
+    std::vector<uint64_t> m_Sizes;
+    std::vector<uint32_t> m_Parents;
+    std::vector<uint32_t> m_NameOffsets;
+    std::vector<uint32_t> m_FirstChild;
+    std::vector<uint32_t> m_ChildCount;
+    std::vector<uint8_t> m_Types;
+    std::string m_Names;
+    std::unordered_map<std::string, uint32_t> m_Interned;
+    bool m_bOverflow = false;
+};
+
+uint32_t _snapwriter::Intern(std::string_view name)
+{
+    auto [it, bNew] = m_Interned.try_emplace(std::string(name),
+        (uint32_t)m_Names.size());
+    if (bNew)
+    {
+        if (m_Names.size() + name.size() + 2 > 0xFFFFFFFF)
+            m_bOverflow = true;
+        m_Names += (char)name.size();
+        m_Names += name;
+        m_Names += '\0';
+    }
+    return it->second;
+}
+
+bool _snapwriter::Build(int fd)
+{
+    m_Sizes.push_back(0);
+    m_Parents.push_back(DirSnapshot::npos);
+    m_NameOffsets.push_back(Intern(""));
+    m_FirstChild.push_back(0);
+    m_ChildCount.push_back(0);
+    m_Types.push_back(EntryDirectory);
+
+    m_Sizes[0] = Walk(fd, 0);
+    return !m_bOverflow;
+}
+
+uint64_t _snapwriter::Walk(int fd, uint32_t uDir)
+{
+    struct child {
+        size_t m_uName;
+        direntry m_Type;
+        uint64_t m_uSize;
+    };
+    std::string names;
+    std::vector<child> children;
+
+    ScanDirectoryAt(fd,
+        [&names, &children](const char* name, direntry type, uint64_t uSize) {
+            children.push_back({ names.size(), type, uSize });
+            names.append(name, strlen(name) + 1);
+            return true;
+        }
+    );
+
+    auto nameOf = [&names](const child& ent) {
+        return std::string_view(names.c_str() + ent.m_uName);
+    };
+    std::sort(children.begin(), children.end(),
+        [&nameOf](const child& a, const child& b) {
+            return nameOf(a) < nameOf(b);
+        }
+    );
+
+    uint32_t uFirst = (uint32_t)m_Sizes.size();
+    if (uFirst + children.size() >= DirSnapshot::npos)
+    {
+        m_bOverflow = true;
+        return 0;
+    }
+
+    m_FirstChild[uDir] = uFirst;
+    m_ChildCount[uDir] = (uint32_t)children.size();
+    for (auto& ent : children)
+    {
+        m_Sizes.push_back(ent.m_uSize);
+        m_Parents.push_back(uDir);
+        m_NameOffsets.push_back(Intern(nameOf(ent)));
+        m_FirstChild.push_back(0);
+        m_ChildCount.push_back(0);
+        m_Types.push_back((uint8_t)ent.m_Type);
+    }
+
+    // the children block is complete, subdirectories append after it
+    uint64_t uTotal = 0;
+    for (uint32_t i = 0; i < children.size(); i++)
+    {
+        uint32_t uEntry = uFirst + i;
+        if (children[i].m_Type != EntryDirectory)
+        {
+            uTotal += children[i].m_uSize;
+            continue;
+        }
+
+        int subfd = openat(fd, nameOf(children[i]).data(),
+            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (subfd < 0)
+            continue;
+        m_Sizes[uEntry] = Walk(subfd, uEntry);
+        uTotal += m_Sizes[uEntry];
+        close(subfd);
+    }
+
+    return uTotal;
+}
+
+template<typename T>
+static bool WriteArray(FILE* fp, const T* values, size_t uCount)
+{
+    static const char zeros[8] = { 0 };
+    size_t uPad = AlignSnap(ftell(fp)) - ftell(fp);
+
+    return fwrite(zeros, 1, uPad, fp) == uPad
+        && (!uCount || fwrite(values, sizeof(T), uCount, fp) == uCount);
+}
+
+template<typename T>
+static bool WriteArray(FILE* fp, const std::vector<T>& values)
+{
+    return WriteArray(fp, values.data(), values.size());
+}
+
+bool _snapwriter::Save(FILE* fp) const
+{
+    snapheader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.m_szMagic, SNAPSHOT_MAGIC, 8);
+    header.m_uCount = (uint32_t)m_Sizes.size();
+    header.m_uNamesLen = m_Names.size();
+    header.m_uFileLen = snaplayout(header.m_uCount, m_Names.size()).m_uEnd;
+
+    return fwrite(&header, sizeof(header), 1, fp) == 1
+        && WriteArray(fp, m_Sizes) && WriteArray(fp, m_Parents)
+        && WriteArray(fp, m_NameOffsets) && WriteArray(fp, m_FirstChild)
+        && WriteArray(fp, m_ChildCount) && WriteArray(fp, m_Types)
+        && WriteArray(fp, m_Names.data(), m_Names.size());
+}
+
+bool DirSnapshot::Write(const std::wstring& root, const std::wstring& file)
+{
+    int fd = open(WcharToText(root).c_str(),
+        O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    _snapwriter writer;
+    bool bOk = writer.Build(fd);
+    close(fd);
+    if (!bOk)
+        return false;
+
+    // replaced by rename, truncating a file that readers have mapped
+    // would crash them
+    std::string target = WcharToText(file), temp = target + ".tmp";
+    FILE* fp = fopen(temp.c_str(), "wb");
+    if (!fp)
+        return false;
+
+    bOk = writer.Save(fp);
+    bOk = !fclose(fp) && bOk && !rename(temp.c_str(), target.c_str());
+    if (!bOk)
+        unlink(temp.c_str());
+    return bOk;
+}
+
+/* Reader */
+
+DirSnapshot::DirSnapshot()
+    : m_pBase(nullptr), m_uLength(0), m_uCount(0)
+{
+}
+
+DirSnapshot::~DirSnapshot()
+{
+    Close();
+}
+
+bool DirSnapshot::Open(const std::wstring& file)
+{
+    Close();
+
+    int fd = open(WcharToText(file).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(snapheader))
+    {
+        close(fd);
+        return false;
+    }
+
+    void* pBase = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (pBase == MAP_FAILED)
+        return false;
+
+    const snapheader* header = (const snapheader*)pBase;
+    snaplayout layout(header->m_uCount, header->m_uNamesLen);
+    if (memcmp(header->m_szMagic, SNAPSHOT_MAGIC, 8) || !header->m_uCount
+        || header->m_uFileLen != layout.m_uEnd
+        || layout.m_uEnd != (uint64_t)st.st_size)
+    {
+        munmap(pBase, st.st_size);
+        return false;
+    }
+
+    const char* base = (const char*)pBase;
+    m_pBase = pBase;
+    m_uLength = st.st_size;
+    m_uCount = header->m_uCount;
+    m_pSizes = (const uint64_t*)(base + layout.m_uSizes);
+    m_pParents = (const uint32_t*)(base + layout.m_uParents);
+    m_pNameOffsets = (const uint32_t*)(base + layout.m_uNameOffsets);
+    m_pFirstChild = (const uint32_t*)(base + layout.m_uFirstChild);
+    m_pChildCount = (const uint32_t*)(base + layout.m_uChildCount);
+    m_pTypes = (const uint8_t*)(base + layout.m_uTypes);
+    m_pNames = base + layout.m_uNames;
+    return true;
+}
+
+void DirSnapshot::Close()
+{
+    if (!m_pBase)
+        return;
+
+    munmap(m_pBase, m_uLength);
+    m_pBase = nullptr;
+    m_uLength = 0;
+    m_uCount = 0;
+}
+
+uint32_t DirSnapshot::Find(uint32_t uDir, std::string_view name) const
+{
+    uint32_t uLow = FirstChild(uDir), uHigh = uLow + ChildCount(uDir);
+
+    while (uLow < uHigh)
+    {
+        uint32_t uMid = uLow + (uHigh - uLow) / 2;
+        int iCmp = Name(uMid).compare(name);
+        if (!iCmp)
+            return uMid;
+        if (iCmp < 0)
+            uLow = uMid + 1;
+        else
+            uHigh = uMid;
+    }
+
+    return npos;
+}
+
+uint32_t DirSnapshot::Lookup(std::string_view path, uint32_t uFrom) const
+{
+    uint32_t uEntry = uFrom;
+
+    while (!path.empty() && uEntry != npos)
+    {
+        size_t uSep = path.find('/');
+        std::string_view name = path.substr(0, uSep);
+        path = uSep == path.npos ? std::string_view() : path.substr(uSep + 1);
+
+        if (name.empty() || name == ".")
+            continue;
+        if (name == "..")
+            uEntry = Parent(uEntry);
+        else
+            uEntry = Find(uEntry, name);
+    }
+
+    return uEntry;
+}
+
+std::string DirSnapshot::Path(uint32_t uEntry) const
+{
+    std::vector<uint32_t> chain;
+    for (; uEntry != npos && Parent(uEntry) != npos; uEntry = Parent(uEntry))
+        chain.push_back(uEntry);
+
+    std::string path;
+    for (auto it = chain.rbegin(); it != chain.rend(); it++)
+    {
+        if (!path.empty())
+            path += '/';
+        path += Name(*it);
+    }
+
+    return path;
+}
+#endif
@@ -0,0 +1,80 @@
+#ifndef __WIN32SNAPSHOT_H
+#define __WIN32SNAPSHOT_H
+
+#ifndef WIN32
+#include "win32util.h"
+#include <stdint.h>
+#include <string>
+#include <string_view>
+
+// Read-only snapshot of a directory tree in a file that is mapped
+// instead of parsed. Entries are numbered from 0, the root, and the
+// children of every directory are stored next to each other sorted by
+// name, so listing is a range and lookup a binary search per component.
+// Directory sizes are the total of their subtree.
+//
+// Names are UTF-8 and point into the mapping, nothing allocates except
+// Path(). Files are in native byte order and only the header is checked
+// by Open(), load only snapshots this library wrote.
+class DirSnapshot
+{
+public:
+    static constexpr uint32_t npos = 0xFFFFFFFF;
+
+    DirSnapshot();
+    virtual ~DirSnapshot();
+
+    static bool Write(const std::wstring& root, const std::wstring& file);
+
+    bool Open(const std::wstring& file);
+    void Close();
+    inline bool IsOpen() const { return m_pBase != nullptr; }
+
+    inline uint32_t Count() const { return m_uCount; }
+    inline uint32_t Root() const { return 0; }
+
+    inline std::string_view Name(uint32_t uEntry) const
+    {
+        const char* name = m_pNames + m_pNameOffsets[uEntry];
+        return std::string_view(name + 1, (uint8_t)name[0]);
+    }
+    inline direntry Type(uint32_t uEntry) const
+    {
+        return (direntry)m_pTypes[uEntry];
+    }
+    inline uint64_t Size(uint32_t uEntry) const { return m_pSizes[uEntry]; }
+    inline uint32_t Parent(uint32_t uEntry) const
+    {
+        return m_pParents[uEntry];
+    }
+    inline uint32_t FirstChild(uint32_t uEntry) const
+    {
+        return m_pFirstChild[uEntry];
+    }
+    inline uint32_t ChildCount(uint32_t uEntry) const
+    {
+        return m_pChildCount[uEntry];
+    }
+
+    // child of uDir called name, or npos
+    uint32_t Find(uint32_t uDir, std::string_view name) const;
+    // '/'-separated path relative to uFrom, or npos
+    uint32_t Lookup(std::string_view path, uint32_t uFrom = 0) const;
+    // path of uEntry relative to the root
+    std::string Path(uint32_t uEntry) const;
+private:
+    void* m_pBase;
+    size_t m_uLength;
+    uint32_t m_uCount;
+
+    const uint64_t* m_pSizes;
+    const uint32_t* m_pParents;
+    const uint32_t* m_pNameOffsets;
+    const uint32_t* m_pFirstChild;
+    const uint32_t* m_pChildCount;
+    const uint8_t* m_pTypes;
+    const char* m_pNames;
+};
+#endif
+
+#endif
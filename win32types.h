@@ -0,0 +1,78 @@
+#ifndef __WIN32TYPES_H
+#define __WIN32TYPES_H
+
+/* The subset of Windows types and constants that AppMonitor and its
+ * backends use, so they build where <Windows.h> does not exist. Values
+ * match the Windows SDK, simulated applications see the same messages
+ * and structures a real one would. */
+
+#ifdef WIN32
+#include <Windows.h>
+#include <commctrl.h>
+#else
+#include <stdint.h>
+#include <string.h>
+
+typedef int BOOL;
+typedef uint32_t DWORD;
+typedef unsigned int UINT;
+typedef uintptr_t WPARAM;
+typedef intptr_t LPARAM;
+typedef intptr_t LRESULT;
+typedef uintptr_t DWORD_PTR;
+typedef void* HANDLE;
+typedef struct HWND__* HWND;
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#define CALLBACK
+#define INFINITE 0xFFFFFFFF
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+#define ZeroMemory(p, len) memset((p), 0, (len))
+
+#define WAIT_OBJECT_0 0
+#define WAIT_TIMEOUT 258
+#define WAIT_FAILED 0xFFFFFFFF
+
+#define ERROR_SUCCESS 0
+#define ERROR_FILE_NOT_FOUND 2
+#define ERROR_ACCESS_DENIED 5
+#define ERROR_INVALID_HANDLE 6
+#define ERROR_NOT_ENOUGH_MEMORY 8
+#define ERROR_NOT_SUPPORTED 50
+#define ERROR_INVALID_PARAMETER 87
+#define ERROR_PARTIAL_COPY 299
+#define ERROR_MESSAGE_SYNC_ONLY 1159
+#define ERROR_CANCELLED 1223
+#define ERROR_INVALID_WINDOW_HANDLE 1400
+#define ERROR_TIMEOUT 1460
+
+#define WM_CLOSE 0x0010
+#define WM_GETTEXT 0x000D
+#define WM_GETTEXTLENGTH 0x000E
+#define WM_USER 0x0400
+
+#define TV_FIRST 0x1100
+#define TVM_GETNEXTITEM (TV_FIRST + 10)
+#define TVM_GETITEMA (TV_FIRST + 12)
+#define TVM_GETITEMW (TV_FIRST + 62)
+
+#define TVIF_TEXT 0x0001
+#define TVIF_IMAGE 0x0002
+#define TVIF_PARAM 0x0004
+#define TVIF_STATE 0x0008
+#define TVIF_HANDLE 0x0010
+#define TVIF_SELECTEDIMAGE 0x0020
+#define TVIF_CHILDREN 0x0040
+
+#define TVGN_ROOT 0x0000
+#define TVGN_NEXT 0x0001
+#define TVGN_PREVIOUS 0x0002
+#define TVGN_PARENT 0x0003
+#define TVGN_CHILD 0x0004
+#endif
+
+#endif
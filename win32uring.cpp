@@ -0,0 +1,443 @@
+#include "win32uring.h"
+
+#ifndef WIN32
+#include "win32util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+/* Minimal io_uring plumbing over the raw syscalls, so there is no
+ * dependency on liburing. One submitter, no SQPOLL. */
+
+struct _uring {
+    int m_iFd;
+
+    void* m_pSqRing;
+    size_t m_uSqRingLen;
+    unsigned* m_pSqHead;
+    unsigned* m_pSqTail;
+    unsigned* m_pSqArray;
+    unsigned m_uSqMask;
+    unsigned m_uSqEntries;
+
+    io_uring_sqe* m_pSqes;
+    size_t m_uSqesLen;
+
+    void* m_pCqRing;
+    size_t m_uCqRingLen;
+    unsigned* m_pCqHead;
+    unsigned* m_pCqTail;
+    unsigned m_uCqMask;
+    io_uring_cqe* m_pCqes;
+
+    unsigned m_uToSubmit;
+};
+
+static void UringDestroy(_uring* ring)
+{
+    if (ring->m_pSqes)
+        munmap(ring->m_pSqes, ring->m_uSqesLen);
+    if (ring->m_pCqRing && ring->m_pCqRing != ring->m_pSqRing)
+        munmap(ring->m_pCqRing, ring->m_uCqRingLen);
+    if (ring->m_pSqRing)
+        munmap(ring->m_pSqRing, ring->m_uSqRingLen);
+    if (ring->m_iFd >= 0)
+        close(ring->m_iFd);
+    delete ring;
+}
+
+static _uring* UringCreate(unsigned uEntries)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = (int)syscall(__NR_io_uring_setup, uEntries, &params);
+    if (fd < 0)
+        return nullptr;
+
+    _uring* ring = new _uring();
+    ring->m_iFd = fd;
+
+    ring->m_uSqRingLen = params.sq_off.array
+        + params.sq_entries * sizeof(unsigned);
+    ring->m_uCqRingLen = params.cq_off.cqes
+        + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->m_uSqRingLen = std::max(ring->m_uSqRingLen,
+            ring->m_uCqRingLen);
+    }
+
+    ring->m_pSqRing = mmap(NULL, ring->m_uSqRingLen,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        fd, IORING_OFF_SQ_RING);
+    if (ring->m_pSqRing == MAP_FAILED)
+    {
+        ring->m_pSqRing = nullptr;
+        UringDestroy(ring);
+        return nullptr;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->m_pCqRing = ring->m_pSqRing;
+    else
+    {
+        ring->m_pCqRing = mmap(NULL, ring->m_uCqRingLen,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            fd, IORING_OFF_CQ_RING);
+        if (ring->m_pCqRing == MAP_FAILED)
+        {
+            ring->m_pCqRing = nullptr;
+            UringDestroy(ring);
+            return nullptr;
+        }
+    }
+
+    ring->m_uSqesLen = params.sq_entries * sizeof(io_uring_sqe);
+    ring->m_pSqes = (io_uring_sqe*)mmap(NULL, ring->m_uSqesLen,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        fd, IORING_OFF_SQES);
+    if (ring->m_pSqes == MAP_FAILED)
+    {
+        ring->m_pSqes = nullptr;
+        UringDestroy(ring);
+        return nullptr;
+    }
+
+    char* sq = (char*)ring->m_pSqRing;
+    ring->m_pSqHead = (unsigned*)(sq + params.sq_off.head);
+    ring->m_pSqTail = (unsigned*)(sq + params.sq_off.tail);
+    ring->m_pSqArray = (unsigned*)(sq + params.sq_off.array);
+    ring->m_uSqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring->m_uSqEntries = params.sq_entries;
+
+    char* cq = (char*)ring->m_pCqRing;
+    ring->m_pCqHead = (unsigned*)(cq + params.cq_off.head);
+    ring->m_pCqTail = (unsigned*)(cq + params.cq_off.tail);
+    ring->m_uCqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring->m_pCqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    ring->m_uToSubmit = 0;
+    return ring;
+}
+
+static io_uring_sqe* UringGetSqe(_uring* ring)
+{
+    unsigned uTail = *ring->m_pSqTail;
+    unsigned uHead = __atomic_load_n(ring->m_pSqHead, __ATOMIC_ACQUIRE);
+    if (uTail - uHead >= ring->m_uSqEntries)
+        return nullptr;
+
+    unsigned uIndex = uTail & ring->m_uSqMask;
+    io_uring_sqe* sqe = &ring->m_pSqes[uIndex];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->m_pSqArray[uIndex] = uIndex;
+
+    __atomic_store_n(ring->m_pSqTail, uTail + 1, __ATOMIC_RELEASE);
+    ring->m_uToSubmit++;
+    return sqe;
+}
+
+static bool UringSubmit(_uring* ring, unsigned uWait)
+{
+    unsigned uFlags = uWait ? IORING_ENTER_GETEVENTS : 0;
+    if (!ring->m_uToSubmit && !uWait)
+        return true;
+
+    for (;;)
+    {
+        int iRes = (int)syscall(__NR_io_uring_enter, ring->m_iFd,
+            ring->m_uToSubmit, uWait, uFlags, NULL, 0);
+        if (iRes >= 0)
+        {
+            ring->m_uToSubmit -= std::min<unsigned>(iRes, ring->m_uToSubmit);
+            return true;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return false;
+    }
+}
+
+template<typename F>
+static unsigned UringReap(_uring* ring, F func)
+{
+    unsigned uHead = *ring->m_pCqHead;
+    unsigned uTail = __atomic_load_n(ring->m_pCqTail, __ATOMIC_ACQUIRE);
+    unsigned uCount = 0;
+
+    for (; uHead != uTail; uHead++, uCount++)
+    {
+        io_uring_cqe* cqe = &ring->m_pCqes[uHead & ring->m_uCqMask];
+        func(cqe->user_data, cqe->res);
+    }
+
+    __atomic_store_n(ring->m_pCqHead, uHead, __ATOMIC_RELEASE);
+    return uCount;
+}
+
+/* MetadataRing */
+
+MetadataRing::MetadataRing(unsigned uDepth)
+    : m_pRing(nullptr), m_uDepth(std::max(uDepth, 1u))
+{
+    if (IsSupported())
+        m_pRing = UringCreate(m_uDepth);
+}
+
+MetadataRing::~MetadataRing()
+{
+    if (m_pRing)
+        UringDestroy(m_pRing);
+}
+
+static bool ProbeUring()
+{
+    _uring* ring = UringCreate(2);
+    if (!ring)
+        return false;
+
+    size_t uLen = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+    auto buf = std::make_unique<char[]>(uLen);
+    memset(buf.get(), 0, uLen);
+    io_uring_probe* probe = (io_uring_probe*)buf.get();
+
+    bool bOk = syscall(__NR_io_uring_register, ring->m_iFd,
+        IORING_REGISTER_PROBE, probe, 256) >= 0;
+    for (unsigned op : { IORING_OP_STATX, IORING_OP_OPENAT })
+    {
+        bOk = bOk && op < probe->ops_len
+            && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    UringDestroy(ring);
+    return bOk;
+}
+
+bool MetadataRing::IsSupported()
+{
+    static const bool s_bSupported = ProbeUring();
+    return s_bSupported;
+}
+
+struct ring_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// an open directory, alive while it is being read or while any
+// queued request still refers to its descriptor or names
+struct _ringdir {
+    int m_iFd;
+    std::string m_Names;
+    unsigned m_uRefs;
+};
+
+struct _ringop {
+    _ringdir* m_pDir;
+    const char* m_pName;
+    bool m_bUnknown;
+};
+
+struct _ringreq {
+    uint8_t m_uOp;
+    _ringop m_Op;
+    struct statx m_Statx;
+};
+
+static void ReleaseDir(_ringdir* dir)
+{
+    if (--dir->m_uRefs)
+        return;
+    close(dir->m_iFd);
+    delete dir;
+}
+
+uint64_t MetadataRing::GetDirectorySize(const std::wstring& path)
+{
+    if (!m_pRing)
+        return ::GetDirectorySize(path);
+
+    int fd = open(WcharToText(path).c_str(),
+        O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+
+    std::vector<_ringreq> reqs(m_uDepth);
+    std::vector<unsigned> freeReqs;
+    for (unsigned i = m_uDepth; i > 0; i--)
+        freeReqs.push_back(i - 1);
+
+    std::vector<_ringdir*> ready = { new _ringdir { fd, "", 1 } };
+    std::vector<_ringop> stats, opens;
+    std::vector<char> buf(65536);
+    uint64_t uTotal = 0;
+    unsigned uInFlight = 0, uOpening = 0;
+
+    auto complete = [&](uint64_t uData, int iRes) {
+        _ringreq& req = reqs[uData];
+        _ringop op = req.m_Op;
+        freeReqs.push_back((unsigned)uData);
+        uInFlight--;
+
+        if (req.m_uOp == IORING_OP_OPENAT)
+        {
+            uOpening--;
+            if (iRes >= 0)
+                ready.push_back(new _ringdir { iRes, "", 1 });
+            ReleaseDir(op.m_pDir);
+            return;
+        }
+
+        if (iRes < 0)
+            ReleaseDir(op.m_pDir);
+        else if (S_ISREG(req.m_Statx.stx_mode) || !op.m_bUnknown)
+        {
+            uTotal += req.m_Statx.stx_size;
+            ReleaseDir(op.m_pDir);
+        }
+        else if (S_ISDIR(req.m_Statx.stx_mode))
+        {
+            op.m_bUnknown = false;
+            opens.push_back(op);
+        }
+        else ReleaseDir(op.m_pDir);
+    };
+
+    for (;;)
+    {
+        // keep the ring full, file stats first, directory opens only
+        // while few opened directories are waiting to be read
+        while (!freeReqs.empty())
+        {
+            unsigned uReq = freeReqs.back();
+            _ringreq& req = reqs[uReq];
+
+            if (!stats.empty())
+            {
+                req.m_Op = stats.back();
+                stats.pop_back();
+                req.m_uOp = IORING_OP_STATX;
+            }
+            else if (!opens.empty() && ready.size() + uOpening < m_uDepth)
+            {
+                req.m_Op = opens.back();
+                opens.pop_back();
+                req.m_uOp = IORING_OP_OPENAT;
+                uOpening++;
+            }
+            else break;
+
+            io_uring_sqe* sqe = UringGetSqe(m_pRing);
+            if (!sqe)
+            {
+                if (req.m_uOp == IORING_OP_OPENAT)
+                {
+                    opens.push_back(req.m_Op);
+                    uOpening--;
+                }
+                else stats.push_back(req.m_Op);
+                break;
+            }
+
+            sqe->opcode = req.m_uOp;
+            sqe->fd = req.m_Op.m_pDir->m_iFd;
+            sqe->addr = (uint64_t)(uintptr_t)req.m_Op.m_pName;
+            sqe->user_data = uReq;
+            if (req.m_uOp == IORING_OP_STATX)
+            {
+                sqe->len = req.m_Op.m_bUnknown
+                    ? STATX_TYPE | STATX_SIZE : STATX_SIZE;
+                sqe->off = (uint64_t)(uintptr_t)&req.m_Statx;
+                sqe->statx_flags = AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC;
+            }
+            else
+            {
+                sqe->open_flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW
+                    | O_CLOEXEC;
+            }
+
+            freeReqs.pop_back();
+            uInFlight++;
+        }
+
+        if (!ready.empty())
+        {
+            // let the kernel work on the queue while reading a directory
+            UringSubmit(m_pRing, 0);
+            _ringdir* dir = ready.back();
+            ready.pop_back();
+
+            std::vector<std::pair<size_t, unsigned char>> entries;
+            long lRead;
+            while ((lRead = syscall(SYS_getdents64, dir->m_iFd,
+                buf.data(), buf.size())) > 0)
+            {
+                for (long lPos = 0; lPos < lRead; )
+                {
+                    auto* ent = (ring_dirent64*)(buf.data() + lPos);
+                    lPos += ent->d_reclen;
+
+                    const char* name = ent->d_name;
+                    if (name[0] == '.' && (!name[1]
+                        || (name[1] == '.' && !name[2])))
+                        continue;
+                    if (ent->d_type != DT_REG && ent->d_type != DT_DIR
+                        && ent->d_type != DT_UNKNOWN)
+                        continue;
+
+                    entries.emplace_back(dir->m_Names.size(), ent->d_type);
+                    dir->m_Names.append(name, strlen(name) + 1);
+                }
+            }
+
+            // names are final now, pointers into them stay valid
+            for (auto& [uPos, type] : entries)
+            {
+                _ringop op = { dir, dir->m_Names.c_str() + uPos,
+                    type == DT_UNKNOWN };
+                dir->m_uRefs++;
+                (type == DT_DIR ? opens : stats).push_back(op);
+            }
+            ReleaseDir(dir);
+            continue;
+        }
+
+        if (!uInFlight)
+            break;
+
+        if (!UringSubmit(m_pRing, 1))
+            break;
+        UringReap(m_pRing, complete);
+    }
+
+    // only left with work here if io_uring_enter failed
+    while (uInFlight && UringSubmit(m_pRing, 1))
+        UringReap(m_pRing, complete);
+    for (auto& op : stats)
+        ReleaseDir(op.m_pDir);
+    for (auto& op : opens)
+        ReleaseDir(op.m_pDir);
+    for (auto* dir : ready)
+        ReleaseDir(dir);
+
+    return uTotal;
+}
+
+uint64_t GetDirectorySizeUring(const std::wstring& path, unsigned uDepth)
+{
+    MetadataRing ring(uDepth);
+    return ring.GetDirectorySize(path);
+}
+#endif
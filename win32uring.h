@@ -0,0 +1,40 @@
+#ifndef __WIN32URING_H
+#define __WIN32URING_H
+
+#ifndef WIN32
+#include <stdint.h>
+#include <string>
+
+struct _uring;
+
+// Directory walker that batches per-entry metadata syscalls through
+// io_uring. Directories are still read with getdents64, but the statx
+// of every file and the openat of every subdirectory are queued, and up
+// to uDepth of them stay in flight at once. The walk is depth-first, so
+// the number of open directories follows the tree depth.
+//
+// IsReady() is false when the kernel lacks io_uring or its STATX/OPENAT
+// operations, or when seccomp forbids it; GetDirectorySize then falls
+// back to the synchronous walker.
+class MetadataRing
+{
+public:
+    MetadataRing(unsigned uDepth = 64);
+    virtual ~MetadataRing();
+
+    static bool IsSupported();
+
+    inline bool IsReady() const { return m_pRing != nullptr; }
+    inline unsigned Depth() const { return m_uDepth; }
+
+    uint64_t GetDirectorySize(const std::wstring& path);
+private:
+    _uring* m_pRing;
+    unsigned m_uDepth;
+};
+
+uint64_t GetDirectorySizeUring(const std::wstring& path,
+    unsigned uDepth = 64);
+#endif
+
+#endif
@@ -1,4 +1,5 @@
 #include "win32util.h"
+#include "win32cp.h"
 
 #ifdef WIN32
 #include <io.h>
@@ -8,9 +9,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <iostream>
+#include <atomic>
+#include <deque>
 #include <memory>
 #include <map>
+#include <mutex>
+#include <thread>
 
 byteorder ArchByteOrder()
 {
@@ -37,49 +43,48 @@ bool IsLinuxSystem()
     return false;
 }
 
-std::wstring TextToWchar(const std::string& text)
+size_t TextToWchar(std::string_view text, std::span<wchar_t> out)
 {
-    size_t uWcharLen = MultiByteToWideChar(CP_UTF8, 0,
-        text.c_str(), text.size(), NULL, 0);
-    auto pszWchar = std::make_unique<wchar_t[]>(uWcharLen+1);
-    MultiByteToWideChar(CP_UTF8, 0, text.c_str(), text.size(),
-        pszWchar.get(), uWcharLen);
-    pszWchar[uWcharLen] = L'\0';
-    return std::wstring(pszWchar.get());
+    return AnsiToWchar(text, out, CP_UTF8);
 }
 
-std::string WcharToText(const std::wstring& text)
+size_t WcharToText(std::wstring_view text, std::span<char> out)
 {
-    size_t uMbsLen = WideCharToMultiByte(CP_UTF8, 0,
-        text.c_str(), text.size(), NULL, 0, NULL, NULL);
-    auto pszChar = std::make_unique<char[]>(uMbsLen +1);
-    WideCharToMultiByte(CP_UTF8, 0, text.c_str(), text.size(),
-        pszChar.get(), uMbsLen, NULL, NULL);
-    pszChar[uMbsLen] = '\0';
-    return std::string(pszChar.get());
+    return WcharToAnsi(text, out, CP_UTF8);
 }
 
-std::wstring AnsiToWchar(const std::string& text, int cp)
+size_t AnsiToWchar(std::string_view text, std::span<wchar_t> out, int cp)
 {
-    size_t uWcharLen = MultiByteToWideChar(cp, 0,
-        text.c_str(), text.size(), NULL, 0);
-    auto pszWchar = std::make_unique<wchar_t[]>(uWcharLen +1);
-    MultiByteToWideChar(cp, 0, text.c_str(), text.size(),
-        pszWchar.get(), uWcharLen);
-    pszWchar[uWcharLen] = L'\0';
-    return std::wstring(pszWchar.get());
+    if (text.empty())
+        return 0;
+
+    int iLen = MultiByteToWideChar(cp, 0, text.data(), (int)text.size(),
+        NULL, 0);
+    if (iLen <= 0)
+        return 0;
+    if ((size_t)iLen <= out.size())
+    {
+        MultiByteToWideChar(cp, 0, text.data(), (int)text.size(),
+            out.data(), iLen);
+    }
+    return (size_t)iLen;
 }
 
-
-std::string WcharToAnsi(const std::wstring& text, int cp)
+size_t WcharToAnsi(std::wstring_view text, std::span<char> out, int cp)
 {
-    size_t uMbsLen = WideCharToMultiByte(cp, 0,
-        text.c_str(), text.size(), NULL, 0, NULL, NULL);
-    auto pszChar = std::make_unique<char[]>(uMbsLen +1);
-    WideCharToMultiByte(cp, 0, text.c_str(), text.size(),
-        pszChar.get(), uMbsLen, NULL, NULL);
-    pszChar[uMbsLen] = '\0';
-    return std::string(pszChar.get());
+    if (text.empty())
+        return 0;
+
+    int iLen = WideCharToMultiByte(cp, 0, text.data(), (int)text.size(),
+        NULL, 0, NULL, NULL);
+    if (iLen <= 0)
+        return 0;
+    if ((size_t)iLen <= out.size())
+    {
+        WideCharToMultiByte(cp, 0, text.data(), (int)text.size(),
+            out.data(), iLen, NULL, NULL);
+    }
+    return (size_t)iLen;
 }
 
 std::wstring TermToWchar(const std::string& text)
@@ -92,38 +97,230 @@ std::string WcharToTerm(const std::wstring& text)
     return WcharToAnsi(text, GetConsoleOutputCP());
 }
 
+StreamTranscoder::StreamTranscoder(int fromCp, int toCp, SinkFunc sink,
+    size_t uBufSize)
+    : m_Sink(sink), m_iFromCp(fromCp), m_iToCp(toCp), m_pConv(NULL),
+    m_Out(std::max<size_t>(uBufSize, 64)), m_uOut(0), m_uPending(0),
+    m_bFailed(false)
+{
+    CPINFO cpInfo;
+    m_uMaxChar = GetCPInfo(fromCp, &cpInfo) ? cpInfo.MaxCharSize : 1;
+
+    // one UTF-16 unit never encodes to more than 4 bytes, so a full
+    // pivot buffer always fits into an empty output buffer
+    m_Wide.resize(m_Out.size() / 4);
+    m_Replace = toCp == 1200 ? std::string("?\0", 2)
+        : WcharToAnsi(L"?", toCp);
+}
+
+StreamTranscoder::~StreamTranscoder()
+{
+}
+
+static size_t CompletePrefix(int cp, unsigned uMaxChar,
+    const char* in, size_t len)
+{
+    if (cp == CP_UTF8)
+    {
+        size_t i = len, uBack = 0;
+        while (i && uBack < 4 && ((uint8_t)in[i - 1] & 0xC0) == 0x80)
+        {
+            i--;
+            uBack++;
+        }
+        if (!i)
+            return len;
+
+        uint8_t lead = (uint8_t)in[i - 1];
+        size_t uNeed = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3
+            : lead >= 0xC0 ? 2 : 1;
+        return uBack + 1 < uNeed ? i - 1 : len;
+    }
+    else if (uMaxChar == 2)
+    {
+        size_t i = 0;
+        while (i < len)
+            i += IsDBCSLeadByteEx(cp, (BYTE)in[i]) ? 2 : 1;
+        return i > len ? len - 1 : len;
+    }
+
+    return len;
+}
+
+size_t StreamTranscoder::Feed(const char* in, size_t len)
+{
+    size_t uComplete = CompletePrefix(m_iFromCp, m_uMaxChar, in, len);
+    size_t uLeft = len - uComplete;
+
+    while (uComplete && !m_bFailed)
+    {
+        size_t uPiece = std::min(uComplete, m_Wide.size());
+        if (uPiece < uComplete)
+            uPiece = CompletePrefix(m_iFromCp, m_uMaxChar, in, uPiece);
+
+        int iWide = MultiByteToWideChar(m_iFromCp, 0, in, (int)uPiece,
+            m_Wide.data(), (int)m_Wide.size());
+        size_t uBytes = m_iToCp == 1200 ? iWide * sizeof(wchar_t)
+            : WideCharToMultiByte(m_iToCp, 0, m_Wide.data(), iWide,
+                NULL, 0, NULL, NULL);
+        if (m_uOut + uBytes > m_Out.size() && !Flush())
+            break;
+
+        if (m_iToCp == 1200)
+            memcpy(m_Out.data() + m_uOut, m_Wide.data(), uBytes);
+        else
+        {
+            WideCharToMultiByte(m_iToCp, 0, m_Wide.data(), iWide,
+                m_Out.data() + m_uOut, (int)uBytes, NULL, NULL);
+        }
+        m_uOut += uBytes;
+
+        in += uPiece;
+        uComplete -= uPiece;
+    }
+
+    return uLeft;
+}
+
+void StreamTranscoder::FinishState()
+{
+}
+
 std::wstring JoinFilePath(const std::wstring& path,
     const std::wstring& name)
 {
     return path + L"\\" + name;
 }
 
-listdir ListDirectory(const std::wstring& path)
+void JoinFilePath(std::string_view path, std::string_view name,
+    std::string& out)
 {
-    auto pFind = std::make_unique<WIN32_FIND_DATAW>();
-    std::wstring findPath = path + L"\\*";
+    out.append(path);
+    out += '\\';
+    out.append(name);
+}
 
-    std::vector<std::wstring> files, dirs;
-    HANDLE hFind = FindFirstFileW(findPath.c_str(), pFind.get());
-    if (hFind)
+FILE* OpenFileUtf8(std::string_view path, const char* mode)
+{
+    std::wstring wpath, wmode;
+    TextToWchar(path, wpath);
+    TextToWchar(mode, wmode);
+    return _wfopen(wpath.c_str(), wmode.c_str());
+}
+
+bool MappedFile::OpenNative(const wchar_t* path, access hint)
+{
+    DWORD dwFlags = hint == AccessSequential ? FILE_FLAG_SEQUENTIAL_SCAN
+        : hint == AccessRandom ? FILE_FLAG_RANDOM_ACCESS
+        : FILE_ATTRIBUTE_NORMAL;
+    HANDLE hFile = CreateFileW(path, GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+        OPEN_EXISTING, dwFlags, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER fileSize = {0};
+    bool bDisk = GetFileType(hFile) == FILE_TYPE_DISK
+        && GetFileSizeEx(hFile, &fileSize);
+    if (bDisk && fileSize.QuadPart > 0
+        && (uint64_t)fileSize.QuadPart <= SIZE_MAX)
     {
-        do {
-            if (!wcscmp(pFind->cFileName, L"."))
-                continue;
-            if (!wcscmp(pFind->cFileName, L".."))
-                continue;
+        HANDLE hMapping = CreateFileMappingW(hFile, NULL, PAGE_READONLY,
+            0, 0, NULL);
+        if (hMapping)
+        {
+            // the view keeps the mapping alive
+            m_pView = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(hMapping);
+        }
+        if (m_pView)
+        {
+            CloseHandle(hFile);
+            m_pData = (const char*)m_pView;
+            m_uSize = (size_t)fileSize.QuadPart;
+            m_bOpen = true;
+            return true;
+        }
+    }
 
-            if (pFind->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-                dirs.emplace_back(pFind->cFileName);
-            else files.emplace_back(pFind->cFileName);
-        } while (FindNextFileW(hFind, pFind.get()));
-        FindClose(hFind);
+    size_t uLen = 0;
+    bool bOk = true;
+    m_Copy.resize(bDisk ? (size_t)fileSize.QuadPart + 1 : 65536);
+    for (;;)
+    {
+        if (uLen == m_Copy.size())
+            m_Copy.resize(m_Copy.size() * 2);
+
+        DWORD dwChunk = (DWORD)std::min<size_t>(m_Copy.size() - uLen,
+            1 << 30), dwRead = 0;
+        if (!ReadFile(hFile, m_Copy.data() + uLen, dwChunk, &dwRead, NULL))
+        {
+            bOk = GetLastError() == ERROR_BROKEN_PIPE;
+            break;
+        }
+        if (!dwRead)
+            break;
+        uLen += dwRead;
     }
+    CloseHandle(hFile);
 
-    return std::make_tuple(files, dirs);
+    m_Copy.resize(bOk ? uLen : 0);
+    m_pData = m_Copy.data();
+    m_uSize = m_Copy.size();
+    m_bOpen = bOk;
+    return bOk;
 }
 
-uint64_t GetDirectorySize(const std::wstring& path)
+std::wstring DirEntry::Name() const
+{
+    return std::wstring(m_pName);
+}
+
+void DirEntry::Name(std::wstring& out) const
+{
+    out.assign(m_pName);
+}
+
+std::string DirEntry::Utf8Name() const
+{
+    std::string out;
+    WcharToText(m_pName, out);
+    return out;
+}
+
+void DirEntry::Utf8Name(std::string& out) const
+{
+    WcharToText(m_pName, out);
+}
+
+bool EnumDirectory(const std::wstring& path, DirEntryFunc func)
+{
+    auto pFind = std::make_unique<WIN32_FIND_DATAW>();
+    std::wstring findPath = path + L"\\*";
+
+    HANDLE hFind = FindFirstFileExW(findPath.c_str(), FindExInfoBasic,
+        pFind.get(), FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+    if (hFind == INVALID_HANDLE_VALUE)
+        return false;
+
+    do {
+        if (!wcscmp(pFind->cFileName, L"."))
+            continue;
+        if (!wcscmp(pFind->cFileName, L".."))
+            continue;
+
+        DirEntry ent(pFind->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY
+            ? EntryDirectory : EntryFile, 0, pFind->cFileName);
+        if (!func(ent))
+            break;
+    } while (FindNextFileW(hFind, pFind.get()));
+    FindClose(hFind);
+
+    return true;
+}
+
+static uint64_t ScanDirectory(const std::wstring& path,
+    std::vector<std::wstring>& subdirs)
 {
     uint64_t uDirSize = 0;
     auto [files, dirs] = ListDirectory(path);
@@ -142,15 +339,44 @@ uint64_t GetDirectorySize(const std::wstring& path)
     }
 
     for (auto& dir : dirs)
-        uDirSize += GetDirectorySize(JoinFilePath(path, dir));
+        subdirs.push_back(JoinFilePath(path, dir));
 
     return uDirSize;
 }
+
+uint64_t GetDirectorySize(const std::wstring& path)
+{
+    std::vector<std::wstring> dirs;
+    uint64_t uDirSize = ScanDirectory(path, dirs);
+
+    for (auto& dir : dirs)
+        uDirSize += GetDirectorySize(dir);
+
+    return uDirSize;
+}
+
+bool EnumDirectory(std::string_view path, DirEntryFunc func)
+{
+    std::wstring wpath;
+    TextToWchar(path, wpath);
+    return EnumDirectory(wpath, func);
+}
+
+uint64_t GetDirectorySize(std::string_view path)
+{
+    std::wstring wpath;
+    TextToWchar(path, wpath);
+    return GetDirectorySize(wpath);
+}
 #else
 
 #include <iconv.h>
 #include <string>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
 bool IsWindowsSystem()
 {
     return false;
@@ -161,97 +387,752 @@ bool IsLinuxSystem()
     return true;
 }
 
+static int InternalUCSPage()
+{
+    return ArchByteOrder() == BigEndian ? CP_UCS4BE : CP_UCS4LE;
+}
+
+static std::string IconvCodeset(int cp)
+{
+    switch (cp)
+    {
+    case CP_UTF7: return "UTF-7";
+    case CP_UTF8: return "UTF-8";
+    case CP_UCS4LE: return "UCS-4LE";
+    case CP_UCS4BE: return "UCS-4BE";
+    }
+    return "CP" + std::to_string(cp);
+}
+
+// iconv_open is far more expensive than converting a file name,
+// so descriptors are opened once per thread and reset on reuse
+class _iconv_cache {
+public:
+    ~_iconv_cache()
+    {
+        for (auto& [key, cv] : m_Conv)
+            if (cv != (iconv_t)-1) iconv_close(cv);
+    }
+
+    iconv_t Get(int fromCp, int toCp)
+    {
+        auto key = std::make_pair(fromCp, toCp);
+        if (m_LastCv != (iconv_t)-1 && m_LastKey == key)
+        {
+            iconv(m_LastCv, NULL, NULL, NULL, NULL);
+            return m_LastCv;
+        }
+
+        iconv_t cv;
+        auto it = m_Conv.find(key);
+        if (it == m_Conv.end())
+        {
+            cv = iconv_open(IconvCodeset(toCp).c_str(),
+                IconvCodeset(fromCp).c_str());
+            m_Conv.emplace(key, cv);
+        }
+        else
+        {
+            cv = it->second;
+            if (cv != (iconv_t)-1)
+                iconv(cv, NULL, NULL, NULL, NULL);
+        }
+
+        m_LastKey = key;
+        m_LastCv = cv;
+        return cv;
+    }
+private:
+    std::map<std::pair<int,int>, iconv_t> m_Conv;
+    std::pair<int,int> m_LastKey = {0, 0};
+    iconv_t m_LastCv = (iconv_t)-1;
+};
+
+static thread_local _iconv_cache s_IconvCache;
+
+/* ASCII fast path
+ *
+ * Path names and control texts are almost always plain ASCII, which
+ * widens to UCS-4 and narrows back without a table. The kernels below
+ * convert the leading ASCII run and return its length; whatever is left
+ * from the first non-ASCII character on goes through iconv. */
+
+static size_t AsciiWidenScalar(const char* in, size_t len, wchar_t* out)
+{
+    size_t i;
+    for (i = 0; i < len && !(in[i] & 0x80); i++)
+        out[i] = (wchar_t)in[i];
+    return i;
+}
+
+static size_t AsciiNarrowScalar(const wchar_t* in, size_t len, char* out)
+{
+    size_t i;
+    for (i = 0; i < len && (uint32_t)in[i] < 0x80; i++)
+        out[i] = (char)in[i];
+    return i;
+}
+
+#ifdef __SSE2__
+static size_t AsciiWidenSSE2(const char* in, size_t len, wchar_t* out)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+        if (_mm_movemask_epi8(v))
+            break;
+
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        __m128i* dst = (__m128i*)(out + i);
+        _mm_storeu_si128(dst + 0, _mm_unpacklo_epi16(lo, zero));
+        _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(lo, zero));
+        _mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(hi, zero));
+        _mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(hi, zero));
+    }
+
+    return i + AsciiWidenScalar(in + i, len - i, out + i);
+}
+
+static size_t AsciiNarrowSSE2(const wchar_t* in, size_t len, char* out)
+{
+    const __m128i high = _mm_set1_epi32(~0x7F);
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16)
+    {
+        const __m128i* src = (const __m128i*)(in + i);
+        __m128i v0 = _mm_loadu_si128(src + 0);
+        __m128i v1 = _mm_loadu_si128(src + 1);
+        __m128i v2 = _mm_loadu_si128(src + 2);
+        __m128i v3 = _mm_loadu_si128(src + 3);
+
+        __m128i any = _mm_or_si128(_mm_or_si128(v0, v1),
+            _mm_or_si128(v2, v3));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(
+            _mm_and_si128(any, high), zero)) != 0xFFFF)
+            break;
+
+        __m128i w0 = _mm_packs_epi32(v0, v1);
+        __m128i w1 = _mm_packs_epi32(v2, v3);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(w0, w1));
+    }
+
+    return i + AsciiNarrowScalar(in + i, len - i, out + i);
+}
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AVX2_KERNELS
+
+__attribute__((target("avx2")))
+static size_t AsciiWidenAVX2(const char* in, size_t len, wchar_t* out)
+{
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+        if (_mm256_movemask_epi8(v))
+            break;
+
+        __m128i lo = _mm256_castsi256_si128(v);
+        __m128i hi = _mm256_extracti128_si256(v, 1);
+        __m256i* dst = (__m256i*)(out + i);
+        _mm256_storeu_si256(dst + 0, _mm256_cvtepu8_epi32(lo));
+        _mm256_storeu_si256(dst + 1,
+            _mm256_cvtepu8_epi32(_mm_srli_si128(lo, 8)));
+        _mm256_storeu_si256(dst + 2, _mm256_cvtepu8_epi32(hi));
+        _mm256_storeu_si256(dst + 3,
+            _mm256_cvtepu8_epi32(_mm_srli_si128(hi, 8)));
+    }
+
+    return i + AsciiWidenScalar(in + i, len - i, out + i);
+}
+
+__attribute__((target("avx2")))
+static size_t AsciiNarrowAVX2(const wchar_t* in, size_t len, char* out)
+{
+    const __m256i high = _mm256_set1_epi32(~0x7F);
+    // packs/packus work per 128-bit lane, this puts dwords back in order
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32)
+    {
+        const __m256i* src = (const __m256i*)(in + i);
+        __m256i v0 = _mm256_loadu_si256(src + 0);
+        __m256i v1 = _mm256_loadu_si256(src + 1);
+        __m256i v2 = _mm256_loadu_si256(src + 2);
+        __m256i v3 = _mm256_loadu_si256(src + 3);
+
+        __m256i any = _mm256_or_si256(_mm256_or_si256(v0, v1),
+            _mm256_or_si256(v2, v3));
+        if (!_mm256_testz_si256(any, high))
+            break;
+
+        __m256i w0 = _mm256_packs_epi32(v0, v1);
+        __m256i w1 = _mm256_packs_epi32(v2, v3);
+        __m256i b = _mm256_packus_epi16(w0, w1);
+        _mm256_storeu_si256((__m256i*)(out + i),
+            _mm256_permutevar8x32_epi32(b, order));
+    }
+
+    return i + AsciiNarrowScalar(in + i, len - i, out + i);
+}
+#endif
+
+typedef size_t (*asciiwiden_t)(const char*, size_t, wchar_t*);
+typedef size_t (*asciinarrow_t)(const wchar_t*, size_t, char*);
+
+static asciiwiden_t SelectAsciiWiden()
+{
+#ifdef HAVE_AVX2_KERNELS
+    if (__builtin_cpu_supports("avx2"))
+        return AsciiWidenAVX2;
+#endif
+#ifdef __SSE2__
+    return AsciiWidenSSE2;
+#else
+    return AsciiWidenScalar;
+#endif
+}
+
+static asciinarrow_t SelectAsciiNarrow()
+{
+#ifdef HAVE_AVX2_KERNELS
+    if (__builtin_cpu_supports("avx2"))
+        return AsciiNarrowAVX2;
+#endif
+#ifdef __SSE2__
+    return AsciiNarrowSSE2;
+#else
+    return AsciiNarrowScalar;
+#endif
+}
+
+static size_t AsciiWiden(const char* in, size_t len, wchar_t* out)
+{
+    static const asciiwiden_t pfnWiden = SelectAsciiWiden();
+    return pfnWiden(in, len, out);
+}
+
+static size_t AsciiNarrow(const wchar_t* in, size_t len, char* out)
+{
+    static const asciinarrow_t pfnNarrow = SelectAsciiNarrow();
+    return pfnNarrow(in, len, out);
+}
+
+// Converts as much as fits into out, then keeps converting into a
+// scratch buffer only to count the rest. Returns full output size.
+static size_t IconvConvert(iconv_t cv, const void* in, size_t inLen,
+    void* out, size_t outLen)
+{
+    char* pIn = (char*)in, *pOut = (char*)out;
+    char scratch[256];
+    size_t uTotal = 0;
+
+    if (!outLen)
+    {
+        pOut = scratch;
+        outLen = sizeof(scratch);
+    }
+
+    for (;;)
+    {
+        char* pStart = pOut;
+        size_t uRes = iconv(cv, &pIn, &inLen, &pOut, &outLen);
+        uTotal += pOut - pStart;
+
+        if (uRes != (size_t)-1 || errno != E2BIG)
+            break;
+        if (pStart == scratch && pOut == pStart)
+            break;
+
+        pOut = scratch;
+        outLen = sizeof(scratch);
+    }
+
+    return uTotal;
+}
+
+/* The ASCII prefix is copied as is only for UTF-8 and the single-byte
+ * pages, which all keep ASCII in their lower half; EBCDIC, UTF-7 and
+ * the rest go to iconv whole. */
+
+static size_t DecodeToWchar(int cp, std::string_view text,
+    std::span<wchar_t> out)
+{
+    const sbcs_page* page = cp == CP_UTF8 ? nullptr : FindSingleBytePage(cp);
+    size_t uLen = 0;
+    if (cp == CP_UTF8 || page)
+    {
+        uLen = AsciiWiden(text.data(),
+            std::min(text.size(), out.size()), out.data());
+        if (uLen == text.size())
+            return uLen;
+
+        text.remove_prefix(uLen);
+        out = out.subspan(uLen);
+    }
+
+    if (page)
+    {
+        SingleByteDecode(page, text.data(),
+            std::min(text.size(), out.size()), out.data());
+        return uLen + text.size();
+    }
+
+    iconv_t cv = s_IconvCache.Get(cp, InternalUCSPage());
+    if (cv == (iconv_t)-1)
+        return uLen;
+
+    return uLen + IconvConvert(cv, text.data(), text.size(),
+        out.data(), out.size_bytes()) / sizeof(wchar_t);
+}
+
+static size_t EncodeFromWchar(int cp, std::wstring_view text,
+    std::span<char> out)
+{
+    const sbcs_page* page = cp == CP_UTF8 ? nullptr : FindSingleBytePage(cp);
+    size_t uLen = 0;
+    if (cp == CP_UTF8 || page)
+    {
+        uLen = AsciiNarrow(text.data(),
+            std::min(text.size(), out.size()), out.data());
+        if (uLen == text.size())
+            return uLen;
+
+        text.remove_prefix(uLen);
+        out = out.subspan(uLen);
+    }
+
+    if (page)
+    {
+        SingleByteEncode(page, text.data(),
+            std::min(text.size(), out.size()), out.data());
+        return uLen + text.size();
+    }
+
+    iconv_t cv = s_IconvCache.Get(InternalUCSPage(), cp);
+    if (cv == (iconv_t)-1)
+        return uLen;
+
+    return uLen + IconvConvert(cv, text.data(), text.size() * sizeof(wchar_t),
+        out.data(), out.size());
+}
+
+size_t TextToWchar(std::string_view text, std::span<wchar_t> out)
+{
+    return DecodeToWchar(CP_UTF8, text, out);
+}
+
+size_t WcharToText(std::wstring_view text, std::span<char> out)
+{
+    return EncodeFromWchar(CP_UTF8, text, out);
+}
+
+size_t AnsiToWchar(std::string_view text, std::span<wchar_t> out, int cp)
+{
+    if (cp == 3) cp = 1251;
+    return DecodeToWchar(cp, text, out);
+}
+
+size_t WcharToAnsi(std::wstring_view text, std::span<char> out, int cp)
+{
+    if (cp == 3) cp = 1251;
+    return EncodeFromWchar(cp, text, out);
+}
+
+std::wstring TermToWchar(const std::string& text)
+{
+    return TextToWchar(text);
+}
+
+std::string WcharToTerm(const std::wstring& text)
+{
+    return WcharToText(text);
+}
+
+StreamTranscoder::StreamTranscoder(int fromCp, int toCp, SinkFunc sink,
+    size_t uBufSize)
+    : m_Sink(sink), m_iFromCp(fromCp), m_iToCp(toCp), m_uMaxChar(0),
+    m_Out(std::max<size_t>(uBufSize, 64)), m_uOut(0), m_uPending(0),
+    m_bFailed(false)
+{
+    if (m_iFromCp == 3) m_iFromCp = 1251;
+    if (m_iToCp == 3) m_iToCp = 1251;
+
+    std::string toCodeset = IconvCodeset(m_iToCp);
+    iconv_t cv = iconv_open(toCodeset.c_str(),
+        IconvCodeset(m_iFromCp).c_str());
+    m_pConv = cv;
+    if (cv == (iconv_t)-1)
+    {
+        m_bFailed = true;
+        return;
+    }
+
+    iconv_t rcv = iconv_open(toCodeset.c_str(), "UTF-8");
+    if (rcv != (iconv_t)-1)
+    {
+        char szRepl[16];
+        m_Replace.assign(szRepl, IconvConvert(rcv, "?", 1,
+            szRepl, sizeof(szRepl)));
+        iconv_close(rcv);
+    }
+}
+
+StreamTranscoder::~StreamTranscoder()
+{
+    if ((iconv_t)m_pConv != (iconv_t)-1)
+        iconv_close((iconv_t)m_pConv);
+}
+
+// iconv also stops with EILSEQ on a valid character that has no
+// mapping in the target codepage, which then has to be skipped whole
+static size_t InputCharLength(int cp, const char* in, size_t len)
+{
+    if (cp == CP_UCS4LE || cp == CP_UCS4BE)
+        return 4;
+    else if (cp != CP_UTF8)
+        return 1;
+
+    uint8_t lead = (uint8_t)in[0];
+    size_t uNeed = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3
+        : lead >= 0xC0 ? 2 : 1;
+    for (size_t i = 1; i < uNeed; i++)
+        if (i >= len || ((uint8_t)in[i] & 0xC0) != 0x80)
+            return 1;
+    return uNeed;
+}
+
+size_t StreamTranscoder::Feed(const char* in, size_t len)
+{
+    char* pIn = (char*)in;
+
+    while (len && !m_bFailed)
+    {
+        char* pOut = m_Out.data() + m_uOut;
+        size_t outLen = m_Out.size() - m_uOut;
+        size_t uRes = iconv((iconv_t)m_pConv, &pIn, &len, &pOut, &outLen);
+        m_uOut = pOut - m_Out.data();
+
+        if (uRes != (size_t)-1)
+            break;
+        else if (errno == E2BIG)
+            Flush();
+        else if (errno == EILSEQ)
+        {
+            size_t uSkip = std::min(len, InputCharLength(m_iFromCp,
+                pIn, len));
+            pIn += uSkip;
+            len -= uSkip;
+            Replace();
+        }
+        else if (errno == EINVAL)
+            return len;
+        else m_bFailed = true;
+    }
+
+    return 0;
+}
+
+void StreamTranscoder::FinishState()
+{
+    // stateful encodings may need a shift sequence to return
+    // to the initial state
+    char* pOut = m_Out.data() + m_uOut;
+    size_t outLen = m_Out.size() - m_uOut;
+    if (iconv((iconv_t)m_pConv, NULL, NULL, &pOut, &outLen) == (size_t)-1
+        && errno == E2BIG && Flush())
+    {
+        pOut = m_Out.data();
+        outLen = m_Out.size();
+        iconv((iconv_t)m_pConv, NULL, NULL, &pOut, &outLen);
+    }
+    m_uOut = pOut - m_Out.data();
+}
+
+#endif
+
+/* Conversions into reusable strings */
+
+/* The output gets room for the longest result the input can have in
+ * one pass (a wide character is at most 4 bytes of UTF-8 or ANSI, a
+ * byte at most one wide character), bounded by what the string already
+ * holds, so a reused string neither converts twice nor zero-fills more
+ * than the input calls for. */
+
+template<typename T, typename F>
+static size_t ConvertInto(std::basic_string<T>& out, size_t uGuess,
+    F convert)
+{
+    size_t uRoom = std::max(uGuess,
+        std::min(out.capacity(), uGuess * (sizeof(T) == 1 ? 4 : 1)));
+    size_t uLen = 0;
+
+#ifdef __cpp_lib_string_resize_and_overwrite
+    out.resize_and_overwrite(uRoom, [&](T* pOut, size_t uSize) {
+        uLen = convert(std::span<T>(pOut, uSize));
+        return uLen <= uSize ? uLen : 0;
+    });
+    if (uLen > uRoom)
+    {
+        out.resize_and_overwrite(uLen, [&](T* pOut, size_t uSize) {
+            return uLen = convert(std::span<T>(pOut, uSize));
+        });
+    }
+#else
+    out.resize(uRoom);
+    uLen = convert(std::span<T>(out.data(), out.size()));
+    if (uLen > out.size())
+    {
+        out.resize(uLen);
+        uLen = convert(std::span<T>(out.data(), out.size()));
+    }
+    out.resize(uLen);
+#endif
+    return uLen;
+}
+
+size_t TextToWchar(std::string_view text, std::wstring& out)
+{
+    return ConvertInto<wchar_t>(out, text.size(),
+        [&](std::span<wchar_t> buf) { return TextToWchar(text, buf); });
+}
+
+size_t WcharToText(std::wstring_view text, std::string& out)
+{
+    return ConvertInto<char>(out, text.size(),
+        [&](std::span<char> buf) { return WcharToText(text, buf); });
+}
+
+size_t AnsiToWchar(std::string_view text, std::wstring& out, int cp)
+{
+    return ConvertInto<wchar_t>(out, text.size(),
+        [&](std::span<wchar_t> buf) { return AnsiToWchar(text, buf, cp); });
+}
+
+size_t WcharToAnsi(std::wstring_view text, std::string& out, int cp)
+{
+    return ConvertInto<char>(out, text.size(),
+        [&](std::span<char> buf) { return WcharToAnsi(text, buf, cp); });
+}
+
+size_t TextToWcharSize(std::string_view text)
+{
+    return TextToWchar(text, std::span<wchar_t>());
+}
+
+size_t WcharToTextSize(std::wstring_view text)
+{
+    return WcharToText(text, std::span<char>());
+}
+
+size_t AnsiToWcharSize(std::string_view text, int cp)
+{
+    return AnsiToWchar(text, std::span<wchar_t>(), cp);
+}
+
+size_t WcharToAnsiSize(std::wstring_view text, int cp)
+{
+    return WcharToAnsi(text, std::span<char>(), cp);
+}
+
 std::wstring TextToWchar(const std::string& text)
 {
-    size_t bufLen = text.size() + 1;
-    size_t bufSize = bufLen * sizeof(wchar_t);
-    auto szOut = std::make_unique<wchar_t[]>(bufLen);
-    
-    char* in = (char*)text.c_str(), *out = (char*)szOut.get();
-    size_t inLen = bufLen, outLen = bufSize;
-    memset(out, '\0', outLen);
-    
-    iconv_t _cv = iconv_open(ArchInternalUCS(), "UTF-8");
-    iconv(_cv, &in, &inLen, &out, &outLen);
-    iconv_close(_cv);
-    
-    size_t strLen = (bufSize - outLen) / sizeof(wchar_t);
-    szOut[strLen - 1] = 0;
-    return std::wstring(szOut.get(), strLen - 1);
+    std::wstring ret;
+    TextToWchar(text, ret);
+    return ret;
 }
 
 std::string WcharToText(const std::wstring& text)
 {
-    size_t bufSize = (text.size()+1)*sizeof(wchar_t);
-    auto szOut = std::make_unique<char[]>(bufSize);
-    
-    char* in = (char*)text.c_str(), *out = szOut.get();
-    size_t inLen = (text.size()+1)*sizeof(wchar_t), outLen = bufSize;
-    memset(szOut.get(), '\0', bufSize);
-    
-    iconv_t cv = iconv_open("UTF-8", ArchInternalUCS());
-    iconv(cv, &in, &inLen, &out, &outLen);
-    iconv_close(cv);
-    
-    size_t strLen = bufSize - outLen;
-    szOut[strLen - 1] = 0;
-    return std::string(szOut.get(), strLen - 1);
+    std::string ret;
+    WcharToText(text, ret);
+    return ret;
 }
 
 std::wstring AnsiToWchar(const std::string& text, int cp)
 {
-    if (cp == 3) cp = 1251;
-    
-    size_t bufLen = text.size() + 1;
-    size_t bufSize = bufLen * sizeof(wchar_t);
-    auto szOut = std::make_unique<wchar_t[]>(bufLen);
-    
-    char* in = (char*)text.c_str(), *out = (char*)szOut.get();
-    size_t inLen = bufLen, outLen = bufSize;
-    memset(out, '\0', outLen);
-    
-    iconv_t _cv = iconv_open(ArchInternalUCS(),
-        ("CP" + std::to_string(cp)).c_str());
-    iconv(_cv, &in, &inLen, &out, &outLen);
-    iconv_close(_cv);
-    
-    size_t strLen = (bufSize - outLen) / sizeof(wchar_t);
-    szOut[strLen - 1] = 0;
-    return std::wstring(szOut.get(), strLen - 1);
+    std::wstring ret;
+    AnsiToWchar(text, ret, cp);
+    return ret;
+}
+
+std::string WcharToAnsi(const std::wstring& text, int cp)
+{
+    std::string ret;
+    WcharToAnsi(text, ret, cp);
+    return ret;
+}
+
+/* WStringTable */
+
+WStringTable::WStringTable()
+    : m_Offsets(1, 0)
+{
+}
+
+void WStringTable::Reserve(size_t uStrings, size_t uChars)
+{
+    m_Offsets.reserve(m_Offsets.size() + uStrings);
+    m_Chars.reserve(m_Chars.size() + uChars);
+}
+
+void WStringTable::Append(std::wstring_view str)
+{
+    m_Chars.insert(m_Chars.end(), str.begin(), str.end());
+    m_Chars.push_back(L'\0');
+    m_Offsets.push_back(m_Chars.size());
+}
+
+void WStringTable::Clear()
+{
+    m_Chars.clear();
+    m_Offsets.assign(1, 0);
+}
+
+WStringTable TextToWcharBatch(const std::vector<std::string>& texts)
+{
+    return AnsiToWcharBatch(texts, CP_UTF8);
+}
+
+WStringTable AnsiToWcharBatch(const std::vector<std::string>& texts,
+    int cp)
+{
+    WStringTable table;
+
+    // no supported encoding yields more characters than input bytes,
+    // so the whole batch is converted in place without reallocating
+    size_t uTotal = 0;
+    for (auto& text : texts)
+        uTotal += text.size() + 1;
+
+    table.m_Offsets.reserve(texts.size() + 1);
+    table.m_Chars.resize(uTotal);
+
+    size_t uPos = 0;
+    for (auto& text : texts)
+    {
+        std::span<wchar_t> out(table.m_Chars.data() + uPos,
+            table.m_Chars.size() - uPos);
+        size_t uLen = AnsiToWchar(text, out, cp);
+        if (uLen >= out.size())
+        {
+            table.m_Chars.resize(table.m_Chars.size() + uLen + 1);
+            out = std::span<wchar_t>(table.m_Chars.data() + uPos, uLen);
+            AnsiToWchar(text, out, cp);
+        }
+
+        uPos += uLen;
+        table.m_Chars[uPos++] = L'\0';
+        table.m_Offsets.push_back(uPos);
+    }
+
+    table.m_Chars.resize(uPos);
+    return table;
+}
+
+/* StreamTranscoder */
+
+bool StreamTranscoder::Write(const void* data, size_t len)
+{
+    const char* in = (const char*)data;
+    if (m_bFailed)
+        return false;
+
+    // finish a sequence split by the previous chunk byte by byte
+    while (m_uPending && len && !m_bFailed)
+    {
+        m_Pending[m_uPending++] = *in++;
+        len--;
+        FeedPending();
+    }
+    if (!len || m_bFailed)
+        return !m_bFailed;
+
+    size_t uLeft = Feed(in, len);
+    for (; uLeft > sizeof(m_Pending); uLeft--)
+        Replace();
+    memcpy(m_Pending, in + len - uLeft, uLeft);
+    m_uPending = uLeft;
+
+    return !m_bFailed;
+}
+
+void StreamTranscoder::FeedPending()
+{
+    size_t uLeft = Feed(m_Pending, m_uPending);
+    memmove(m_Pending, m_Pending + m_uPending - uLeft, uLeft);
+    m_uPending = uLeft;
+
+    if (m_uPending == sizeof(m_Pending))
+    {
+        Replace();
+        memmove(m_Pending, m_Pending + 1, --m_uPending);
+    }
 }
 
-std::string WcharToAnsi(const std::wstring& text, int cp)
+void StreamTranscoder::Replace()
 {
-    if (cp == 3) cp = 1251;
+    if (m_uOut + m_Replace.size() > m_Out.size() && !Flush())
+        return;
 
-    size_t bufSize = (text.size()+1)*sizeof(wchar_t);
-    auto szOut = std::make_unique<char[]>(bufSize);
-    
-    char* in = (char*)text.c_str(), *out = szOut.get();
-    size_t inLen = (text.size()+1)*sizeof(wchar_t), outLen = bufSize;
-    memset(szOut.get(), '\0', bufSize);
-    
-    iconv_t _cv = iconv_open(("CP"
-        + std::to_string(cp)).c_str(), ArchInternalUCS());
-    iconv(_cv, &in, &inLen, &out, &outLen);
-    iconv_close(_cv);
-    
-    size_t strLen = bufSize - outLen;
-    szOut[strLen - 1] = 0;
-    return std::string(szOut.get(), strLen - 1);
+    memcpy(m_Out.data() + m_uOut, m_Replace.data(), m_Replace.size());
+    m_uOut += m_Replace.size();
 }
 
-std::wstring TermToWchar(const std::string& text)
+bool StreamTranscoder::Flush()
 {
-    return TextToWchar(text);
+    if (m_bFailed)
+        return false;
+
+    if (m_uOut && !m_Sink(m_Out.data(), m_uOut))
+        m_bFailed = true;
+
+    m_uOut = 0;
+    return !m_bFailed;
 }
 
-std::string WcharToTerm(const std::wstring& text)
+bool StreamTranscoder::Finish()
 {
-    return WcharToText(text);
+    if (m_bFailed)
+        return false;
+
+    if (m_uPending)
+    {
+        Replace();
+        m_uPending = 0;
+    }
+
+    FinishState();
+    return Flush();
 }
 
-#endif
+bool TranscodeFile(FILE* in, FILE* out, int fromCp, int toCp)
+{
+    StreamTranscoder stream(fromCp, toCp,
+        [out](const char* data, size_t len) {
+            return fwrite(data, 1, len, out) == len;
+        }
+    );
+
+    std::vector<char> buf(65536);
+    size_t uRead;
+    while ((uRead = fread(buf.data(), 1, buf.size(), in)) > 0)
+    {
+        if (!stream.Write(buf.data(), uRead))
+            return false;
+    }
+
+    return !ferror(in) && stream.Finish();
+}
 
 #ifdef WIN32
 struct _findwnd_s {
@@ -361,59 +1242,626 @@ std::wstring JoinFilePath(const std::wstring& path,
     return path + L"/" + name;
 }
 
+void JoinFilePath(std::string_view path, std::string_view name,
+    std::string& out)
+{
+    out.append(path);
+    out += '/';
+    out.append(name);
+}
+
+// '\0'-terminated copy of a path for the system calls, on the stack
+// unless the path is unusually long
+class _cpath
+{
+public:
+    _cpath(std::string_view path)
+    {
+        if (path.size() < sizeof(m_szBuf))
+        {
+            memcpy(m_szBuf, path.data(), path.size());
+            m_szBuf[path.size()] = '\0';
+            m_pPath = m_szBuf;
+        }
+        else
+        {
+            m_Long.assign(path);
+            m_pPath = m_Long.c_str();
+        }
+    }
+
+    inline operator const char*() const { return m_pPath; }
+private:
+    char m_szBuf[256];
+    std::string m_Long;
+    const char* m_pPath;
+};
+
+FILE* OpenFileUtf8(std::string_view path, const char* mode)
+{
+    return fopen(_cpath(path), mode);
+}
+
 #include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
-listdir ListDirectory(const std::wstring& path)
+bool MappedFile::OpenNative(const char* path, access hint)
 {
-    std::vector<std::wstring> files, dirs;
-    std::string utfPath = WcharToText(path);
-    
-    DIR* dir;
-    struct dirent* ent;
-    if (dir = opendir(utfPath.c_str()))
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st))
+    {
+        close(fd);
+        return false;
+    }
+
+    // /proc and /sys files report a size of 0 and are read instead
+    bool bRegular = S_ISREG(st.st_mode);
+    if (bRegular && st.st_size > 0 && (uint64_t)st.st_size <= SIZE_MAX)
+    {
+        void* pView = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (pView != MAP_FAILED)
+        {
+            madvise(pView, st.st_size, hint == AccessSequential
+                ? MADV_SEQUENTIAL : hint == AccessRandom
+                ? MADV_RANDOM : MADV_NORMAL);
+            close(fd);
+            m_pView = pView;
+            m_pData = (const char*)pView;
+            m_uSize = st.st_size;
+            m_bOpen = true;
+            return true;
+        }
+    }
+
+    size_t uLen = 0;
+    bool bOk = true;
+    m_Copy.resize(bRegular && st.st_size > 0 ? st.st_size + 1 : 65536);
+    for (;;)
+    {
+        if (uLen == m_Copy.size())
+            m_Copy.resize(m_Copy.size() * 2);
+
+        ssize_t lRead = read(fd, m_Copy.data() + uLen, m_Copy.size() - uLen);
+        if (lRead < 0 && errno == EINTR)
+            continue;
+        if (lRead <= 0)
+        {
+            bOk = !lRead;
+            break;
+        }
+        uLen += lRead;
+    }
+    close(fd);
+
+    m_Copy.resize(bOk ? uLen : 0);
+    m_pData = m_Copy.data();
+    m_uSize = m_Copy.size();
+    m_bOpen = bOk;
+    return bOk;
+}
+
+/* Directory size walker
+ *
+ * Directories are read with getdents64 and every entry is looked up
+ * with statx/fstatat relative to the directory descriptor, so no file
+ * is opened and no full path is built. Subdirectory names are collected
+ * before descending, which lets all levels of a walk on one thread share
+ * a single getdents buffer. */
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+#ifdef STATX_SIZE
+static std::atomic<bool> s_bStatx(true);
+#endif
+
+// Looks up an entry without following symlinks. Only the size is
+// requested when the type is already known from getdents.
+static bool StatAt(int fd, const char* name, unsigned char& type,
+    uint64_t& uSize)
+{
+#ifdef STATX_SIZE
+    if (s_bStatx.load(std::memory_order_relaxed))
+    {
+        struct statx stx;
+        unsigned mask = type == DT_UNKNOWN
+            ? STATX_TYPE | STATX_SIZE : STATX_SIZE;
+        if (!statx(fd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+            mask, &stx))
+        {
+            if (type == DT_UNKNOWN)
+                type = IFTODT(stx.stx_mode);
+            uSize = stx.stx_size;
+            return true;
+        }
+        else if (errno != ENOSYS)
+            return false;
+
+        s_bStatx = false;
+    }
+#endif
+
+    struct stat st;
+    if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW))
+        return false;
+
+    if (type == DT_UNKNOWN)
+        type = IFTODT(st.st_mode);
+    uSize = (uint64_t)st.st_size;
+    return true;
+}
+
+uint64_t ScanDirectoryAt(int fd, std::string& subdirs)
+{
+    static thread_local std::vector<char> buf(65536);
+    uint64_t uDirSize = 0;
+
+    long lRead;
+    while ((lRead = syscall(SYS_getdents64, fd, buf.data(), buf.size())) > 0)
     {
-        while (ent = readdir(dir))
+        for (long lPos = 0; lPos < lRead; )
         {
-            if (!strcmp(ent->d_name, "."))
+            auto* ent = (linux_dirent64*)(buf.data() + lPos);
+            lPos += ent->d_reclen;
+
+            const char* name = ent->d_name;
+            if (name[0] == '.' && (!name[1]
+                || (name[1] == '.' && !name[2])))
                 continue;
-            if (!strcmp(ent->d_name, ".."))
+
+            unsigned char type = ent->d_type;
+            uint64_t uSize = 0;
+            if (type == DT_REG || type == DT_UNKNOWN)
+            {
+                if (!StatAt(fd, name, type, uSize))
+                    continue;
+            }
+
+            if (type == DT_REG)
+                uDirSize += uSize;
+            else if (type == DT_DIR)
+                subdirs.append(name, strlen(name) + 1);
+        }
+    }
+
+    return uDirSize;
+}
+
+std::wstring DirEntry::Name() const
+{
+    return TextToWchar(m_pName);
+}
+
+void DirEntry::Name(std::wstring& out) const
+{
+    TextToWchar(m_pName, out);
+}
+
+std::string DirEntry::Utf8Name() const
+{
+    return std::string(m_pName);
+}
+
+void DirEntry::Utf8Name(std::string& out) const
+{
+    out.assign(m_pName);
+}
+
+static direntry EntryType(unsigned char type)
+{
+    switch (type)
+    {
+    case DT_REG: return EntryFile;
+    case DT_DIR: return EntryDirectory;
+    case DT_LNK: return EntrySymlink;
+    case DT_UNKNOWN: return EntryUnknown;
+    }
+    return EntryOther;
+}
+
+bool EnumDirectory(const std::wstring& path, DirEntryFunc func)
+{
+    return EnumDirectory(WcharToText(path), func);
+}
+
+bool EnumDirectory(std::string_view path, DirEntryFunc func)
+{
+    int fd = open(_cpath(path), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    // not the shared walker buffer, func may enumerate another directory
+    alignas(linux_dirent64) char buf[16384];
+    bool bStop = false;
+
+    long lRead;
+    while (!bStop
+        && (lRead = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0)
+    {
+        for (long lPos = 0; lPos < lRead && !bStop; )
+        {
+            auto* ent = (linux_dirent64*)(buf + lPos);
+            lPos += ent->d_reclen;
+
+            const char* name = ent->d_name;
+            if (name[0] == '.' && (!name[1]
+                || (name[1] == '.' && !name[2])))
                 continue;
-            
-            std::wstring ucsName = TextToWchar(ent->d_name);
-            if (ent->d_type == DT_DIR)
-                dirs.push_back(ucsName);
-            else if (ent->d_type == DT_REG)
-                files.push_back(ucsName);
+
+            unsigned char type = ent->d_type;
+            if (type == DT_UNKNOWN)
+            {
+                struct stat st;
+                if (!fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW))
+                    type = IFTODT(st.st_mode);
+            }
+
+            bStop = !func(DirEntry(EntryType(type), ent->d_ino, name));
         }
-        closedir(dir);
     }
 
-    return std::make_tuple(files, dirs);
+    close(fd);
+    return true;
 }
 
-uint64_t GetDirectorySize(const std::wstring& path)
+bool ScanDirectoryAt(int fd, DirScanFunc func)
 {
-    uint64_t uDirSize = 0;
-    auto [files, dirs] = ListDirectory(path);
+    // func may scan another directory, so no shared buffer
+    alignas(linux_dirent64) char buf[16384];
+    bool bStop = false;
 
-    for (auto& file : files)
+    long lRead;
+    while (!bStop
+        && (lRead = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0)
+    {
+        for (long lPos = 0; lPos < lRead && !bStop; )
+        {
+            auto* ent = (linux_dirent64*)(buf + lPos);
+            lPos += ent->d_reclen;
+
+            const char* name = ent->d_name;
+            if (name[0] == '.' && (!name[1]
+                || (name[1] == '.' && !name[2])))
+                continue;
+
+            unsigned char type = ent->d_type;
+            uint64_t uSize = 0;
+            if (type == DT_REG || type == DT_UNKNOWN)
+            {
+                if (!StatAt(fd, name, type, uSize))
+                    continue;
+                if (type != DT_REG)
+                    uSize = 0;
+            }
+
+            bStop = !func(name, EntryType(type), uSize);
+        }
+    }
+
+    return lRead >= 0;
+}
+
+// keeps a descriptor open per level, so a deep tree can run into
+// EMFILE; whatever cannot be opened is counted in uSkipped
+static uint64_t DirectorySizeAt(int fd, size_t& uSkipped)
+{
+    std::string subdirs;
+    uint64_t uDirSize = ScanDirectoryAt(fd, subdirs);
+
+    for (size_t uPos = 0; uPos < subdirs.size(); )
     {
-        int64_t fileSize = {0};
-        std::string utfPath = WcharToText(JoinFilePath(path, file));
-        FILE* pFile = fopen(utfPath.c_str(), "rb");
-        if (!pFile) continue;
+        const char* name = subdirs.c_str() + uPos;
+        uPos += strlen(name) + 1;
+
+        int subfd = openat(fd, name,
+            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (subfd < 0)
+        {
+            uSkipped++;
+            continue;
+        }
+        uDirSize += DirectorySizeAt(subfd, uSkipped);
+        close(subfd);
+    }
+
+    return uDirSize;
+}
+
+static uint64_t ScanDirectory(const pathstring& path,
+    std::vector<pathstring>& subdirs)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
 
-        fseek(pFile, 0L, SEEK_END);
-        fileSize = (int64_t)ftell(pFile);
-        fclose(pFile);
+    std::string names;
+    uint64_t uDirSize = ScanDirectoryAt(fd, names);
+    close(fd);
 
-        if (fileSize > 0) uDirSize += fileSize;
+    for (size_t uPos = 0; uPos < names.size(); )
+    {
+        std::string_view name(names.c_str() + uPos);
+        uPos += name.size() + 1;
+
+        subdirs.emplace_back();
+        subdirs.back().reserve(path.size() + name.size() + 1);
+        JoinFilePath(path, name, subdirs.back());
     }
 
-    for (auto& dir : dirs)
-        uDirSize += GetDirectorySize(JoinFilePath(path, dir));
+    return uDirSize;
+}
+
+uint64_t GetDirectorySize(const std::wstring& path)
+{
+    return GetDirectorySize(WcharToText(path));
+}
+
+uint64_t GetDirectorySize(std::string_view path)
+{
+    size_t uSkipped;
+    return GetDirectorySizeSkipped(path, uSkipped);
+}
 
+uint64_t GetDirectorySizeSkipped(const std::wstring& path, size_t& uSkipped)
+{
+    return GetDirectorySizeSkipped(WcharToText(path), uSkipped);
+}
+
+uint64_t GetDirectorySizeSkipped(std::string_view path, size_t& uSkipped)
+{
+    uSkipped = 0;
+    int fd = open(_cpath(path), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        uSkipped = 1;
+        return 0;
+    }
+
+    uint64_t uDirSize = DirectorySizeAt(fd, uSkipped);
+    close(fd);
     return uDirSize;
 }
 
 #endif
+
+listdir ListDirectory(const std::wstring& path)
+{
+    std::vector<std::wstring> files, dirs;
+
+    EnumDirectory(path,
+        [&files, &dirs](const DirEntry& ent) {
+            if (ent.Type() == EntryDirectory)
+                dirs.push_back(ent.Name());
+            else if (ent.Type() == EntryFile)
+                files.push_back(ent.Name());
+            return true;
+        }
+    );
+
+    return std::make_tuple(files, dirs);
+}
+
+MappedFile::MappedFile()
+    : m_pView(nullptr), m_pData(nullptr), m_uSize(0), m_bOpen(false)
+{
+}
+
+MappedFile::MappedFile(const std::wstring& path, access hint)
+    : MappedFile()
+{
+    Open(path, hint);
+}
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+bool MappedFile::Open(const std::wstring& path, access hint)
+{
+    Close();
+#ifdef WIN32
+    return OpenNative(path.c_str(), hint);
+#else
+    return OpenNative(WcharToText(path).c_str(), hint);
+#endif
+}
+
+bool MappedFile::Open(std::string_view path, access hint)
+{
+    Close();
+#ifdef WIN32
+    std::wstring wpath;
+    TextToWchar(path, wpath);
+    return OpenNative(wpath.c_str(), hint);
+#else
+    return OpenNative(_cpath(path), hint);
+#endif
+}
+
+void MappedFile::Close()
+{
+    if (m_pView)
+    {
+#ifdef WIN32
+        UnmapViewOfFile(m_pView);
+#else
+        munmap(m_pView, m_uSize);
+#endif
+    }
+
+    m_pView = nullptr;
+    m_pData = nullptr;
+    m_uSize = 0;
+    m_Copy = std::vector<char>();
+    m_bOpen = false;
+}
+
+std::string JoinFilePath(std::string_view path, std::string_view name)
+{
+    std::string out;
+    out.reserve(path.size() + name.size() + 1);
+    JoinFilePath(path, name, out);
+    return out;
+}
+
+listdir_utf8 ListDirectory(std::string_view path)
+{
+    std::vector<std::string> files, dirs;
+
+    EnumDirectory(path,
+        [&files, &dirs](const DirEntry& ent) {
+            if (ent.Type() == EntryDirectory)
+                dirs.push_back(ent.Utf8Name());
+            else if (ent.Type() == EntryFile)
+                files.push_back(ent.Utf8Name());
+            return true;
+        }
+    );
+
+    return std::make_tuple(files, dirs);
+}
+
+/* Parallel directory size
+ *
+ * Every worker owns a deque of directories still to scan. It pops from
+ * the back of its own deque, which keeps the walk depth-first and the
+ * subdirectories it just found warm, and steals from the front of other
+ * deques when it runs dry. Sizes are summed per worker and only added
+ * up after all workers are joined. */
+
+struct alignas(64) _dirsize_worker {
+    std::mutex m_Lock;
+    std::deque<pathstring> m_Queue;
+    uint64_t m_uSize = 0;
+};
+
+class _dirsize_pool {
+public:
+    _dirsize_pool(unsigned uThreads)
+        : m_Workers(uThreads), m_uPending(0)
+    {
+    }
+
+    uint64_t Run(const pathstring& path)
+    {
+        m_uPending = 1;
+        m_Workers[0].m_Queue.push_back(path);
+
+        std::vector<std::thread> threads;
+        for (unsigned i = 1; i < m_Workers.size(); i++)
+            threads.emplace_back(&_dirsize_pool::Work, this, i);
+        Work(0);
+        for (auto& thread : threads)
+            thread.join();
+
+        uint64_t uSize = 0;
+        for (auto& worker : m_Workers)
+            uSize += worker.m_uSize;
+        return uSize;
+    }
+private:
+    bool Pop(unsigned uSelf, pathstring& path)
+    {
+        {
+            auto& self = m_Workers[uSelf];
+            std::lock_guard<std::mutex> lock(self.m_Lock);
+            if (!self.m_Queue.empty())
+            {
+                path = std::move(self.m_Queue.back());
+                self.m_Queue.pop_back();
+                return true;
+            }
+        }
+
+        for (size_t i = 1; i < m_Workers.size(); i++)
+        {
+            auto& victim = m_Workers[(uSelf + i) % m_Workers.size()];
+            std::lock_guard<std::mutex> lock(victim.m_Lock);
+            if (!victim.m_Queue.empty())
+            {
+                path = std::move(victim.m_Queue.front());
+                victim.m_Queue.pop_front();
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void Work(unsigned uSelf)
+    {
+        auto& self = m_Workers[uSelf];
+        std::vector<pathstring> dirs;
+        pathstring path;
+
+        // a directory counts as pending until its subdirectories are
+        // queued, so zero pending means the whole tree is done
+        while (m_uPending.load(std::memory_order_acquire))
+        {
+            if (!Pop(uSelf, path))
+            {
+                std::this_thread::yield();
+                continue;
+            }
+
+            dirs.clear();
+            self.m_uSize += ScanDirectory(path, dirs);
+            if (!dirs.empty())
+            {
+                m_uPending.fetch_add(dirs.size(), std::memory_order_relaxed);
+                std::lock_guard<std::mutex> lock(self.m_Lock);
+                for (auto& dir : dirs)
+                    self.m_Queue.push_back(std::move(dir));
+            }
+            m_uPending.fetch_sub(1, std::memory_order_release);
+        }
+    }
+
+    std::vector<_dirsize_worker> m_Workers;
+    std::atomic<size_t> m_uPending;
+};
+
+static uint64_t ParallelDirectorySize(const pathstring& path,
+    unsigned uThreads)
+{
+    if (!uThreads)
+        uThreads = std::max(1u, std::thread::hardware_concurrency());
+    if (uThreads == 1)
+        return GetDirectorySize(path);
+
+    _dirsize_pool pool(uThreads);
+    return pool.Run(path);
+}
+
+uint64_t GetDirectorySize(const std::wstring& path, unsigned uThreads)
+{
+#ifdef WIN32
+    return ParallelDirectorySize(path, uThreads);
+#else
+    return ParallelDirectorySize(WcharToText(path), uThreads);
+#endif
+}
+
+uint64_t GetDirectorySize(std::string_view path, unsigned uThreads)
+{
+#ifdef WIN32
+    std::wstring wpath;
+    TextToWchar(path, wpath);
+    return ParallelDirectorySize(wpath, uThreads);
+#else
+    return ParallelDirectorySize(pathstring(path), uThreads);
+#endif
+}
@@ -11,8 +11,13 @@
 #undef min
 #endif
 
+#include <stdio.h>
+
 #include <algorithm>
+#include <functional>
+#include <span>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <tuple>
 
@@ -31,6 +36,107 @@ std::string WcharToText(const std::wstring& text);
 std::wstring AnsiToWchar(const std::string& text, int cp = 3);
 std::string WcharToAnsi(const std::wstring& text, int cp = 3);
 
+// Conversions into caller-provided buffers. All of them return the
+// length of the complete result in characters; if it is larger than
+// out.size() the content of out is unspecified and the call should be
+// repeated with a buffer of at least that size.
+size_t TextToWchar(std::string_view text, std::span<wchar_t> out);
+size_t WcharToText(std::wstring_view text, std::span<char> out);
+size_t AnsiToWchar(std::string_view text, std::span<wchar_t> out,
+    int cp = 3);
+size_t WcharToAnsi(std::wstring_view text, std::span<char> out,
+    int cp = 3);
+
+// Same, but reuse the capacity of out and only grow it when needed
+size_t TextToWchar(std::string_view text, std::wstring& out);
+size_t WcharToText(std::wstring_view text, std::string& out);
+size_t AnsiToWchar(std::string_view text, std::wstring& out, int cp = 3);
+size_t WcharToAnsi(std::wstring_view text, std::string& out, int cp = 3);
+
+size_t TextToWcharSize(std::string_view text);
+size_t WcharToTextSize(std::wstring_view text);
+size_t AnsiToWcharSize(std::string_view text, int cp = 3);
+size_t WcharToAnsiSize(std::wstring_view text, int cp = 3);
+
+// Many strings stored back to back in one buffer, each followed by
+// L'\0', so a large batch costs two allocations instead of one per string
+class WStringTable
+{
+public:
+    WStringTable();
+
+    inline size_t Size() const { return m_Offsets.size() - 1; }
+    inline size_t Chars() const { return m_Chars.size(); }
+
+    inline std::wstring_view operator[](size_t i) const
+    {
+        return std::wstring_view(CStr(i),
+            m_Offsets[i + 1] - m_Offsets[i] - 1);
+    }
+
+    inline const wchar_t* CStr(size_t i) const
+    {
+        return m_Chars.data() + m_Offsets[i];
+    }
+
+    void Reserve(size_t uStrings, size_t uChars);
+    void Append(std::wstring_view str);
+    void Clear();
+
+    friend WStringTable AnsiToWcharBatch(
+        const std::vector<std::string>& texts, int cp);
+private:
+    std::vector<wchar_t> m_Chars;
+    std::vector<size_t> m_Offsets;
+};
+
+WStringTable TextToWcharBatch(const std::vector<std::string>& texts);
+WStringTable AnsiToWcharBatch(const std::vector<std::string>& texts,
+    int cp = 3);
+
+// Transcodes a stream fed in chunks of any size from one codepage to
+// another. A multibyte sequence split between chunks is carried over to
+// the next Write, invalid input is replaced with '?'. Output is passed
+// to the sink whenever the internal buffer fills up and on Flush/Finish,
+// so memory use stays at the buffer size whatever the stream length.
+class StreamTranscoder
+{
+public:
+    typedef std::function<bool(const char*, size_t)> SinkFunc;
+
+    StreamTranscoder(int fromCp, int toCp, SinkFunc sink,
+        size_t uBufSize = 65536);
+    virtual ~StreamTranscoder();
+
+    bool Write(const void* data, size_t len);
+    bool Flush();
+    bool Finish();
+
+    inline bool Failed() const { return m_bFailed; }
+private:
+    size_t Feed(const char* in, size_t len);
+    void FeedPending();
+    void FinishState();
+    void Replace();
+
+    SinkFunc m_Sink;
+    int m_iFromCp;
+    int m_iToCp;
+    void* m_pConv;
+    unsigned m_uMaxChar;
+
+    std::vector<char> m_Out;
+    size_t m_uOut;
+    std::vector<wchar_t> m_Wide;
+    std::string m_Replace;
+
+    char m_Pending[8];
+    size_t m_uPending;
+    bool m_bFailed;
+};
+
+bool TranscodeFile(FILE* in, FILE* out, int fromCp, int toCp);
+
 std::wstring TermToWchar(const std::string& text);
 std::string WcharToTerm(const std::wstring& text);
 
@@ -42,6 +148,8 @@ bool ReconnectIO(bool OpenNewConsole);
 #else
 #define CP_UTF7 65000
 #define CP_UTF8 65001
+#define CP_UCS4LE 12000
+#define CP_UCS4BE 12001
 
 #define _fseeki64 fseeko64
 #define _ftelli64 ftello64
@@ -68,6 +176,137 @@ using listdir = std::tuple<
 >;
 
 listdir ListDirectory(const std::wstring& path);
+
+#ifdef WIN32
+typedef wchar_t pathchar_t;
+#else
+typedef char pathchar_t;
+#endif
+typedef std::basic_string<pathchar_t> pathstring;
+
+/* UTF-8 paths
+ *
+ * Same functions taking UTF-8 paths. On Linux they are the actual
+ * implementation and the wide versions convert once and call them, on
+ * Windows they convert to UTF-16 and call the wide versions. */
+
+std::string JoinFilePath(std::string_view path, std::string_view name);
+// appends to out instead of allocating a new string
+void JoinFilePath(std::string_view path, std::string_view name,
+    std::string& out);
+
+FILE* OpenFileUtf8(std::string_view path, const char* mode);
+
+using listdir_utf8 = std::tuple<
+    std::vector<std::string>,
+    std::vector<std::string>
+>;
+
+listdir_utf8 ListDirectory(std::string_view path);
+
+// Read-only view of a whole file. Regular files are mapped, anything
+// that cannot be (pipes, /proc files, failed mappings) is read into an
+// owned buffer instead, so Data() works the same either way. The hint
+// is passed to madvise on Linux and to CreateFile on Windows.
+class MappedFile
+{
+public:
+    enum access {
+        AccessNormal = 0,
+        AccessSequential,
+        AccessRandom
+    };
+
+    MappedFile();
+    MappedFile(const std::wstring& path, access hint = AccessSequential);
+    virtual ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool Open(const std::wstring& path, access hint = AccessSequential);
+    bool Open(std::string_view path, access hint = AccessSequential);
+    void Close();
+
+    inline bool IsOpen() const { return m_bOpen; }
+    inline bool IsMapped() const { return m_pView != nullptr; }
+    inline size_t Size() const { return m_uSize; }
+    inline std::span<const char> Data() const
+    {
+        return std::span<const char>(m_pData, m_uSize);
+    }
+private:
+    bool OpenNative(const pathchar_t* path, access hint);
+
+    void* m_pView;
+    const char* m_pData;
+    size_t m_uSize;
+    std::vector<char> m_Copy;
+    bool m_bOpen;
+};
+
+enum direntry {
+    EntryUnknown = 0,
+    EntryFile,
+    EntryDirectory,
+    EntrySymlink,
+    EntryOther
+};
+
+// Directory entry as reported by the system. The name stays in the
+// native encoding and is only converted by Name(). Inode() is 0 on
+// Windows, where symlinks are reported as files or directories.
+class DirEntry
+{
+public:
+    DirEntry(direntry type, uint64_t uInode, const pathchar_t* pName)
+        : m_Type(type), m_uInode(uInode), m_pName(pName)
+    {
+    }
+
+    inline direntry Type() const { return m_Type; }
+    inline uint64_t Inode() const { return m_uInode; }
+    inline const pathchar_t* NativeName() const { return m_pName; }
+
+    std::wstring Name() const;
+    void Name(std::wstring& out) const;
+    std::string Utf8Name() const;
+    void Utf8Name(std::string& out) const;
+private:
+    direntry m_Type;
+    uint64_t m_uInode;
+    const pathchar_t* m_pName;
+};
+
+typedef std::function<bool(const DirEntry&)> DirEntryFunc;
+
+// Calls func for every entry except "." and "..", stops as soon as func
+// returns false. Returns false if the directory cannot be opened.
+bool EnumDirectory(const std::wstring& path, DirEntryFunc func);
+bool EnumDirectory(std::string_view path, DirEntryFunc func);
+
 uint64_t GetDirectorySize(const std::wstring& path);
+uint64_t GetDirectorySize(std::string_view path);
+// Scans subdirectories on uThreads workers, 0 means one per CPU
+uint64_t GetDirectorySize(const std::wstring& path, unsigned uThreads);
+uint64_t GetDirectorySize(std::string_view path, unsigned uThreads);
+
+#ifndef WIN32
+// Same as GetDirectorySize, uSkipped counts directories that could not
+// be opened (EACCES, EMFILE...), the size misses their whole subtree
+uint64_t GetDirectorySizeSkipped(const std::wstring& path, size_t& uSkipped);
+uint64_t GetDirectorySizeSkipped(std::string_view path, size_t& uSkipped);
+
+// Sums regular files of the directory open as fd and appends the names
+// of its subdirectories to subdirs, each terminated by '\0'
+uint64_t ScanDirectoryAt(int fd, std::string& subdirs);
+
+typedef std::function<bool(const char* name, direntry type,
+    uint64_t uSize)> DirScanFunc;
+
+// Calls func for every entry of the directory open as fd, with the size
+// of regular files and 0 for anything else. Stops when func returns false.
+bool ScanDirectoryAt(int fd, DirScanFunc func);
+#endif
 
 #endif
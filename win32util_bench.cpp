@@ -0,0 +1,775 @@
+#include "win32util.h"
+#ifndef WIN32
+#include "win32dircache.h"
+#include "win32snapshot.h"
+#include "win32uring.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+
+#ifndef WIN32
+#include <iconv.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+
+using bench_clock = std::chrono::steady_clock;
+
+struct bench_result {
+    std::string m_Name;
+    double m_dValue;
+    std::string m_Unit;
+    bool m_bOk;
+};
+
+static std::vector<bench_result> s_Results;
+static double s_dBenchTime = 0.5;
+
+// calls per second of func, run for dScale times the --time setting
+static double BenchRate(const std::function<void()>& func,
+    double dScale = 1.0)
+{
+    uint64_t uCalls = 0;
+    auto start = bench_clock::now();
+    auto deadline = start
+        + std::chrono::duration<double>(s_dBenchTime * dScale);
+    auto now = start;
+
+    do {
+        for (int i = 0; i < 256; i++)
+            func();
+        uCalls += 256;
+        now = bench_clock::now();
+    } while (now < deadline);
+
+    return uCalls / std::chrono::duration<double>(now - start).count();
+}
+
+static double Seconds(bench_clock::time_point start)
+{
+    return std::chrono::duration<double>(bench_clock::now() - start)
+        .count();
+}
+
+static void Report(const std::string& name, double dValue,
+    const char* unit = "calls/s", bool bOk = true)
+{
+    int iDigits = dValue < 100 ? 3 : dValue < 10000 ? 1 : 0;
+    printf("%-36s %14.*f %s%s\n", name.c_str(), iDigits, dValue, unit,
+        bOk ? "" : " MISMATCH");
+    s_Results.push_back({ name, dValue, unit, bOk });
+}
+
+static std::string JsonString(const std::string& text)
+{
+    std::string out = "\"";
+    for (char ch : text)
+    {
+        if (ch == '"' || ch == '\\')
+            out += '\\';
+        out += ch;
+    }
+    return out + "\"";
+}
+
+struct bench_tree {
+    size_t m_uFiles;
+    size_t m_uFilesPerDir;
+    size_t m_uSubdirs;
+};
+
+static bool WriteJson(const char* path, const bench_tree& tree)
+{
+    FILE* fp = fopen(path, "w");
+    if (!fp)
+        return false;
+
+    fprintf(fp, "{\n  \"platform\": \"%s\",\n", IsWindowsSystem()
+        ? "windows" : "linux");
+    fprintf(fp, "  \"time\": %g,\n", s_dBenchTime);
+    fprintf(fp, "  \"tree\": { \"files\": %zu, \"files_per_dir\": %zu, "
+        "\"subdirs\": %zu },\n", tree.m_uFiles, tree.m_uFilesPerDir,
+        tree.m_uSubdirs);
+    fprintf(fp, "  \"results\": [\n");
+    for (size_t i = 0; i < s_Results.size(); i++)
+    {
+        auto& result = s_Results[i];
+        fprintf(fp, "    { \"name\": %s, \"value\": %.10g, "
+            "\"unit\": %s, \"ok\": %s }%s\n",
+            JsonString(result.m_Name).c_str(),
+            std::isfinite(result.m_dValue) ? result.m_dValue : 0.0,
+            JsonString(result.m_Unit).c_str(),
+            result.m_bOk ? "true" : "false",
+            i + 1 < s_Results.size() ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+
+    return !fclose(fp);
+}
+
+#ifndef WIN32
+// what every conversion did before converters were cached
+static std::wstring UncachedTextToWchar(const std::string& text)
+{
+    std::wstring out(text.size() + 1, L'\0');
+    char* in = (char*)text.c_str(), *pOut = (char*)out.data();
+    size_t inLen = text.size() + 1, outLen = out.size() * sizeof(wchar_t);
+
+    iconv_t cv = iconv_open(ArchInternalUCS(), "UTF-8");
+    iconv(cv, &in, &inLen, &pOut, &outLen);
+    iconv_close(cv);
+
+    out.resize(out.size() - outLen / sizeof(wchar_t) - 1);
+    return out;
+}
+
+static std::string UncachedWcharToText(const std::wstring& text)
+{
+    std::string out((text.size() + 1) * 4, '\0');
+    char* in = (char*)text.c_str(), *pOut = out.data();
+    size_t inLen = (text.size() + 1) * sizeof(wchar_t), outLen = out.size();
+
+    iconv_t cv = iconv_open("UTF-8", ArchInternalUCS());
+    iconv(cv, &in, &inLen, &pOut, &outLen);
+    iconv_close(cv);
+
+    out.resize(out.size() - outLen - 1);
+    return out;
+}
+
+// ASCII runs of every length around the SIMD block sizes, broken by
+// multibyte characters, must convert exactly like plain iconv does
+static bool VerifyConversions()
+{
+    const char* breaks[] = { "\xD0\x96", "\xE2\x82\xAC",
+        "\xF0\x9F\x98\x80", "\x7F" };
+    unsigned uChecked = 0;
+
+    for (unsigned uPrefix = 0; uPrefix < 100; uPrefix++)
+    {
+        for (const char* brk : breaks)
+        {
+            std::string text;
+            for (unsigned i = 0; i < uPrefix; i++)
+                text += (char)('a' + i % 26);
+            text += brk;
+            for (unsigned i = 0; i < uPrefix % 37; i++)
+                text += (char)('0' + i % 10);
+
+            std::wstring wide = UncachedTextToWchar(text);
+            if (TextToWchar(text) != wide
+                || WcharToText(wide) != UncachedWcharToText(wide))
+            {
+                printf("verify: mismatch on \"%s\"\n", text.c_str());
+                return false;
+            }
+            uChecked++;
+        }
+    }
+
+    printf("verify: %u mixed inputs match iconv\n", uChecked);
+    return true;
+}
+
+// every byte iconv can decode must decode and encode back the same way
+static bool VerifyCodepages()
+{
+    const int pages[] = { 866, 1250, 1251, 1252, 1253,
+        1254, 1255, 1256, 1257, 1258 };
+
+    for (int cp : pages)
+    {
+        std::string codeset = "CP" + std::to_string(cp);
+        iconv_t cv = iconv_open(ArchInternalUCS(), codeset.c_str());
+
+        for (unsigned c = 0x80; c < 0x100; c++)
+        {
+            char chIn = (char)c, *in = &chIn;
+            wchar_t wc = 0;
+            char* out = (char*)&wc;
+            size_t inLen = 1, outLen = sizeof(wc);
+
+            iconv(cv, NULL, NULL, NULL, NULL);
+            // CP1255/CP1258 hold back base letters awaiting a combining
+            // mark, the second call flushes them
+            if (iconv(cv, &in, &inLen, &out, &outLen) == (size_t)-1
+                || iconv(cv, NULL, NULL, &out, &outLen) == (size_t)-1)
+                continue;
+
+            std::string ansi(1, chIn);
+            if (AnsiToWchar(ansi, cp) != std::wstring(1, wc)
+                || WcharToAnsi(std::wstring(1, wc), cp) != ansi)
+            {
+                printf("verify: CP%d mismatch on 0x%02X\n", cp, c);
+                iconv_close(cv);
+                return false;
+            }
+        }
+        iconv_close(cv);
+    }
+
+    printf("verify: single-byte codepages match iconv\n");
+    return true;
+}
+
+static std::wstring IconvDecode(const char* codeset, const std::string& text)
+{
+    iconv_t cv = iconv_open(ArchInternalUCS(), codeset);
+    std::wstring out(text.size() * 4 + 4, L'\0');
+    char* in = (char*)text.data(), *pOut = (char*)out.data();
+    size_t inLen = text.size(), outLen = out.size() * sizeof(wchar_t);
+    iconv(cv, &in, &inLen, &pOut, &outLen);
+    iconv_close(cv);
+    out.resize((pOut - (char*)out.data()) / sizeof(wchar_t));
+    return out;
+}
+
+// Pages that do not keep ASCII as is must not take the ASCII fast path:
+// EBCDIC, where 'A' is 0xC1 and 0x41 a no-break space, and UTF-7, where
+// '+' starts a base64 run.
+static bool VerifyNonAsciiPages()
+{
+    std::string bytes;
+    for (unsigned c = 0x40; c < 0x100; c++)
+        bytes += (char)c;
+
+    for (int cp : { 500, 1026 })
+    {
+        std::string codeset = "CP" + std::to_string(cp);
+        std::wstring wide = IconvDecode(codeset.c_str(), bytes);
+        if (AnsiToWchar(bytes, cp) != wide
+            || WcharToAnsi(wide, cp) != bytes)
+        {
+            printf("verify: CP%d mismatch\n", cp);
+            return false;
+        }
+    }
+
+    if (AnsiToWchar("+BB8-", CP_UTF7) != IconvDecode("UTF-7", "+BB8-")
+        || AnsiToWchar("A+-B", CP_UTF7) != L"A+B"
+        || WcharToAnsi(L"A+B", CP_UTF7) != "A+-B")
+    {
+        printf("verify: UTF-7 mismatch\n");
+        return false;
+    }
+
+    printf("verify: EBCDIC and UTF-7 match iconv\n");
+    return true;
+}
+#endif
+
+static void BenchConversions()
+{
+    std::string name = "some_directory_entry.txt";
+    std::wstring wname = TextToWchar(name);
+    std::string ansi = WcharToAnsi(wname);
+
+#ifndef WIN32
+    Report("TextToWchar (uncached iconv)",
+        BenchRate([&]() { UncachedTextToWchar(name); }));
+#endif
+    Report("TextToWchar", BenchRate([&]() { TextToWchar(name); }));
+    Report("WcharToText", BenchRate([&]() { WcharToText(wname); }));
+    Report("AnsiToWchar", BenchRate([&]() { AnsiToWchar(ansi); }));
+    Report("WcharToAnsi", BenchRate([&]() { WcharToAnsi(wname); }));
+
+    std::string path;
+    for (int i = 0; i < 16; i++)
+        path += "/usr/share/some_directory_entry";
+    std::wstring wpath = TextToWchar(path);
+
+#ifndef WIN32
+    Report("TextToWchar 512 (iconv)",
+        BenchRate([&]() { UncachedTextToWchar(path); }));
+#endif
+    Report("TextToWchar 512", BenchRate([&]() { TextToWchar(path); }));
+    Report("WcharToText 512", BenchRate([&]() { WcharToText(wpath); }));
+
+    std::wstring wbuf;
+    std::string buf;
+    Report("TextToWchar 512 (reused)",
+        BenchRate([&]() { TextToWchar(path, wbuf); }));
+    Report("WcharToText 512 (reused)",
+        BenchRate([&]() { WcharToText(wpath, buf); }));
+
+    std::wstring wcyr = TextToWchar("\xD0\x9F\xD1\x80\xD0\xB8\xD0\xB2"
+        "\xD0\xB5\xD1\x82, \xD0\xBC\xD0\xB8\xD1\x80");
+    std::string cyr = WcharToAnsi(wcyr, 1251);
+    Report("AnsiToWchar 1251", BenchRate([&]() { AnsiToWchar(cyr); }));
+    Report("WcharToAnsi 1251", BenchRate([&]() { WcharToAnsi(wcyr); }));
+}
+
+// uChars characters of ASCII, Cyrillic or mixed text
+static std::wstring MakeInput(const char* kind, size_t uChars)
+{
+    std::string pattern = !strcmp(kind, "ascii")
+        ? "some_directory/entry_2024.txt "
+        : !strcmp(kind, "cyrillic")
+        ? "\xD0\x9F\xD1\x80\xD0\xB8\xD0\xB2\xD0\xB5\xD1\x82 "
+          "\xD0\xBC\xD0\xB8\xD1\x80 "
+        : "report_\xD0\x9E\xD1\x82\xD1\x87\xD1\x91\xD1\x82_2024.txt ";
+    std::wstring unit = TextToWchar(pattern), text;
+
+    while (text.size() < uChars)
+        text += unit;
+    text.resize(uChars);
+    return text;
+}
+
+static void BenchConversionMatrix()
+{
+    for (const char* kind : { "ascii", "cyrillic", "mixed" })
+    {
+        for (size_t uChars : { 16, 256, 4096 })
+        {
+            std::wstring wide = MakeInput(kind, uChars);
+            std::string text = WcharToText(wide);
+            std::string ansi = WcharToAnsi(wide, 1251);
+            std::wstring wout;
+            std::string out;
+
+            std::vector<std::pair<const char*, std::function<void()>>>
+                funcs = {
+                { "TextToWchar", [&]() { TextToWchar(text); } },
+                { "TextToWchar reused", [&]() { TextToWchar(text, wout); } },
+                { "WcharToText", [&]() { WcharToText(wide); } },
+                { "WcharToText reused", [&]() { WcharToText(wide, out); } },
+                { "AnsiToWchar 1251", [&]() { AnsiToWchar(ansi, 1251); } },
+                { "WcharToAnsi 1251", [&]() { WcharToAnsi(wide, 1251); } },
+            };
+
+            for (auto& [name, func] : funcs)
+            {
+                Report(std::string(name) + " " + kind + " "
+                    + std::to_string(uChars),
+                    BenchRate(func, 0.4) * uChars / 1e6, "Mchar/s");
+            }
+        }
+    }
+}
+
+static void BenchBatch()
+{
+    std::vector<std::string> names;
+    for (int i = 0; i < 10000; i++)
+        names.push_back("entry_" + std::to_string(i) + ".dat");
+
+    Report("TextToWchar x10000", BenchRate([&]() {
+        std::vector<std::wstring> wide;
+        wide.reserve(names.size());
+        for (auto& name : names)
+            wide.push_back(TextToWchar(name));
+    }, 2.0));
+    Report("TextToWcharBatch x10000", BenchRate([&]() {
+        TextToWcharBatch(names);
+    }, 2.0));
+}
+
+static void BenchStream(size_t uSize)
+{
+    std::wstring line = TextToWchar("2024-01-01 12:00:00 [INFO] "
+        "\xD0\x9E\xD0\xBF\xD0\xB5\xD1\x80\xD0\xB0\xD1\x86\xD0\xB8"
+        "\xD1\x8F \xD0\xB7\xD0\xB0\xD0\xB2\xD0\xB5\xD1\x80\xD1\x88"
+        "\xD0\xB5\xD0\xBD\xD0\xB0 id=12345\n");
+    std::string chunk;
+    while (chunk.size() < 65536)
+        chunk += WcharToAnsi(line, 1251);
+
+    uint64_t uOut = 0;
+    StreamTranscoder stream(1251, CP_UTF8,
+        [&uOut](const char* data, size_t len) {
+            uOut += len;
+            return true;
+        }
+    );
+
+    size_t uIn = 0;
+    auto start = bench_clock::now();
+    for (; uIn < uSize; uIn += chunk.size())
+        stream.Write(chunk.data(), chunk.size());
+    stream.Finish();
+    Report("StreamTranscoder 1251->UTF-8",
+        uIn / Seconds(start) / 1048576, "MB/s");
+}
+
+static uint64_t Checksum(const char* data, size_t len)
+{
+    uint64_t uSum = 0;
+    for (size_t i = 0; i < len; i++)
+        uSum += (unsigned char)data[i];
+    return uSum;
+}
+
+// both readers run on a file already in the page cache, so this
+// measures the copy through stdio against touching mapped pages
+static void BenchMappedFile(size_t uSize)
+{
+    auto file = std::filesystem::temp_directory_path()
+        / "win32util_bench.dat";
+    std::vector<char> chunk(65536);
+    for (size_t i = 0; i < chunk.size(); i++)
+        chunk[i] = (char)(i * 2654435761u >> 24);
+
+    FILE* fp = fopen(file.string().c_str(), "wb");
+    if (!fp)
+        return;
+    for (size_t uDone = 0; uDone < uSize; uDone += chunk.size())
+        fwrite(chunk.data(), 1, chunk.size(), fp);
+    fclose(fp);
+
+    for (int iPass = 0; iPass < 2; iPass++)
+    {
+        uint64_t uSum = 0, uLen = 0;
+        auto start = bench_clock::now();
+        fp = fopen(file.string().c_str(), "rb");
+        size_t uRead;
+        while ((uRead = fread(chunk.data(), 1, chunk.size(), fp)) > 0)
+        {
+            uSum += Checksum(chunk.data(), uRead);
+            uLen += uRead;
+        }
+        fclose(fp);
+        double dRead = Seconds(start);
+
+        start = bench_clock::now();
+        MappedFile mapped(file.wstring());
+        auto data = mapped.Data();
+        uint64_t uMappedSum = Checksum(data.data(), data.size());
+        double dMap = Seconds(start);
+
+        // the first pass only warms the cache
+        if (!iPass)
+            continue;
+        Report("fread 64K", uLen / dRead / 1048576, "MB/s");
+        Report(mapped.IsMapped() ? "MappedFile" : "MappedFile (read)",
+            data.size() / dMap / 1048576, "MB/s",
+            uMappedSum == uSum && data.size() == uLen);
+    }
+
+    std::filesystem::remove(file);
+}
+
+// Generates tree.m_uFiles files of 1..4096 bytes, filling directories
+// breadth-first with m_uFilesPerDir files and m_uSubdirs subdirectories
+// each. Returns their total size, entries counts files and directories.
+static uint64_t MakeTree(const std::filesystem::path& root,
+    const bench_tree& tree, size_t& uEntries)
+{
+    std::vector<std::filesystem::path> dirs = { root };
+    std::vector<char> data(4096, 'x');
+    size_t uPerDir = std::max<size_t>(tree.m_uFilesPerDir, 1);
+    uint64_t uTotal = 0;
+
+    uEntries = 0;
+    std::filesystem::create_directories(root);
+    for (size_t i = 0, uDir = 0; i < tree.m_uFiles && uDir < dirs.size();
+        uDir++)
+    {
+        auto dir = dirs[uDir];
+        for (size_t j = 0; j < uPerDir && i < tree.m_uFiles; j++, i++)
+        {
+            size_t uSize = 1 + (i * 2654435761u) % data.size();
+            FILE* fp = fopen((dir / ("f" + std::to_string(j))).string()
+                .c_str(), "wb");
+            if (!fp)
+                continue;
+            fwrite(data.data(), 1, uSize, fp);
+            fclose(fp);
+            uTotal += uSize;
+            uEntries++;
+        }
+        for (size_t j = 0; j < tree.m_uSubdirs && i < tree.m_uFiles; j++)
+        {
+            dirs.push_back(dir / ("d" + std::to_string(j)));
+            std::filesystem::create_directory(dirs.back());
+            uEntries++;
+        }
+    }
+
+    return uTotal;
+}
+
+template<typename S>
+static size_t ListTree(const S& path)
+{
+    auto [files, dirs] = ListDirectory(path);
+    size_t uCount = files.size() + dirs.size();
+
+    for (auto& dir : dirs)
+        uCount += ListTree(S(JoinFilePath(path, dir)));
+    return uCount;
+}
+
+static void BenchListDirectory(const std::filesystem::path& root,
+    size_t uEntries)
+{
+    auto start = bench_clock::now();
+    size_t uCount = ListTree(root.wstring());
+    Report("ListDirectory tree", uCount / Seconds(start), "entries/s",
+        uCount == uEntries);
+
+    start = bench_clock::now();
+    uCount = ListTree(root.string());
+    Report("ListDirectory tree (UTF-8)", uCount / Seconds(start),
+        "entries/s", uCount == uEntries);
+}
+
+#ifndef WIN32
+// needs root, cold runs are skipped otherwise
+static bool DropCaches()
+{
+    sync();
+    FILE* fp = fopen("/proc/sys/vm/drop_caches", "w");
+    if (!fp)
+        return false;
+    bool bOk = fputs("3", fp) >= 0;
+    return !fclose(fp) && bOk;
+}
+
+static void BenchRingDirectorySize(const std::wstring& root,
+    size_t uFiles, uint64_t uExpected)
+{
+    if (!MetadataRing::IsSupported())
+    {
+        printf("%-36s %14s\n", "MetadataRing", "unsupported");
+        return;
+    }
+
+    bool bCold = DropCaches();
+    if (!bCold)
+        printf("%-36s %14s\n", "cold cache", "skipped");
+
+    std::vector<std::pair<std::string, std::function<uint64_t()>>> walkers = {
+        { "GetDirectorySize", [&]() { return GetDirectorySize(root); } },
+    };
+    for (unsigned uDepth : { 8u, 64u, 256u })
+    {
+        walkers.emplace_back("MetadataRing depth " + std::to_string(uDepth),
+            [&root, uDepth]() { return GetDirectorySizeUring(root, uDepth); });
+    }
+
+    for (int iCold = bCold; iCold >= 0; iCold--)
+    {
+        for (auto& [name, walk] : walkers)
+        {
+            if (iCold && !DropCaches())
+                continue;
+
+            auto start = bench_clock::now();
+            uint64_t uSize = walk();
+            Report(name + (iCold ? " (cold)" : " (warm)"),
+                uFiles / Seconds(start), "files/s", uSize == uExpected);
+        }
+    }
+}
+
+static void BenchSnapshot(const std::filesystem::path& root,
+    uint64_t uExpected)
+{
+    std::wstring file = (root.parent_path() / "win32util_bench.snap")
+        .wstring();
+
+    auto start = bench_clock::now();
+    bool bOk = DirSnapshot::Write(root.wstring(), file);
+    double dWrite = Seconds(start);
+
+    DirSnapshot snap;
+    start = bench_clock::now();
+    bOk = bOk && snap.Open(file);
+    double dOpen = Seconds(start);
+
+    if (!bOk)
+    {
+        Report("DirSnapshot::Write", 0, "entries/s", false);
+        return;
+    }
+    Report("DirSnapshot::Write", snap.Count() / dWrite, "entries/s",
+        snap.Size(snap.Root()) == uExpected);
+    Report("DirSnapshot::Open", dOpen * 1000, "ms");
+
+    std::vector<std::string> paths;
+    for (uint32_t i = 0; i < snap.Count(); i += 97)
+        paths.push_back(snap.Path(i));
+    size_t uNext = 0;
+    Report("DirSnapshot::Lookup", BenchRate([&]() {
+        snap.Lookup(paths[uNext++ % paths.size()]);
+    }));
+
+    std::filesystem::remove(file);
+}
+#endif
+
+#ifndef WIN32
+// Watched cache, then subdirectories moved between two watched parents
+// in both directions, so one of the old parents is walked after the new
+// one whichever order readdir gives; files written into the moved
+// directories have to show up. Leaves the tree changed.
+static void BenchDirSizeCache(const std::filesystem::path& root,
+    uint64_t uExpected)
+{
+    DirSizeCache cache;
+    std::wstring wroot = root.wstring();
+    bool bWatch = cache.Watch();
+    bool bOk = cache.GetSize(wroot) == uExpected;
+    Report("DirSizeCache (watched)", BenchRate([&]() {
+        cache.GetSize(wroot);
+    }), "calls/s", bWatch && bOk && cache.GetSize(wroot) == uExpected);
+
+    auto d0 = root / "d0", d1 = root / "d1";
+    if (!std::filesystem::exists(d0 / "d0")
+        || !std::filesystem::exists(d1 / "d0"))
+        return;
+    std::filesystem::rename(d0 / "d0", d1 / "moved");
+    std::filesystem::rename(d1 / "d0", d0 / "moved");
+    bool bMoved = cache.GetSize(wroot) == uExpected;
+
+    std::vector<char> data(1000, 'y');
+    for (auto& dir : { d0, d1 })
+    {
+        FILE* fp = fopen((dir / "moved" / "new").string().c_str(), "wb");
+        if (fp)
+        {
+            fwrite(data.data(), 1, data.size(), fp);
+            fclose(fp);
+        }
+    }
+    bMoved = bMoved && cache.GetSize(wroot) == uExpected + 2000;
+    Report("DirSizeCache moved subdirectories", 2, "dirs", bMoved);
+}
+#endif
+
+#ifndef WIN32
+// A chain of nested directories deeper than the descriptors left under
+// a lowered RLIMIT_NOFILE: the walk cannot open the bottom of it and
+// has to say so instead of returning a short size quietly.
+static void BenchSkippedDirectories(const std::filesystem::path& root)
+{
+    auto dir = root / "deep";
+    for (int i = 0; i < 32; i++)
+    {
+        dir /= "d";
+        std::filesystem::create_directories(dir);
+        FILE* fp = fopen((dir / "f").string().c_str(), "wb");
+        if (fp)
+        {
+            fputc('x', fp);
+            fclose(fp);
+        }
+    }
+
+    size_t uSkipped = 0;
+    uint64_t uFull = GetDirectorySizeSkipped((root / "deep").string(),
+        uSkipped);
+    bool bOk = uFull == 32 && !uSkipped;
+
+    // room for a few levels above what is open already
+    size_t uOpen = 0;
+    for (auto& ent : std::filesystem::directory_iterator("/proc/self/fd"))
+    {
+        (void)ent;
+        uOpen++;
+    }
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    struct rlimit low = limit;
+    low.rlim_cur = uOpen + 8;
+    if (!setrlimit(RLIMIT_NOFILE, &low))
+    {
+        uint64_t uShort = GetDirectorySizeSkipped((root / "deep").string(),
+            uSkipped);
+        setrlimit(RLIMIT_NOFILE, &limit);
+        bOk = bOk && uShort < uFull && uSkipped == 1;
+    }
+    Report("GetDirectorySize skipped directories", (double)uSkipped, "dirs",
+        bOk);
+    std::filesystem::remove_all(root / "deep");
+}
+#endif
+
+static void BenchDirectoryTree(const bench_tree& tree)
+{
+    auto root = std::filesystem::temp_directory_path() / "win32util_bench";
+    std::filesystem::remove_all(root);
+    size_t uEntries = 0;
+    uint64_t uExpected = MakeTree(root, tree, uEntries);
+    std::wstring wroot = root.wstring();
+    size_t uFiles = tree.m_uFiles;
+
+    BenchListDirectory(root, uEntries);
+
+    for (unsigned uThreads : { 1u, 2u, 4u, 8u })
+    {
+        auto start = bench_clock::now();
+        uint64_t uSize = GetDirectorySize(wroot, uThreads);
+
+        char szName[64];
+        snprintf(szName, sizeof(szName), "GetDirectorySize %u thread%s",
+            uThreads, uThreads > 1 ? "s" : "");
+        Report(szName, uFiles / Seconds(start), "files/s",
+            uSize == uExpected);
+    }
+
+    std::string root8 = root.string();
+    auto start = bench_clock::now();
+    uint64_t uSize = GetDirectorySize(root8);
+    Report("GetDirectorySize (UTF-8)", uFiles / Seconds(start), "files/s",
+        uSize == uExpected);
+
+#ifndef WIN32
+    BenchRingDirectorySize(wroot, uFiles, uExpected);
+    BenchSnapshot(root, uExpected);
+    BenchDirSizeCache(root, uExpected);
+    BenchSkippedDirectories(root);
+#endif
+    std::filesystem::remove_all(root);
+}
+
+int main(int argc, char** argv)
+{
+    bench_tree tree = { 20000, 16, 16 };
+    const char* json = NULL;
+
+    for (int i = 1; i + 1 < argc; i++)
+    {
+        if (!strcmp(argv[i], "--tree-files"))
+            tree.m_uFiles = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--tree-files-per-dir"))
+            tree.m_uFilesPerDir = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--tree-subdirs"))
+            tree.m_uSubdirs = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--time"))
+            s_dBenchTime = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--json"))
+            json = argv[++i];
+    }
+
+#ifndef WIN32
+    if (!VerifyConversions() || !VerifyCodepages() || !VerifyNonAsciiPages())
+        return 1;
+#endif
+    BenchConversions();
+    BenchConversionMatrix();
+    BenchBatch();
+    BenchStream(256 * 1024 * 1024);
+    BenchMappedFile(256 * 1024 * 1024);
+    BenchDirectoryTree(tree);
+
+    if (json && !WriteJson(json, tree))
+    {
+        printf("cannot write %s\n", json);
+        return 1;
+    }
+
+    for (auto& result : s_Results)
+        if (!result.m_bOk)
+            return 1;
+    return 0;
+}
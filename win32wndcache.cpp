@@ -0,0 +1,244 @@
+#include "win32wndcache.h"
+#include "win32ctrl.h"
+
+#include <ctype.h>
+
+static std::string ClassKey(const std::string& wndClass)
+{
+    std::string key = wndClass;
+    for (char& ch : key)
+        ch = (char)tolower((unsigned char)ch);
+    return key;
+}
+
+bool AppWindowCache::SameClass(const std::string& wndClass,
+    const std::string& other)
+{
+    return wndClass.size() == other.size()
+        && ClassKey(wndClass) == ClassKey(other);
+}
+
+AppWindowCache::AppWindowCache(AppMonitor* app)
+    : m_pApp(app), m_uGeneration(0), m_bValid(false), m_dwMaxAge(1000),
+    m_bRefreshOnMiss(true), m_bValidate(true), m_uRefreshes(0),
+    m_uQueried(0)
+{
+}
+
+AppWindowCache::~AppWindowCache()
+{
+}
+
+void AppWindowCache::SetMaxAge(DWORD dwMs)
+{
+    m_dwMaxAge = dwMs;
+}
+
+void AppWindowCache::SetRefreshOnMiss(bool bRefresh)
+{
+    m_bRefreshOnMiss = bRefresh;
+}
+
+void AppWindowCache::SetValidate(bool bValidate)
+{
+    m_bValidate = bValidate;
+}
+
+void AppWindowCache::Invalidate()
+{
+    m_bValid = false;
+}
+
+void AppWindowCache::Clear()
+{
+    m_Windows.clear();
+    m_Foreign.clear();
+    m_ByClass.clear();
+    m_ByParent.clear();
+    m_bValid = false;
+}
+
+bool AppWindowCache::Fresh() const
+{
+    if (!m_bValid)
+        return false;
+    if (m_dwMaxAge == INFINITE)
+        return true;
+    return std::chrono::steady_clock::now() - m_Taken
+        < std::chrono::milliseconds(m_dwMaxAge);
+}
+
+unsigned AppWindowCache::ClassId(const std::string& wndClass, bool bAdd)
+{
+    std::string key = ClassKey(wndClass);
+    auto it = m_ClassIds.find(key);
+    if (it != m_ClassIds.end())
+        return it->second;
+    if (!bAdd)
+        return 0;
+
+    // ids start at 1, 0 is a class nobody has
+    m_Classes.push_back(wndClass);
+    unsigned uId = (unsigned)m_Classes.size();
+    m_ClassIds.emplace(std::move(key), uId);
+    return uId;
+}
+
+void AppWindowCache::Visit(HWND hWnd, bool bTop, std::vector<HWND>& order)
+{
+    auto it = m_Windows.find(hWnd);
+    if (it == m_Windows.end())
+    {
+        AppBackend* pBackend = m_pApp->GetBackend();
+        wndinfo info;
+        info.m_hParent = bTop ? NULL : pBackend->WindowParent(hWnd);
+        info.m_dwPid = m_pApp->GetAppProcessId();
+        info.m_uClass = ClassId(pBackend->WindowClass(hWnd), true);
+        it = m_Windows.emplace(hWnd, info).first;
+        m_uQueried++;
+    }
+
+    it->second.m_uSeen = m_uGeneration;
+    order.push_back(hWnd);
+}
+
+void AppWindowCache::Refresh()
+{
+    AppBackend* pBackend = m_pApp->GetBackend();
+    DWORD dwPid = m_pApp->GetAppProcessId();
+    std::vector<HWND> order;
+
+    m_uGeneration++;
+    m_uQueried = 0;
+
+    pBackend->EnumTopWindows([&](HWND hWnd) {
+        auto foreign = m_Foreign.find(hWnd);
+        if (foreign != m_Foreign.end())
+        {
+            foreign->second = m_uGeneration;
+            return true;
+        }
+
+        if (!m_Windows.count(hWnd))
+        {
+            DWORD dwOwner = pBackend->WindowProcessId(hWnd);
+            if (!dwOwner)
+                return true;
+            if (dwOwner != dwPid)
+            {
+                m_Foreign[hWnd] = m_uGeneration;
+                m_uQueried++;
+                return true;
+            }
+        }
+
+        Visit(hWnd, true, order);
+        pBackend->EnumChildren(hWnd, [&](HWND hChild) {
+            Visit(hChild, false, order);
+            return true;
+        });
+        return true;
+    });
+
+    // whatever was not enumerated this time is gone
+    for (auto it = m_Windows.begin(); it != m_Windows.end(); )
+        it = it->second.m_uSeen != m_uGeneration ? m_Windows.erase(it)
+            : std::next(it);
+    for (auto it = m_Foreign.begin(); it != m_Foreign.end(); )
+        it = it->second != m_uGeneration ? m_Foreign.erase(it)
+            : std::next(it);
+
+    m_ByClass.clear();
+    m_ByParent.clear();
+    for (HWND hWnd : order)
+    {
+        const wndinfo& info = m_Windows[hWnd];
+        m_ByClass[{ info.m_hParent, info.m_uClass }].push_back(hWnd);
+        m_ByParent[info.m_hParent].push_back(hWnd);
+    }
+
+    m_Taken = std::chrono::steady_clock::now();
+    m_bValid = true;
+    m_uRefreshes++;
+}
+
+bool AppWindowCache::Alive(HWND hWnd)
+{
+    // a handle reused by the same process may belong to another class
+    auto it = m_Windows.find(hWnd);
+    AppBackend* pBackend = m_pApp->GetBackend();
+    return it != m_Windows.end()
+        && pBackend->WindowProcessId(hWnd) == it->second.m_dwPid
+        && ClassId(pBackend->WindowClass(hWnd), false)
+            == it->second.m_uClass;
+}
+
+HWND AppWindowCache::Lookup(HWND hParent, const std::string& wndClass,
+    const std::wstring* wndText)
+{
+    bool bRefreshed = false;
+    if (!Fresh())
+    {
+        Refresh();
+        bRefreshed = true;
+    }
+
+    for (;;)
+    {
+        auto it = m_ByClass.find({ hParent, ClassId(wndClass, false) });
+        if (it != m_ByClass.end())
+        {
+            for (HWND hWnd : it->second)
+            {
+                if (m_bValidate && !Alive(hWnd))
+                    continue;
+
+                std::wstring text;
+                if (wndText && (!m_pApp->GetBackend()->WindowText(hWnd, text)
+                    || text != *wndText))
+                {
+                    continue;
+                }
+                return hWnd;
+            }
+        }
+
+        if (bRefreshed || !m_bRefreshOnMiss)
+            return NULL;
+        Refresh();
+        bRefreshed = true;
+    }
+}
+
+HWND AppWindowCache::FindAppWindow(const std::string& wndClass)
+{
+    return Lookup(NULL, wndClass, NULL);
+}
+
+HWND AppWindowCache::FindChild(HWND hParent, const std::string& wndClass,
+    const std::wstring& wndText)
+{
+    return Lookup(hParent, wndClass, wndText.empty() ? NULL : &wndText);
+}
+
+std::vector<HWND> AppWindowCache::Children(HWND hParent)
+{
+    if (!Fresh())
+        Refresh();
+
+    auto it = m_ByParent.find(hParent);
+    return it != m_ByParent.end() ? it->second : std::vector<HWND>();
+}
+
+std::string AppWindowCache::WindowClass(HWND hWnd) const
+{
+    auto it = m_Windows.find(hWnd);
+    return it != m_Windows.end() ? m_Classes[it->second.m_uClass - 1]
+        : std::string();
+}
+
+HWND AppWindowCache::WindowParent(HWND hWnd) const
+{
+    auto it = m_Windows.find(hWnd);
+    return it != m_Windows.end() ? it->second.m_hParent : NULL;
+}
@@ -0,0 +1,116 @@
+#ifndef __WIN32WNDCACHE_H
+#define __WIN32WNDCACHE_H
+
+#include "win32types.h"
+#include <stdint.h>
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class AppMonitor;
+
+// Snapshot of an application's window tree: every window it owns with
+// its parent, process and class, indexed by (parent, class) and by
+// parent, so FindAppWindow and FindChild are hash lookups instead of a
+// walk over the desktop asking each window for its class.
+//
+// A window's class, parent and process are read once, when it is first
+// seen; Refresh() enumerates the handles again and only queries windows
+// that are new, windows of other processes included. Class names are
+// matched case-insensitively, as FindWindowEx does.
+//
+// Staleness: a snapshot older than SetMaxAge() is refreshed before the
+// next lookup (0 refreshes every time, INFINITE never), a lookup that
+// misses refreshes once with SetRefreshOnMiss(), and with SetValidate()
+// every hit is checked to still be alive, with the same process and
+// class, at the cost of two queries.
+//
+// Not thread-safe, use one cache per thread or lock around it.
+class AppWindowCache
+{
+public:
+    AppWindowCache(AppMonitor* app);
+    virtual ~AppWindowCache();
+
+    void SetMaxAge(DWORD dwMs);
+    void SetRefreshOnMiss(bool bRefresh);
+    void SetValidate(bool bValidate);
+
+    void Refresh();
+    // the next lookup refreshes
+    void Invalidate();
+    void Clear();
+
+    // top-level window of the application, first in enumeration order
+    HWND FindAppWindow(const std::string& wndClass);
+    // direct child, wndText is compared on the live window
+    HWND FindChild(HWND hParent, const std::string& wndClass,
+        const std::wstring& wndText = L"");
+    // direct children in enumeration order, NULL for the top-level ones
+    std::vector<HWND> Children(HWND hParent);
+
+    std::string WindowClass(HWND hWnd) const;
+    HWND WindowParent(HWND hWnd) const;
+
+    // class names compare like FindWindowEx compares them
+    static bool SameClass(const std::string& wndClass,
+        const std::string& other);
+
+    inline size_t Windows() const { return m_Windows.size(); }
+    inline size_t Refreshes() const { return m_uRefreshes; }
+    // windows queried by the last Refresh
+    inline size_t Queried() const { return m_uQueried; }
+private:
+    struct wndkey {
+        HWND m_hParent;
+        unsigned m_uClass;
+
+        bool operator==(const wndkey& other) const
+        {
+            return m_hParent == other.m_hParent
+                && m_uClass == other.m_uClass;
+        }
+    };
+
+    struct wndkey_hash {
+        size_t operator()(const wndkey& key) const
+        {
+            return std::hash<uintptr_t>()((uintptr_t)key.m_hParent * 31
+                + key.m_uClass);
+        }
+    };
+
+    struct wndinfo {
+        HWND m_hParent = NULL;
+        DWORD m_dwPid = 0;
+        unsigned m_uClass = 0;
+        uint64_t m_uSeen = 0;
+    };
+
+    bool Fresh() const;
+    void Visit(HWND hWnd, bool bTop, std::vector<HWND>& order);
+    unsigned ClassId(const std::string& wndClass, bool bAdd);
+    bool Alive(HWND hWnd);
+    HWND Lookup(HWND hParent, const std::string& wndClass,
+        const std::wstring* wndText);
+
+    AppMonitor* m_pApp;
+    std::unordered_map<HWND, wndinfo> m_Windows;
+    std::unordered_map<HWND, uint64_t> m_Foreign;
+    std::unordered_map<wndkey, std::vector<HWND>, wndkey_hash> m_ByClass;
+    std::unordered_map<HWND, std::vector<HWND>> m_ByParent;
+    std::unordered_map<std::string, unsigned> m_ClassIds;
+    std::vector<std::string> m_Classes;
+
+    std::chrono::steady_clock::time_point m_Taken;
+    uint64_t m_uGeneration;
+    bool m_bValid;
+    DWORD m_dwMaxAge;
+    bool m_bRefreshOnMiss;
+    bool m_bValidate;
+    size_t m_uRefreshes;
+    size_t m_uQueried;
+};
+
+#endif